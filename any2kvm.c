@@ -0,0 +1,2124 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+compile:
+
+gcc -std=c99 -Wall -Werror -pthread -o any2kvm any2kvm.c
+
+The converters (vhd, vhdx, vmfssparse, sesparse, vmdk, qcow2, flat) must
+be built in the same directory, any2kvm runs them to get the extent map of
+each image.
+*/
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <endian.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "extent.h"
+#include "guestfs.h"
+#include "output.h"
+#include "vmware.h"
+
+struct Layer
+{
+	const char		*path;
+	const uint8_t	*base;
+	uint64_t		size;
+	struct ExtentCensus	census;
+};
+
+/*
+ * An image chain, root first. The merged map tells for every virtual
+ * offset which layer holds the data, the top-most one wins.
+ */
+struct Chain
+{
+	unsigned		layersCount;
+	struct Layer	*layers;
+	struct ExtentMap	map;
+	uint64_t		virtualSize;
+};
+
+static const char *imageTool(const char *path)
+{
+	const int fd = open(path, O_RDONLY);
+	if( fd == -1 )
+	{
+		perror(path);
+		exit(1);
+	}
+
+	uint8_t magic[16] = {};
+	if( pread(fd, magic, sizeof(magic), 0) < 0 )
+	{
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+
+	// the grains of a streamOptimized VMDK (as in an OVA) have no place in
+	// the file to map, only the converter can inflate them
+	uint32_t sparseFlags;
+	memcpy(&sparseFlags, magic + 8, sizeof(sparseFlags));	// after the magic and version
+	if( memcmp(magic, "KDMV", 4) == 0 && ( le32toh(sparseFlags) & SPARSEFLAG_COMPRESSED ) )
+	{
+		fprintf(stderr, "%s: the grains are compressed (streamOptimized), any2kvm can't map the image; "
+			"convert it with vmdk first and use the raw image\n", path);
+		exit(1);
+	}
+
+	if( memcmp(magic, "conectix", 8) == 0 )
+		return "vhd";
+	else if( memcmp(magic, "vhdxfile", 8) == 0 )
+		return "vhdx";
+	else if( *(uint32_t *)magic == 0x44574f43 )
+		return "vmfssparse";
+	else if( memcmp(magic, "KDMV", 4) == 0 )
+		return "vmdk";
+	else if( memcmp(magic, "QFI\xfb", 4) == 0 )
+		return "qcow2";
+	else if( *(uint64_t *)magic == 0xcafebabe )
+		return "sesparse";
+
+	// no metadata at all, e.g. an ESXi thick base under its -delta.vmdk
+	const size_t len = strlen(path);
+	static const char *flatSuffixes[] = { "-flat.vmdk", ".raw", ".img" };
+	for(unsigned i = 0; i < sizeof(flatSuffixes) / sizeof(flatSuffixes[0]); i++)
+	{
+		const size_t l = strlen(flatSuffixes[i]);
+		if( len >= l && strcmp(path + len - l, flatSuffixes[i]) == 0 )
+			return "flat";
+	}
+
+	fprintf(stderr, "%s: unknown image format\n", path);
+	exit(1);
+}
+
+// where the extent maps of the images are kept between runs, -I
+static const char *indexDir;
+
+#define INDEX_HEAD_SIZE		(256 * 1024)
+#define INDEX_TAIL_SIZE		4096
+
+/*
+ * What an extent index is valid for: the image file as it is now, and the
+ * converter that made it. The headers at both ends (VHD footer, VHDX
+ * headers with the DataWriteGuid, VMDK and qcow2 headers) are hashed in,
+ * so an image written to without its mtime changing isn't taken for the
+ * one indexed.
+ */
+struct ImageKey
+{
+	uint64_t		dev;
+	uint64_t		ino;
+	uint64_t		size;
+	uint64_t		mtimeSec;
+	uint64_t		mtimeNsec;
+	uint64_t		toolSize;
+	uint64_t		toolMtimeSec;
+	uint64_t		toolMtimeNsec;
+	uint64_t		hash;
+};
+
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+		h = ( h ^ p[i] ) * 0x100000001b3ull;
+	return h;
+}
+
+/*
+ * False for block devices: writes to them don't change any of this.
+ */
+static bool imageKey(const char *path, const char *toolPath, struct ImageKey *key)
+{
+	struct stat st, toolSt;
+	const int fd = open(path, O_RDONLY);
+	if( fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || stat(toolPath, &toolSt) != 0 )
+	{
+		if( fd != -1 )
+			close(fd);
+		return false;
+	}
+
+	memset(key, 0, sizeof(*key));
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->size = st.st_size;
+	key->mtimeSec = st.st_mtim.tv_sec;
+	key->mtimeNsec = st.st_mtim.tv_nsec;
+	key->toolSize = toolSt.st_size;
+	key->toolMtimeSec = toolSt.st_mtim.tv_sec;
+	key->toolMtimeNsec = toolSt.st_mtim.tv_nsec;
+
+	static uint8_t buf[INDEX_HEAD_SIZE];
+	key->hash = 0xcbf29ce484222325ull;
+	ssize_t len = pread(fd, buf, INDEX_HEAD_SIZE, 0);
+	if( len > 0 )
+		key->hash = fnv1a(key->hash, buf, len);
+	const off_t tail = st.st_size > INDEX_TAIL_SIZE ? st.st_size - INDEX_TAIL_SIZE : 0;
+	len = pread(fd, buf, INDEX_TAIL_SIZE, tail);
+	if( len > 0 )
+		key->hash = fnv1a(key->hash, buf, len);
+	close(fd);
+	return true;
+}
+
+/*
+ * Run the converter for this image in map mode and load the result, or
+ * take it from the index of an earlier run. True if it was indexed.
+ */
+static bool imageMap(struct ExtentMap *map, const char *path)
+{
+	const char *tool = imageTool(path);
+
+	char toolPath[PATH_MAX];
+	const ssize_t len = readlink("/proc/self/exe", toolPath, sizeof(toolPath) - 1);
+	if( len < 0 )
+	{
+		perror("readlink");
+		exit(1);
+	}
+	toolPath[len] = 0;
+	char *slash = strrchr(toolPath, '/');
+	snprintf(slash + 1, sizeof(toolPath) - (slash + 1 - toolPath), "%s", tool);
+
+	struct ImageKey key;
+	char indexPath[PATH_MAX];
+	const bool indexed = indexDir && imageKey(path, toolPath, &key);
+	if( indexed )
+	{
+		// named by the file, a newer index of it replaces the stale one
+		snprintf(indexPath, sizeof(indexPath), "%s/%s-%016" PRIx64 ".idx", indexDir, tool,
+			fnv1a(0xcbf29ce484222325ull, (const uint8_t *)&key, 2 * sizeof(uint64_t)));
+		if( extentIndexLoad(map, indexPath, &key, sizeof(key)) )
+			return true;
+	}
+
+	const char *tmpDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char mapPath[PATH_MAX];
+	snprintf(mapPath, sizeof(mapPath), "%s/any2kvm-XXXXXX", tmpDir);
+	const int mapFd = mkstemp(mapPath);
+	if( mapFd == -1 )
+	{
+		perror("mkstemp");
+		exit(1);
+	}
+	close(mapFd);
+
+	const pid_t pid = fork();
+	if( pid == -1 )
+	{
+		perror("fork");
+		exit(1);
+	}
+	else if( pid == 0 )
+	{
+		const int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		execl(toolPath, toolPath, "-m", mapPath, path, NULL);
+		perror(toolPath);
+		_exit(1);
+	}
+
+	int status;
+	if( waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+	{
+		fprintf(stderr, "%s: %s failed\n", path, tool);
+		unlink(mapPath);
+		exit(1);
+	}
+
+	extentMapLoad(map, mapPath);
+	unlink(mapPath);
+
+	if( indexed )
+	{
+		if( mkdir(indexDir, 0755) != 0 && errno != EEXIST )
+			perror(indexDir);
+		else if( !extentIndexSave(map, indexPath, &key, sizeof(key)) )
+			fprintf(stderr, "%s: can't save the extent index of %s\n", indexPath, path);
+	}
+	return false;
+}
+
+/*
+ * "name" relative to the directory of "path", unless it's absolute.
+ */
+static char *siblingPath(const char *path, const char *name)
+{
+	char *res;
+	const char *slash = strrchr(path, '/');
+	if( name[0] == '/' || !slash )
+		res = strdup(name);
+	else if( asprintf(&res, "%.*s/%s", (int)(slash - path), path, name) == -1 )
+		res = NULL;
+	if( !res )
+	{
+		perror("malloc");
+		exit(1);
+	}
+	return res;
+}
+
+/*
+ * The data file of a VMware image and its parent, NULL if it has none:
+ * the extent and parentFileNameHint of a text descriptor, the
+ * parentFileName of a COWD delta, the embedded descriptor of a hosted
+ * sparse extent. Other images are their own data file, their parents
+ * aren't followed.
+ */
+static char *imageParent(const char *path, char **dataPath)
+{
+	*dataPath = strdup(path);
+
+	const int fd = open(path, O_RDONLY);
+	if( fd == -1 )
+	{
+		perror(path);
+		exit(1);
+	}
+
+	static char buf[64 * 1024];
+	const ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if( len < 0 )
+	{
+		perror(path);
+		exit(1);
+	}
+	buf[len] = 0;
+
+	char *parent = NULL, *parentCid = NULL;
+	if( len > 21 && memcmp(buf, "# Disk DescriptorFile", 21) == 0 )
+	{
+		char *extent = descriptorExtentFile(buf, len);
+		if( !extent )
+		{
+			fprintf(stderr, "%s: no extent in the descriptor\n", path);
+			exit(1);
+		}
+		free(*dataPath);
+		*dataPath = siblingPath(path, extent);
+		free(extent);
+		parent = descriptorValue(buf, len, "parentFileNameHint");
+		parentCid = descriptorValue(buf, len, "parentCID");
+	}
+	else if( len >= sizeof(struct COWDisk_Header) && *(uint32_t *)buf == COWD_MAGIC )
+	{
+		const struct COWDisk_Header *hdr = (const void *)buf;
+		if( hdr->u.child.parentFileName[0] )
+			parent = strndup(hdr->u.child.parentFileName, sizeof(hdr->u.child.parentFileName));
+	}
+	else if( len >= sizeof(struct SparseExtentHeader) && *(uint32_t *)buf == SPARSE_MAGIC )
+	{
+		const struct SparseExtentHeader *hdr = (const void *)buf;
+		char *desc = NULL;
+		const uint64_t descLen = hdr->descriptorSize * 512;
+		if( hdr->descriptorOffset && descLen && descLen <= 16 * 1024 * 1024 && ( desc = malloc(descLen + 1) ) &&
+			pread(fd, desc, descLen, hdr->descriptorOffset * 512) == descLen )
+		{
+			desc[descLen] = 0;
+			parent = descriptorValue(desc, strlen(desc), "parentFileNameHint");
+			parentCid = descriptorValue(desc, strlen(desc), "parentCID");
+		}
+		free(desc);
+	}
+	close(fd);
+
+	char *res = NULL;
+	if( parent && parent[0] && !( parentCid && strcasecmp(parentCid, "ffffffff") == 0 ) )
+		res = siblingPath(path, parent);
+	free(parent);
+	free(parentCid);
+	return res;
+}
+
+#define CHAIN_MAX_DEPTH		256
+
+/*
+ * The data files of the chain, root first. A single image is followed
+ * down to its base through the VMware parent links, a list is taken as
+ * the whole chain.
+ */
+static char **chainPaths(unsigned *count, char **paths)
+{
+	char **res = calloc(CHAIN_MAX_DEPTH, sizeof(*res));
+	unsigned n = 0;
+
+	if( *count == 1 )
+	{
+		char *data;
+		for(char *path = strdup(paths[0]); path; )
+		{
+			if( n == CHAIN_MAX_DEPTH )
+			{
+				fprintf(stderr, "%s: the chain is too long, or has a loop\n", paths[0]);
+				exit(1);
+			}
+			char *parent = imageParent(path, &data);
+			res[n++] = data;
+			free(path);
+			path = parent;
+		}
+
+		// collected top first
+		for(unsigned i = 0; i < n / 2; i++)
+		{
+			char *t = res[i];
+			res[i] = res[n - 1 - i];
+			res[n - 1 - i] = t;
+		}
+	}
+	else
+	{
+		if( *count > CHAIN_MAX_DEPTH )
+		{
+			fprintf(stderr, "the chain is too long\n");
+			exit(1);
+		}
+		for(unsigned i = 0; i < *count; i++)
+		{
+			char *parent = imageParent(paths[i], &res[n++]);
+			free(parent);
+		}
+	}
+
+	*count = n;
+	return res;
+}
+
+static void chainOpen(struct Chain *chain, unsigned count, char **imagePaths)
+{
+	char **paths = chainPaths(&count, imagePaths);
+	memset(chain, 0, sizeof(*chain));
+	chain->layersCount = count;
+	chain->layers = calloc(count, sizeof(*chain->layers));
+
+	for(unsigned i = 0; i < count; i++)
+	{
+		struct Layer *l = &chain->layers[i];
+		l->path = paths[i];
+
+		const int fd = open(l->path, O_RDONLY);
+		if( fd == -1 )
+		{
+			perror(l->path);
+			exit(1);
+		}
+		l->size = lseek(fd, 0, SEEK_END);
+		l->base = mmap(NULL, l->size, PROT_READ, MAP_SHARED, fd, 0);
+		if( l->base == MAP_FAILED )
+		{
+			perror("mmap");
+			exit(1);
+		}
+		close(fd);
+
+		struct ExtentMap map;
+		const bool indexed = imageMap(&map, l->path);
+		extentMapCensus(&map, &l->census);
+		for(uint64_t e = 0; e < map.count; e++)
+			map.ext[e].layer = i;
+
+		// the top image defines the disk size
+		chain->virtualSize = map.virtualSize;
+		if( i == 0 )
+			chain->map = map;
+		else
+		{
+			struct ExtentMap merged;
+			extentMapOverlay(&merged, &chain->map, &map);
+			extentMapFree(&chain->map);
+			extentMapFree(&map);
+			chain->map = merged;
+		}
+
+		printf("%s: %" PRIu64 " extents%s\n", l->path, chain->map.count, indexed ? " (indexed)" : "");
+	}
+}
+
+/*
+ * Lookup with a one-entry cache: "hint" is the extent the previous lookup
+ * ended at, sequential reads hit it or the one after it.
+ */
+static uint64_t chainLookup(const struct Chain *chain, uint64_t offset, uint64_t *hint)
+{
+	const struct ExtentMap *map = &chain->map;
+	for(uint64_t i = *hint; i < *hint + 2 && i < map->count; i++)
+	{
+		if( map->ext[i].virtOffset + map->ext[i].length > offset &&
+			( i == 0 || map->ext[i - 1].virtOffset + map->ext[i - 1].length <= offset ) )
+		{
+			*hint = i;
+			return i;
+		}
+	}
+
+	*hint = extentMapFind(map, offset);
+	return *hint;
+}
+
+/*
+ * Read the virtual disk, holes read as zeroes.
+ */
+static void chainRead(const struct Chain *chain, uint64_t offset, void *buf, uint64_t len, uint64_t *hint)
+{
+	const uint64_t end = offset + len;
+	for(uint64_t pos = offset; pos < end; )
+	{
+		const uint64_t i = chainLookup(chain, pos, hint);
+		const struct Extent *e = i < chain->map.count ? &chain->map.ext[i] : NULL;
+
+		uint64_t l;
+		if( !e || e->virtOffset > pos )
+		{
+			l = ( e && e->virtOffset < end ? e->virtOffset : end ) - pos;
+			memset(buf + (pos - offset), 0, l);
+		}
+		else
+		{
+			l = e->virtOffset + e->length - pos;
+			if( l > end - pos )
+				l = end - pos;
+			if( e->fileOffset == EXTENT_ZERO )
+				memset(buf + (pos - offset), 0, l);
+			else
+				memcpy(buf + (pos - offset), chain->layers[e->layer].base + e->fileOffset + ( pos - e->virtOffset ), l);
+		}
+		pos += l;
+	}
+}
+
+struct ChainReader
+{
+	const struct Chain	*chain;
+	uint64_t		hint;
+};
+
+static void chainGuestRead(void *ctx, uint64_t offset, void *buf, uint64_t len)
+{
+	struct ChainReader *r = ctx;
+	if( offset > r->chain->virtualSize || len > r->chain->virtualSize - offset )
+	{
+		memset(buf, 0, len);
+		return;
+	}
+	chainRead(r->chain, offset, buf, len, &r->hint);
+}
+
+#define GUEST_FREE_LAYER	(~0u)
+
+/*
+ * Drop the ranges the guest file systems have free from the merged map,
+ * they read as holes from then on.
+ */
+static void chainSkipGuestFree(struct Chain *chain)
+{
+	struct ChainReader r = { chain, 0 };
+	struct ExtentMap freeMap;
+	guestFreeMap(&freeMap, chainGuestRead, &r, chain->virtualSize);
+	for(uint64_t i = 0; i < freeMap.count; i++)
+		freeMap.ext[i].layer = GUEST_FREE_LAYER;
+
+	uint64_t before = 0;
+	for(uint64_t i = 0; i < chain->map.count; i++)
+		if( chain->map.ext[i].fileOffset != EXTENT_ZERO )
+			before += chain->map.ext[i].length;
+
+	struct ExtentMap merged;
+	extentMapOverlay(&merged, &chain->map, &freeMap);
+	extentMapFree(&chain->map);
+	extentMapFree(&freeMap);
+
+	uint64_t out = 0, after = 0;
+	for(uint64_t i = 0; i < merged.count; i++)
+	{
+		if( merged.ext[i].layer == GUEST_FREE_LAYER )
+			continue;
+		if( merged.ext[i].fileOffset != EXTENT_ZERO )
+			after += merged.ext[i].length;
+		merged.ext[out++] = merged.ext[i];
+	}
+	merged.count = out;
+	chain->map = merged;
+
+	printf("guestfs: %" PRIu64 " of %" PRIu64 " MiB of image data is free in the guest, skipping it\n", (before - after) >> 20, before >> 20);
+}
+
+/*
+ * NBD server, newstyle fixed handshake. Read-only for "serve", read-write
+ * over the target volume for "cor".
+ */
+
+#define NBD_MAGIC				0x4e42444d41474943ull
+#define NBD_OPTS_MAGIC			0x49484156454f5054ull
+#define NBD_REP_MAGIC			0x0003e889045565a9ull
+#define NBD_REQUEST_MAGIC		0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC	0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC	0x668e33ef
+
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_NO_ZEROES		(1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS		(1 << 0)
+#define NBD_FLAG_READ_ONLY		(1 << 1)
+#define NBD_FLAG_SEND_FLUSH		(1 << 2)
+#define NBD_FLAG_SEND_FUA		(1 << 3)
+#define NBD_FLAG_SEND_WRITE_ZEROES	(1 << 6)
+#define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)
+
+#define NBD_OPT_EXPORT_NAME		1
+#define NBD_OPT_ABORT			2
+#define NBD_OPT_LIST			3
+#define NBD_OPT_INFO			6
+#define NBD_OPT_GO				7
+#define NBD_OPT_STRUCTURED_REPLY	8
+#define NBD_OPT_LIST_META_CONTEXT	9
+#define NBD_OPT_SET_META_CONTEXT	10
+
+#define NBD_REP_ACK				1
+#define NBD_REP_SERVER			2
+#define NBD_REP_INFO			3
+#define NBD_REP_META_CONTEXT	4
+#define NBD_REP_ERR_UNSUP		0x80000001
+#define NBD_REP_ERR_INVALID		0x80000003
+#define NBD_REP_ERR_UNKNOWN		0x80000006
+
+#define NBD_INFO_EXPORT			0
+#define NBD_INFO_BLOCK_SIZE		3
+
+#define NBD_CMD_READ			0
+#define NBD_CMD_WRITE			1
+#define NBD_CMD_DISC			2
+#define NBD_CMD_FLUSH			3
+#define NBD_CMD_TRIM			4
+#define NBD_CMD_WRITE_ZEROES	6
+#define NBD_CMD_BLOCK_STATUS	7
+
+#define NBD_CMD_FLAG_FUA		(1 << 0)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 3)
+
+#define NBD_REPLY_FLAG_DONE		(1 << 0)
+#define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_BLOCK_STATUS	5
+#define NBD_REPLY_TYPE_ERROR	32769
+
+#define NBD_STATE_HOLE			(1 << 0)
+#define NBD_STATE_ZERO			(1 << 1)
+
+#define NBD_META_BASE_ALLOCATION	1
+#define NBD_MAX_REQUEST			(32 * 1024 * 1024)
+#define NBD_MAX_DESCRIPTORS		1024
+
+struct NbdOption
+{
+	uint64_t		magic;
+	uint32_t		option;
+	uint32_t		length;
+} __attribute__((packed));
+
+struct NbdOptionReply
+{
+	uint64_t		magic;
+	uint32_t		option;
+	uint32_t		type;
+	uint32_t		length;
+} __attribute__((packed));
+
+struct NbdRequest
+{
+	uint32_t		magic;
+	uint16_t		flags;
+	uint16_t		type;
+	uint64_t		handle;
+	uint64_t		offset;
+	uint32_t		length;
+} __attribute__((packed));
+
+struct NbdSimpleReply
+{
+	uint32_t		magic;
+	uint32_t		error;
+	uint64_t		handle;
+} __attribute__((packed));
+
+struct NbdStructuredReply
+{
+	uint32_t		magic;
+	uint16_t		flags;
+	uint16_t		type;
+	uint64_t		handle;
+	uint32_t		length;
+} __attribute__((packed));
+
+struct NbdQueued
+{
+	struct NbdQueued	*next;
+	struct NbdRequest	req;
+	uint8_t				*data;		// write payload
+};
+
+struct NbdConn
+{
+	int				sock;
+	bool			structured;
+	bool			baseAllocation;
+
+	pthread_mutex_t	sendLock;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct NbdQueued	*head, *tail;
+	bool			closing;
+};
+
+static struct Chain	serveChain;
+static const char	*serveExport = "";
+static unsigned		serveThreads = 4;
+static bool			serveWritable;
+static const char	*serveAddress = "127.0.0.1";
+static unsigned		servePort = 10809;
+static const char	*serveSocket;
+static bool			serveSkipGuestFree;
+
+static const char nbdZeroes[64 * 1024];
+
+static bool readFull(int fd, void *buf, size_t len)
+{
+	while( len )
+	{
+		const ssize_t res = read(fd, buf, len);
+		if( res < 0 && errno == EINTR )
+			continue;
+		if( res <= 0 )
+			return false;
+		buf += res;
+		len -= res;
+	}
+	return true;
+}
+
+static bool writeFullIov(int fd, struct iovec *iov, unsigned cnt)
+{
+	while( cnt )
+	{
+		const ssize_t res = writev(fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+		if( res < 0 && errno == EINTR )
+			continue;
+		if( res <= 0 )
+			return false;
+
+		size_t done = res;
+		while( cnt && done >= iov->iov_len )
+		{
+			done -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if( cnt )
+		{
+			iov->iov_base += done;
+			iov->iov_len -= done;
+		}
+	}
+	return true;
+}
+
+static bool writeFull(int fd, const void *buf, size_t len)
+{
+	struct iovec iov = { (void *)buf, len };
+	return writeFullIov(fd, &iov, 1);
+}
+
+static bool nbdOptionReply(struct NbdConn *c, uint32_t option, uint32_t type, const void *data, uint32_t len)
+{
+	struct NbdOptionReply rep = { htobe64(NBD_REP_MAGIC), htobe32(option), htobe32(type), htobe32(len) };
+	struct iovec iov[2] = { { &rep, sizeof(rep) }, { (void *)data, len } };
+	return writeFullIov(c->sock, iov, len ? 2 : 1);
+}
+
+static uint16_t nbdTransmissionFlags(void)
+{
+	if( serveWritable )
+		return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_WRITE_ZEROES;
+	return NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN;
+}
+
+static bool nbdExportInfo(struct NbdConn *c, uint32_t option)
+{
+	struct
+	{
+		uint16_t	type;
+		uint64_t	size;
+		uint16_t	flags;
+	} __attribute__((packed)) info = { htobe16(NBD_INFO_EXPORT), htobe64(serveChain.virtualSize), htobe16(nbdTransmissionFlags()) };
+
+	struct
+	{
+		uint16_t	type;
+		uint32_t	minimum;
+		uint32_t	preferred;
+		uint32_t	maximum;
+	} __attribute__((packed)) blockSize = { htobe16(NBD_INFO_BLOCK_SIZE), htobe32(1), htobe32(4096), htobe32(NBD_MAX_REQUEST) };
+
+	return nbdOptionReply(c, option, NBD_REP_INFO, &info, sizeof(info)) &&
+		nbdOptionReply(c, option, NBD_REP_INFO, &blockSize, sizeof(blockSize));
+}
+
+/*
+ * Handles both LIST and SET. Only "base:allocation" is known, and only for
+ * the read-only export where the allocation can't change under us.
+ */
+static bool nbdMetaContext(struct NbdConn *c, uint32_t option, const uint8_t *data, uint32_t len)
+{
+	static const char baseAllocation[] = "base:allocation";
+
+	if( option == NBD_OPT_SET_META_CONTEXT && !c->structured )
+		return nbdOptionReply(c, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+	uint32_t nameLen;
+	if( len < 8 || ( nameLen = be32toh(*(uint32_t *)data) ) > len - 8 )
+		return nbdOptionReply(c, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+	const uint8_t *p = data + 4 + nameLen;
+	const uint8_t *end = data + len;
+	const uint32_t queries = be32toh(*(uint32_t *)p);
+	p += 4;
+
+	bool found = false;
+	if( queries == 0 && option == NBD_OPT_LIST_META_CONTEXT )
+		found = true;
+
+	for(uint32_t i = 0; i < queries; i++)
+	{
+		if( end - p < 4 )
+			return nbdOptionReply(c, option, NBD_REP_ERR_INVALID, NULL, 0);
+		const uint32_t qLen = be32toh(*(uint32_t *)p);
+		p += 4;
+		if( end - p < qLen )
+			return nbdOptionReply(c, option, NBD_REP_ERR_INVALID, NULL, 0);
+
+		if( ( qLen == strlen(baseAllocation) && memcmp(p, baseAllocation, qLen) == 0 ) ||
+			( option == NBD_OPT_LIST_META_CONTEXT && qLen == 5 && memcmp(p, "base:", 5) == 0 ) )
+			found = true;
+		p += qLen;
+	}
+
+	if( serveWritable )
+		found = false;
+
+	if( option == NBD_OPT_SET_META_CONTEXT )
+		c->baseAllocation = found;
+
+	if( found )
+	{
+		struct
+		{
+			uint32_t	id;
+			char		name[sizeof(baseAllocation) - 1];
+		} __attribute__((packed)) ctx = { htobe32(NBD_META_BASE_ALLOCATION) };
+		memcpy(ctx.name, baseAllocation, sizeof(ctx.name));
+		if( !nbdOptionReply(c, option, NBD_REP_META_CONTEXT, &ctx, sizeof(ctx)) )
+			return false;
+	}
+
+	return nbdOptionReply(c, option, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * Returns true when the client is ready for the transmission phase.
+ */
+static bool nbdHandshake(struct NbdConn *c)
+{
+	struct
+	{
+		uint64_t	magic;
+		uint64_t	optsMagic;
+		uint16_t	flags;
+	} __attribute__((packed)) hello = { htobe64(NBD_MAGIC), htobe64(NBD_OPTS_MAGIC), htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES) };
+
+	if( !writeFull(c->sock, &hello, sizeof(hello)) )
+		return false;
+
+	uint32_t clientFlags;
+	if( !readFull(c->sock, &clientFlags, sizeof(clientFlags)) )
+		return false;
+	clientFlags = be32toh(clientFlags);
+
+	for(;;)
+	{
+		struct NbdOption opt;
+		if( !readFull(c->sock, &opt, sizeof(opt)) || be64toh(opt.magic) != NBD_OPTS_MAGIC )
+			return false;
+
+		const uint32_t option = be32toh(opt.option);
+		const uint32_t len = be32toh(opt.length);
+		if( len > 64 * 1024 )
+			return false;
+
+		uint8_t data[len + 1];
+		if( !readFull(c->sock, data, len) )
+			return false;
+		data[len] = 0;
+
+		switch( option )
+		{
+			case NBD_OPT_EXPORT_NAME:
+			{
+				struct
+				{
+					uint64_t	size;
+					uint16_t	flags;
+					uint8_t		zeroes[124];
+				} __attribute__((packed)) info = { htobe64(serveChain.virtualSize), htobe16(nbdTransmissionFlags()) };
+				return writeFull(c->sock, &info, clientFlags & NBD_FLAG_NO_ZEROES ? 10 : sizeof(info));
+			}
+
+			case NBD_OPT_ABORT:
+				nbdOptionReply(c, option, NBD_REP_ACK, NULL, 0);
+				return false;
+
+			case NBD_OPT_LIST:
+			{
+				const uint32_t nameLen = strlen(serveExport);
+				uint8_t rep[4 + nameLen];
+				*(uint32_t *)rep = htobe32(nameLen);
+				memcpy(rep + 4, serveExport, nameLen);
+				if( !nbdOptionReply(c, option, NBD_REP_SERVER, rep, sizeof(rep)) ||
+					!nbdOptionReply(c, option, NBD_REP_ACK, NULL, 0) )
+					return false;
+				break;
+			}
+
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+			{
+				uint32_t nameLen;
+				if( len < 6 || ( nameLen = be32toh(*(uint32_t *)data) ) > len - 6 )
+				{
+					if( !nbdOptionReply(c, option, NBD_REP_ERR_INVALID, NULL, 0) )
+						return false;
+					break;
+				}
+
+				if( nameLen && ( nameLen != strlen(serveExport) || memcmp(data + 4, serveExport, nameLen) != 0 ) )
+				{
+					if( !nbdOptionReply(c, option, NBD_REP_ERR_UNKNOWN, NULL, 0) )
+						return false;
+					break;
+				}
+
+				if( !nbdExportInfo(c, option) || !nbdOptionReply(c, option, NBD_REP_ACK, NULL, 0) )
+					return false;
+				if( option == NBD_OPT_GO )
+					return true;
+				break;
+			}
+
+			case NBD_OPT_STRUCTURED_REPLY:
+				if( len )
+				{
+					if( !nbdOptionReply(c, option, NBD_REP_ERR_INVALID, NULL, 0) )
+						return false;
+					break;
+				}
+				c->structured = true;
+				if( !nbdOptionReply(c, option, NBD_REP_ACK, NULL, 0) )
+					return false;
+				break;
+
+			case NBD_OPT_LIST_META_CONTEXT:
+			case NBD_OPT_SET_META_CONTEXT:
+				if( !nbdMetaContext(c, option, data, len) )
+					return false;
+				break;
+
+			default:
+				if( !nbdOptionReply(c, option, NBD_REP_ERR_UNSUP, NULL, 0) )
+					return false;
+				break;
+		}
+	}
+}
+
+static void nbdSend(struct NbdConn *c, struct iovec *iov, unsigned cnt)
+{
+	pthread_mutex_lock(&c->sendLock);
+	if( !writeFullIov(c->sock, iov, cnt) )
+		shutdown(c->sock, SHUT_RDWR);
+	pthread_mutex_unlock(&c->sendLock);
+}
+
+static void nbdReply(struct NbdConn *c, uint64_t handle, uint32_t error)
+{
+	if( error && c->structured )
+	{
+		struct
+		{
+			struct NbdStructuredReply	hdr;
+			uint32_t					error;
+			uint16_t					msgLen;
+		} __attribute__((packed)) rep = {
+			{ htobe32(NBD_STRUCTURED_REPLY_MAGIC), htobe16(NBD_REPLY_FLAG_DONE), htobe16(NBD_REPLY_TYPE_ERROR), handle, htobe32(6) },
+			htobe32(error), 0 };
+		struct iovec iov = { &rep, sizeof(rep) };
+		nbdSend(c, &iov, 1);
+		return;
+	}
+
+	struct NbdSimpleReply rep = { htobe32(NBD_SIMPLE_REPLY_MAGIC), htobe32(error), handle };
+	struct iovec iov = { &rep, sizeof(rep) };
+	nbdSend(c, &iov, 1);
+}
+
+static void nbdReplyData(struct NbdConn *c, const struct NbdRequest *req, const void *data)
+{
+	struct
+	{
+		struct NbdStructuredReply	hdr;
+		uint64_t					offset;
+	} __attribute__((packed)) sRep = {
+		{ htobe32(NBD_STRUCTURED_REPLY_MAGIC), htobe16(NBD_REPLY_FLAG_DONE), htobe16(NBD_REPLY_TYPE_OFFSET_DATA), req->handle, htobe32(8 + req->length) },
+		htobe64(req->offset) };
+	struct NbdSimpleReply rep = { htobe32(NBD_SIMPLE_REPLY_MAGIC), 0, req->handle };
+
+	struct iovec iov[2] = { { &rep, sizeof(rep) }, { (void *)data, req->length } };
+	if( c->structured )
+		iov[0] = (struct iovec){ &sRep, sizeof(sRep) };
+	nbdSend(c, iov, 2);
+}
+
+static void nbdRead(struct NbdConn *c, const struct NbdRequest *req, uint64_t *hint)
+{
+	const struct Chain *chain = &serveChain;
+	const uint64_t end = req->offset + req->length;
+
+	unsigned iovAlloc = 64, iovCnt = 1;
+	struct iovec *iov = malloc(iovAlloc * sizeof(*iov));
+
+	struct
+	{
+		struct NbdStructuredReply	hdr;
+		uint64_t					offset;
+	} __attribute__((packed)) sRep = {
+		{ htobe32(NBD_STRUCTURED_REPLY_MAGIC), htobe16(NBD_REPLY_FLAG_DONE), htobe16(NBD_REPLY_TYPE_OFFSET_DATA), req->handle, htobe32(8 + req->length) },
+		htobe64(req->offset) };
+	struct NbdSimpleReply rep = { htobe32(NBD_SIMPLE_REPLY_MAGIC), 0, req->handle };
+
+	if( c->structured )
+		iov[0] = (struct iovec){ &sRep, sizeof(sRep) };
+	else
+		iov[0] = (struct iovec){ &rep, sizeof(rep) };
+
+	for(uint64_t pos = req->offset; pos < end; )
+	{
+		const uint64_t i = chainLookup(chain, pos, hint);
+		const struct Extent *e = i < chain->map.count ? &chain->map.ext[i] : NULL;
+
+		const void *ptr;
+		uint64_t len;
+		if( !e || e->virtOffset > pos )
+		{
+			// not present in any layer
+			ptr = nbdZeroes;
+			len = ( e ? e->virtOffset : end ) - pos;
+		}
+		else
+		{
+			len = e->virtOffset + e->length - pos;
+			if( e->fileOffset == EXTENT_ZERO )
+				ptr = nbdZeroes;
+			else
+				ptr = chain->layers[e->layer].base + e->fileOffset + ( pos - e->virtOffset );
+		}
+		if( len > end - pos )
+			len = end - pos;
+		if( ptr == nbdZeroes && len > sizeof(nbdZeroes) )
+			len = sizeof(nbdZeroes);
+
+		if( iovCnt == iovAlloc )
+		{
+			iovAlloc *= 2;
+			iov = realloc(iov, iovAlloc * sizeof(*iov));
+		}
+		iov[iovCnt++] = (struct iovec){ (void *)ptr, len };
+		pos += len;
+	}
+
+	nbdSend(c, iov, iovCnt);
+	free(iov);
+}
+
+static void nbdBlockStatus(struct NbdConn *c, const struct NbdRequest *req, uint64_t *hint)
+{
+	const struct Chain *chain = &serveChain;
+	const uint64_t end = req->offset + req->length;
+	const unsigned maxDesc = req->flags & NBD_CMD_FLAG_REQ_ONE ? 1 : NBD_MAX_DESCRIPTORS;
+
+	struct
+	{
+		struct NbdStructuredReply	hdr;
+		uint32_t					contextId;
+		struct
+		{
+			uint32_t	length;
+			uint32_t	flags;
+		} __attribute__((packed)) desc[NBD_MAX_DESCRIPTORS];
+	} __attribute__((packed)) rep;
+	unsigned cnt = 0;
+
+	for(uint64_t pos = req->offset; pos < end; )
+	{
+		const uint64_t i = chainLookup(chain, pos, hint);
+		const struct Extent *e = i < chain->map.count ? &chain->map.ext[i] : NULL;
+
+		uint64_t len;
+		uint32_t flags;
+		if( !e || e->virtOffset > pos )
+		{
+			len = ( e ? e->virtOffset : end ) - pos;
+			flags = NBD_STATE_HOLE | NBD_STATE_ZERO;
+		}
+		else
+		{
+			len = e->virtOffset + e->length - pos;
+			flags = e->fileOffset == EXTENT_ZERO ? NBD_STATE_HOLE | NBD_STATE_ZERO : 0;
+		}
+		if( len > end - pos )
+			len = end - pos;
+
+		if( cnt && be32toh(rep.desc[cnt - 1].flags) == flags )
+			rep.desc[cnt - 1].length = htobe32(be32toh(rep.desc[cnt - 1].length) + len);
+		else if( cnt == maxDesc )
+			break;
+		else
+		{
+			rep.desc[cnt].length = htobe32(len);
+			rep.desc[cnt].flags = htobe32(flags);
+			cnt++;
+		}
+		pos += len;
+	}
+
+	const uint32_t payload = 4 + cnt * sizeof(rep.desc[0]);
+	rep.hdr = (struct NbdStructuredReply){ htobe32(NBD_STRUCTURED_REPLY_MAGIC), htobe16(NBD_REPLY_FLAG_DONE), htobe16(NBD_REPLY_TYPE_BLOCK_STATUS), req->handle, htobe32(payload) };
+	rep.contextId = htobe32(NBD_META_BASE_ALLOCATION);
+
+	struct iovec iov = { &rep, sizeof(rep.hdr) + payload };
+	nbdSend(c, &iov, 1);
+}
+
+/*
+ * Copy-on-read: the guest runs from the target volume while it is still
+ * being filled. Chunks not copied yet are fetched from the image chain on
+ * first access and written through to the target, a background thread
+ * copies the rest. The copied bitmap is kept in a file so an interrupted
+ * fill continues where it stopped.
+ */
+
+#define COR_MAGIC			"a2kcor01"
+#define COR_LOCKS			1024
+#define COR_PRIO			4096
+#define COR_READAHEAD		16
+#define COR_SYNC_CHUNKS		256
+
+struct CorBitmapHeader
+{
+	char			magic[8];
+	uint64_t		virtualSize;
+	uint64_t		chunkSize;
+	uint64_t		reserved;
+};
+
+static struct
+{
+	const char		*targetPath;
+	int				target;
+	int				bitmapFd;
+	uint64_t		chunkSize;
+	uint64_t		chunks;
+	uint64_t		*copied;
+	uint64_t		copiedCount;
+	uint64_t		rateLimit;		// bytes per second, 0 for unlimited
+
+	pthread_mutex_t	locks[COR_LOCKS];
+	pthread_mutex_t	syncLock;
+
+	// chunks next to what the guest just touched, copied first
+	pthread_mutex_t	prioLock;
+	uint64_t		prio[COR_PRIO];
+	unsigned		prioHead, prioTail;
+} cor;
+
+static __thread uint8_t *corBuf;
+
+static bool preadFull(int fd, void *buf, uint64_t len, uint64_t offset)
+{
+	while( len )
+	{
+		const ssize_t res = pread(fd, buf, len, offset);
+		if( res < 0 && errno == EINTR )
+			continue;
+		if( res <= 0 )
+			return false;
+		buf += res;
+		offset += res;
+		len -= res;
+	}
+	return true;
+}
+
+static bool pwriteFull(int fd, const void *buf, uint64_t len, uint64_t offset)
+{
+	while( len )
+	{
+		const ssize_t res = pwrite(fd, buf, len, offset);
+		if( res < 0 && errno == EINTR )
+			continue;
+		if( res <= 0 )
+			return false;
+		buf += res;
+		offset += res;
+		len -= res;
+	}
+	return true;
+}
+
+static bool corIsCopied(uint64_t chunk)
+{
+	return __atomic_load_n(&cor.copied[chunk / 64], __ATOMIC_ACQUIRE) & (1ull << (chunk % 64));
+}
+
+static void corMarkCopied(uint64_t chunk)
+{
+	__atomic_fetch_or(&cor.copied[chunk / 64], 1ull << (chunk % 64), __ATOMIC_RELEASE);
+	__atomic_fetch_add(&cor.copiedCount, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t corChunkLen(uint64_t chunk)
+{
+	const uint64_t left = serveChain.virtualSize - chunk * cor.chunkSize;
+	return left < cor.chunkSize ? left : cor.chunkSize;
+}
+
+/*
+ * Make the target durable, then the bitmap. Only bits set before the
+ * target was synced are saved, a chunk is never marked in the file before
+ * its data is on stable storage.
+ */
+static void corSync(void)
+{
+	const uint64_t words = (cor.chunks + 63) / 64;
+	uint64_t *snap = malloc(words * sizeof(*snap));
+	if( !snap )
+	{
+		perror("malloc");
+		exit(1);
+	}
+
+	pthread_mutex_lock(&cor.syncLock);
+	for(uint64_t i = 0; i < words; i++)
+		snap[i] = __atomic_load_n(&cor.copied[i], __ATOMIC_ACQUIRE);
+
+	if( fdatasync(cor.target) != 0 )
+	{
+		perror("fdatasync");
+		exit(1);
+	}
+
+	if( !pwriteFull(cor.bitmapFd, snap, words * sizeof(*snap), sizeof(struct CorBitmapHeader)) || fdatasync(cor.bitmapFd) != 0 )
+	{
+		perror("bitmap");
+		exit(1);
+	}
+	pthread_mutex_unlock(&cor.syncLock);
+
+	free(snap);
+}
+
+/*
+ * Copy the data of the chunk, one write per run of adjacent data extents.
+ * Holes, zero extents and what the guest has free (-F) are left alone, as
+ * copy does: the target is zeroed.
+ */
+static bool corCopyChunk(uint64_t chunk, uint64_t *hint)
+{
+	if( !corBuf && !( corBuf = malloc(cor.chunkSize) ) )
+		return false;
+
+	const struct ExtentMap *map = &serveChain.map;
+	const uint64_t start = chunk * cor.chunkSize;
+	const uint64_t end = start + corChunkLen(chunk);
+	uint64_t runStart = end, runEnd = end;
+	for(uint64_t i = chainLookup(&serveChain, start, hint); ; i++)
+	{
+		const struct Extent *e = i < map->count && map->ext[i].virtOffset < end ? &map->ext[i] : NULL;
+		const bool data = e && e->fileOffset != EXTENT_ZERO;
+		if( runStart != end && ( !data || e->virtOffset != runEnd ) )
+		{
+			uint8_t *buf = corBuf + (runStart - start);
+			chainRead(&serveChain, runStart, buf, runEnd - runStart, hint);
+			if( !pwriteFull(cor.target, buf, runEnd - runStart, runStart) )
+				return false;
+			runStart = end;
+		}
+		if( !e )
+			break;
+		if( !data )
+			continue;
+
+		if( runStart == end )
+			runStart = e->virtOffset > start ? e->virtOffset : start;
+		runEnd = e->virtOffset + e->length < end ? e->virtOffset + e->length : end;
+	}
+	return true;
+}
+
+/*
+ * Copy the chunk unless it's already there. Returns false on I/O error.
+ */
+static bool corEnsure(uint64_t chunk, uint64_t *hint)
+{
+	if( corIsCopied(chunk) )
+		return true;
+
+	pthread_mutex_t *lock = &cor.locks[chunk % COR_LOCKS];
+	bool ok = true;
+
+	pthread_mutex_lock(lock);
+	if( !corIsCopied(chunk) )
+	{
+		ok = corCopyChunk(chunk, hint);
+		if( ok )
+			corMarkCopied(chunk);
+	}
+	pthread_mutex_unlock(lock);
+
+	return ok;
+}
+
+static void corPrioritize(uint64_t chunk)
+{
+	pthread_mutex_lock(&cor.prioLock);
+	for(uint64_t i = chunk + 1; i <= chunk + COR_READAHEAD && i < cor.chunks; i++)
+	{
+		if( corIsCopied(i) )
+			continue;
+		if( (cor.prioTail + 1) % COR_PRIO == cor.prioHead )
+			break;
+		cor.prio[cor.prioTail] = i;
+		cor.prioTail = (cor.prioTail + 1) % COR_PRIO;
+	}
+	pthread_mutex_unlock(&cor.prioLock);
+}
+
+static bool corWriteData(uint64_t offset, const uint8_t *data, uint64_t len)
+{
+	if( data )
+		return pwriteFull(cor.target, data, len, offset);
+
+	while( len )
+	{
+		const uint64_t l = len > sizeof(nbdZeroes) ? sizeof(nbdZeroes) : len;
+		if( !pwriteFull(cor.target, nbdZeroes, l, offset) )
+			return false;
+		offset += l;
+		len -= l;
+	}
+	return true;
+}
+
+/*
+ * Guest write, data is NULL for write zeroes. Chunks not copied yet are
+ * filled from the source first unless the write covers them completely.
+ */
+static bool corWrite(uint64_t offset, const uint8_t *data, uint64_t len, uint64_t *hint)
+{
+	while( len )
+	{
+		const uint64_t chunk = offset / cor.chunkSize;
+		uint64_t l = cor.chunkSize - offset % cor.chunkSize;
+		if( l > len )
+			l = len;
+
+		bool done = false;
+		if( !corIsCopied(chunk) )
+		{
+			pthread_mutex_t *lock = &cor.locks[chunk % COR_LOCKS];
+			pthread_mutex_lock(lock);
+			if( !corIsCopied(chunk) )
+			{
+				if( l != corChunkLen(chunk) && !corCopyChunk(chunk, hint) )
+				{
+					pthread_mutex_unlock(lock);
+					return false;
+				}
+				if( !corWriteData(offset, data, l) )
+				{
+					pthread_mutex_unlock(lock);
+					return false;
+				}
+				corMarkCopied(chunk);
+				done = true;
+			}
+			pthread_mutex_unlock(lock);
+		}
+
+		if( !done && !corWriteData(offset, data, l) )
+			return false;
+
+		offset += l;
+		len -= l;
+		if( data )
+			data += l;
+	}
+	return true;
+}
+
+static void corRequest(struct NbdConn *c, const struct NbdRequest *req, const uint8_t *data, uint64_t *hint)
+{
+	switch( req->type )
+	{
+		case NBD_CMD_READ:
+		{
+			if( req->length > NBD_MAX_REQUEST )
+			{
+				nbdReply(c, req->handle, EINVAL);
+				return;
+			}
+
+			for(uint64_t chunk = req->offset / cor.chunkSize; req->length && chunk <= (req->offset + req->length - 1) / cor.chunkSize; chunk++)
+			{
+				if( corIsCopied(chunk) )
+					continue;
+				if( !corEnsure(chunk, hint) )
+				{
+					nbdReply(c, req->handle, EIO);
+					return;
+				}
+				corPrioritize(chunk);
+			}
+
+			uint8_t *buf = malloc(req->length);
+			if( !buf )
+			{
+				nbdReply(c, req->handle, ENOMEM);
+				return;
+			}
+			if( !preadFull(cor.target, buf, req->length, req->offset) )
+				nbdReply(c, req->handle, EIO);
+			else
+				nbdReplyData(c, req, buf);
+			free(buf);
+			return;
+		}
+
+		case NBD_CMD_WRITE:
+		case NBD_CMD_WRITE_ZEROES:
+			if( !corWrite(req->offset, data, req->length, hint) )
+			{
+				nbdReply(c, req->handle, EIO);
+				return;
+			}
+			if( req->flags & NBD_CMD_FLAG_FUA )
+				corSync();
+			nbdReply(c, req->handle, 0);
+			return;
+
+		case NBD_CMD_FLUSH:
+			corSync();
+			nbdReply(c, req->handle, 0);
+			return;
+
+		default:
+			nbdReply(c, req->handle, EINVAL);
+			return;
+	}
+}
+
+static void *nbdWorker(void *arg)
+{
+	struct NbdConn *c = arg;
+	uint64_t hint = 0;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&c->lock);
+		while( !c->head && !c->closing )
+			pthread_cond_wait(&c->cond, &c->lock);
+		struct NbdQueued *q = c->head;
+		if( q )
+		{
+			c->head = q->next;
+			if( !c->head )
+				c->tail = NULL;
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		if( !q )
+			break;
+
+		const struct NbdRequest *req = &q->req;
+		if( req->offset > serveChain.virtualSize || req->length > serveChain.virtualSize - req->offset )
+			nbdReply(c, req->handle, EINVAL);
+		else if( serveWritable )
+			corRequest(c, req, q->data, &hint);
+		else if( req->type == NBD_CMD_READ )
+		{
+			if( req->length > NBD_MAX_REQUEST )
+				nbdReply(c, req->handle, EINVAL);
+			else
+				nbdRead(c, req, &hint);
+		}
+		else if( req->type == NBD_CMD_BLOCK_STATUS )
+		{
+			if( !c->baseAllocation || !req->length )
+				nbdReply(c, req->handle, EINVAL);
+			else
+				nbdBlockStatus(c, req, &hint);
+		}
+		else
+			nbdReply(c, req->handle, EINVAL);
+
+		free(q->data);
+		free(q);
+	}
+
+	return NULL;
+}
+
+static void *nbdConnection(void *arg)
+{
+	struct NbdConn *c = arg;
+
+	if( !nbdHandshake(c) )
+	{
+		close(c->sock);
+		free(c);
+		return NULL;
+	}
+
+	pthread_t workers[serveThreads];
+	for(unsigned i = 0; i < serveThreads; i++)
+		pthread_create(&workers[i], NULL, nbdWorker, c);
+
+	for(;;)
+	{
+		struct NbdRequest req;
+		if( !readFull(c->sock, &req, sizeof(req)) || be32toh(req.magic) != NBD_REQUEST_MAGIC )
+			break;
+
+		req.flags = be16toh(req.flags);
+		req.type = be16toh(req.type);
+		req.offset = be64toh(req.offset);
+		req.length = be32toh(req.length);
+
+		if( req.type == NBD_CMD_DISC )
+			break;
+
+		uint8_t *data = NULL;
+		if( serveWritable && req.type == NBD_CMD_WRITE )
+		{
+			if( req.length > NBD_MAX_REQUEST || !( data = malloc(req.length) ) )
+				break;
+			if( !readFull(c->sock, data, req.length) )
+			{
+				free(data);
+				break;
+			}
+		}
+		else if( serveWritable && req.type == NBD_CMD_TRIM )
+		{
+			nbdReply(c, req.handle, EINVAL);
+			continue;
+		}
+		else if( !serveWritable && ( req.type == NBD_CMD_WRITE || req.type == NBD_CMD_TRIM || req.type == NBD_CMD_WRITE_ZEROES ) )
+		{
+			// read-only export, skip the payload and refuse
+			if( req.type == NBD_CMD_WRITE )
+			{
+				char buf[64 * 1024];
+				uint32_t left = req.length;
+				while( left )
+				{
+					const uint32_t l = left > sizeof(buf) ? sizeof(buf) : left;
+					if( !readFull(c->sock, buf, l) )
+						goto out;
+					left -= l;
+				}
+			}
+			nbdReply(c, req.handle, EPERM);
+			continue;
+		}
+
+		else if( req.type == NBD_CMD_FLUSH && !serveWritable )
+		{
+			nbdReply(c, req.handle, 0);
+			continue;
+		}
+
+		struct NbdQueued *q = malloc(sizeof(*q));
+		q->next = NULL;
+		q->req = req;
+		q->data = data;
+
+		pthread_mutex_lock(&c->lock);
+		if( c->tail )
+			c->tail->next = q;
+		else
+			c->head = q;
+		c->tail = q;
+		pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+	}
+
+out:
+	pthread_mutex_lock(&c->lock);
+	c->closing = true;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	for(unsigned i = 0; i < serveThreads; i++)
+		pthread_join(workers[i], NULL);
+
+	close(c->sock);
+	free(c);
+	return NULL;
+}
+
+static const char *progName;
+
+static void __attribute__((noreturn)) usage(void)
+{
+	fprintf(stderr, "usage: %s serve [-b address] [-p port | -U socket] [-t threads] [-e export] [-F] [-I indexDir] root.img [child.img ...]\n", progName);
+	fprintf(stderr, "       %s cor [-b address] [-p port | -U socket] [-t threads] [-e export] [-F] [-I indexDir] [-B bitmap] [-c chunkSize] [-r MB/s] target.raw root.img [child.img ...]\n", progName);
+	fprintf(stderr, "       %s copy [-F] [-I indexDir] [-O qcow2 [-B backing] [-c]] [--direct] [--explain] [--calibrate] [--prealloc [--extsize MiB]] target root.img [child.img ...]\n", progName);
+	fprintf(stderr, "       %s census [-F] [-I indexDir] [-r MB/s] [--json extents.json] root.img [child.img ...]\n", progName);
+	fprintf(stderr, "\n  -F  skip the blocks the guest NTFS and ext4 file systems have free\n");
+	fprintf(stderr, "  -I  keep the extent maps of the images in indexDir, an image not changed since is not walked again\n");
+	fprintf(stderr, "  A single VMware image (descriptor, COWD delta or sparse extent) is followed down to its base.\n");
+	exit(1);
+}
+
+/*
+ * Options common to the NBD modes.
+ */
+static void serveOption(int opt)
+{
+	switch( opt )
+	{
+		case 'b':
+			serveAddress = optarg;
+			break;
+		case 'p':
+			servePort = atoi(optarg);
+			break;
+		case 'U':
+			serveSocket = optarg;
+			break;
+		case 't':
+			serveThreads = atoi(optarg);
+			if( !serveThreads )
+				usage();
+			break;
+		case 'e':
+			serveExport = optarg;
+			break;
+		case 'F':
+			serveSkipGuestFree = true;
+			break;
+		case 'I':
+			indexDir = optarg;
+			break;
+		default:
+			usage();
+	}
+}
+
+static void __attribute__((noreturn)) serveLoop(void)
+{
+	int lsock;
+	if( serveSocket )
+	{
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+		if( strlen(serveSocket) >= sizeof(sun.sun_path) )
+		{
+			fprintf(stderr, "socket path too long\n");
+			exit(1);
+		}
+		strcpy(sun.sun_path, serveSocket);
+		unlink(serveSocket);
+
+		lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if( lsock == -1 || bind(lsock, (struct sockaddr *)&sun, sizeof(sun)) != 0 )
+		{
+			perror(serveSocket);
+			exit(1);
+		}
+		printf("serving on nbd+unix:///%s?socket=%s\n", serveExport, serveSocket);
+	}
+	else
+	{
+		struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(servePort) };
+		if( inet_pton(AF_INET, serveAddress, &sin.sin_addr) != 1 )
+		{
+			fprintf(stderr, "invalid address %s\n", serveAddress);
+			exit(1);
+		}
+
+		lsock = socket(AF_INET, SOCK_STREAM, 0);
+		const int one = 1;
+		setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if( lsock == -1 || bind(lsock, (struct sockaddr *)&sin, sizeof(sin)) != 0 )
+		{
+			perror("bind");
+			exit(1);
+		}
+		printf("serving on nbd://%s:%u/%s\n", serveAddress, servePort, serveExport);
+	}
+
+	if( listen(lsock, 16) != 0 )
+	{
+		perror("listen");
+		exit(1);
+	}
+	fflush(stdout);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for(;;)
+	{
+		const int sock = accept(lsock, NULL, NULL);
+		if( sock == -1 )
+		{
+			if( errno == EINTR || errno == ECONNABORTED )
+				continue;
+			perror("accept");
+			exit(1);
+		}
+
+		if( !serveSocket )
+		{
+			const int one = 1;
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+
+		struct NbdConn *c = calloc(1, sizeof(*c));
+		c->sock = sock;
+		pthread_mutex_init(&c->sendLock, NULL);
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->cond, NULL);
+
+		pthread_t thread;
+		if( pthread_create(&thread, NULL, nbdConnection, c) != 0 )
+		{
+			perror("pthread_create");
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+}
+
+static int serve(int argc, char *argv[])
+{
+	int opt;
+	while( (opt = getopt(argc, argv, "b:p:U:t:e:FI:")) != -1 )
+		serveOption(opt);
+
+	if( optind == argc )
+		usage();
+
+	chainOpen(&serveChain, argc - optind, argv + optind);
+	if( serveSkipGuestFree )
+		chainSkipGuestFree(&serveChain);
+	printf("virtualSize=%" PRIu64 "\n", serveChain.virtualSize);
+
+	serveLoop();
+}
+
+static void *corFiller(void *arg)
+{
+	uint64_t hint = 0;
+	uint64_t cursor = 0;
+	uint64_t sinceSync = 0;
+	uint64_t bytes = 0;
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(;;)
+	{
+		uint64_t chunk = cor.chunks;
+
+		pthread_mutex_lock(&cor.prioLock);
+		if( cor.prioHead != cor.prioTail )
+		{
+			chunk = cor.prio[cor.prioHead];
+			cor.prioHead = (cor.prioHead + 1) % COR_PRIO;
+		}
+		pthread_mutex_unlock(&cor.prioLock);
+
+		if( chunk == cor.chunks )
+		{
+			while( cursor < cor.chunks && corIsCopied(cursor) )
+				cursor++;
+			if( cursor == cor.chunks )
+				break;
+			chunk = cursor;
+		}
+
+		if( corIsCopied(chunk) )
+			continue;
+
+		if( !corEnsure(chunk, &hint) )
+		{
+			fprintf(stderr, "copying chunk %" PRIu64 " failed\n", chunk);
+			exit(1);
+		}
+		bytes += corChunkLen(chunk);
+
+		if( ++sinceSync == COR_SYNC_CHUNKS )
+		{
+			corSync();
+			sinceSync = 0;
+			printf("copied %" PRIu64 "/%" PRIu64 " chunks\n", __atomic_load_n(&cor.copiedCount, __ATOMIC_RELAXED), cor.chunks);
+			fflush(stdout);
+		}
+
+		if( cor.rateLimit )
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			const double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+			const double ahead = (double)bytes / cor.rateLimit - elapsed;
+			if( ahead > 0 )
+				usleep(ahead * 1e6);
+		}
+	}
+
+	corSync();
+	printf("fill complete, %s no longer needs the source images\n", cor.targetPath);
+	fflush(stdout);
+	return NULL;
+}
+
+static int corMain(int argc, char *argv[])
+{
+	const char *bitmapPath = NULL;
+	cor.chunkSize = 1024 * 1024;
+
+	int opt;
+	while( (opt = getopt(argc, argv, "b:p:U:t:e:FI:B:c:r:")) != -1 )
+	{
+		switch( opt )
+		{
+			case 'B':
+				bitmapPath = optarg;
+				break;
+			case 'c':
+				cor.chunkSize = strtoull(optarg, NULL, 0);
+				if( cor.chunkSize < 4096 || cor.chunkSize % 4096 )
+				{
+					fprintf(stderr, "chunk size must be a multiple of 4096\n");
+					exit(1);
+				}
+				break;
+			case 'r':
+				cor.rateLimit = strtoull(optarg, NULL, 0) * 1024 * 1024;
+				break;
+			default:
+				serveOption(opt);
+		}
+	}
+
+	if( argc - optind < 2 )
+		usage();
+
+	cor.targetPath = argv[optind];
+	chainOpen(&serveChain, argc - optind - 1, argv + optind + 1);
+	if( serveSkipGuestFree )
+		chainSkipGuestFree(&serveChain);
+	printf("virtualSize=%" PRIu64 "\n", serveChain.virtualSize);
+
+	cor.target = open(cor.targetPath, O_RDWR);
+	if( cor.target == -1 )
+	{
+		perror(cor.targetPath);
+		exit(1);
+	}
+	if( lseek(cor.target, 0, SEEK_END) < serveChain.virtualSize )
+	{
+		fprintf(stderr, "%s is smaller than the image\n", cor.targetPath);
+		exit(1);
+	}
+
+	cor.chunks = (serveChain.virtualSize + cor.chunkSize - 1) / cor.chunkSize;
+	const uint64_t words = (cor.chunks + 63) / 64;
+	cor.copied = calloc(words, sizeof(*cor.copied));
+	for(unsigned i = 0; i < COR_LOCKS; i++)
+		pthread_mutex_init(&cor.locks[i], NULL);
+	pthread_mutex_init(&cor.syncLock, NULL);
+	pthread_mutex_init(&cor.prioLock, NULL);
+
+	// by default the bitmap lives next to the top image
+	char defaultBitmap[PATH_MAX];
+	if( !bitmapPath )
+	{
+		snprintf(defaultBitmap, sizeof(defaultBitmap), "%s.copied", argv[argc - 1]);
+		bitmapPath = defaultBitmap;
+	}
+
+	cor.bitmapFd = open(bitmapPath, O_RDWR | O_CREAT, 0644);
+	if( cor.bitmapFd == -1 )
+	{
+		perror(bitmapPath);
+		exit(1);
+	}
+
+	struct CorBitmapHeader hdr;
+	const ssize_t res = pread(cor.bitmapFd, &hdr, sizeof(hdr), 0);
+	if( res == sizeof(hdr) )
+	{
+		if( memcmp(hdr.magic, COR_MAGIC, 8) != 0 || hdr.virtualSize != serveChain.virtualSize || hdr.chunkSize != cor.chunkSize )
+		{
+			fprintf(stderr, "%s doesn't match this image or chunk size\n", bitmapPath);
+			exit(1);
+		}
+		if( !preadFull(cor.bitmapFd, cor.copied, words * sizeof(*cor.copied), sizeof(hdr)) )
+		{
+			fprintf(stderr, "%s is truncated\n", bitmapPath);
+			exit(1);
+		}
+		for(uint64_t i = 0; i < cor.chunks; i++)
+			if( corIsCopied(i) )
+				cor.copiedCount++;
+		printf("resuming, %" PRIu64 "/%" PRIu64 " chunks already copied\n", cor.copiedCount, cor.chunks);
+	}
+	else if( res == 0 )
+	{
+		hdr = (struct CorBitmapHeader){ COR_MAGIC, serveChain.virtualSize, cor.chunkSize, 0 };
+		if( !pwriteFull(cor.bitmapFd, &hdr, sizeof(hdr), 0) )
+		{
+			perror(bitmapPath);
+			exit(1);
+		}
+	}
+	else
+	{
+		fprintf(stderr, "%s: invalid bitmap\n", bitmapPath);
+		exit(1);
+	}
+
+	// chunks no layer has data for stay as they are on the (new) target
+	{
+		uint64_t next = 0;
+		for(uint64_t i = 0; i < serveChain.map.count; i++)
+		{
+			const struct Extent *e = &serveChain.map.ext[i];
+			for(uint64_t chunk = next; chunk < e->virtOffset / cor.chunkSize; chunk++)
+				if( !corIsCopied(chunk) )
+					corMarkCopied(chunk);
+			const uint64_t last = (e->virtOffset + e->length - 1) / cor.chunkSize + 1;
+			if( last > next )
+				next = last;
+		}
+		for(uint64_t chunk = next; chunk < cor.chunks; chunk++)
+			if( !corIsCopied(chunk) )
+				corMarkCopied(chunk);
+	}
+	corSync();
+
+	pthread_t filler;
+	if( pthread_create(&filler, NULL, corFiller, NULL) != 0 )
+	{
+		perror("pthread_create");
+		exit(1);
+	}
+	pthread_detach(filler);
+
+	serveWritable = true;
+	serveLoop();
+}
+
+/*
+ * Write the merged chain to the target, each grain once, from the layer
+ * that has the latest version of it. The target must be zeroed, zero
+ * extents are only written when there is a backing file for them to hide.
+ */
+static int copyMain(int argc, char *argv[])
+{
+	struct OutputOptions outOpts = {};
+	bool skipGuestFree = false;
+	int opt;
+	while( (opt = getopt_long(argc, argv, "O:B:cFI:", outputLongOptions, NULL)) != -1 )
+	{
+		if( opt == 'F' )
+			skipGuestFree = true;
+		else if( opt == 'I' )
+			indexDir = optarg;
+		else if( !outputOption(&outOpts, opt, optarg) )
+			usage();
+	}
+
+	if( argc - optind < 2 )
+		usage();
+
+	struct Chain chain;
+	chainOpen(&chain, argc - optind - 1, argv + optind + 1);
+	if( skipGuestFree )
+		chainSkipGuestFree(&chain);
+	printf("virtualSize=%" PRIu64 "\n", chain.virtualSize);
+
+	struct Output out;
+	outputInit(&out, NULL, 0, chain.virtualSize);
+	outputOpenOptions(&out, &outOpts, argv[optind], O_RDWR);
+	// the merged map is known, it's allocated before anything is written
+	if( outOpts.prealloc )
+		outputPreallocate(&out, &chain.map, false);
+
+	uint64_t written = 0, reported = 0;
+	for(uint64_t i = 0; i < chain.map.count; i++)
+	{
+		const struct Extent *e = &chain.map.ext[i];
+		if( e->virtOffset >= chain.virtualSize )
+			break;
+		const uint64_t len = e->length < chain.virtualSize - e->virtOffset ? e->length : chain.virtualSize - e->virtOffset;
+
+		if( e->fileOffset != EXTENT_ZERO )
+		{
+			outputBuffer(&out, e->virtOffset, chain.layers[e->layer].base + e->fileOffset, len);
+			written += len;
+		}
+		else if( outOpts.backing )
+			outputZero(&out, e->virtOffset, len);
+
+		if( written - reported >= 1024 * 1024 * 1024 )
+		{
+			reported = written;
+			printf("%" PRIu64 " MiB written, at %" PRIu64 " MiB\r", written >> 20, e->virtOffset >> 20);
+			fflush(stdout);
+		}
+	}
+
+	printf("\n%" PRIu64 " MiB written\nsyncing\n", written >> 20);
+	outputClose(&out);
+	return 0;
+}
+
+/*
+ * What a copy of the chain would write, from the metadata alone: per layer
+ * and merged, with the time it takes at the given rate.
+ */
+static int censusMain(int argc, char *argv[])
+{
+	const char *jsonPath = NULL;
+	double rate = 200;
+	bool skipGuestFree = false;
+	int opt;
+	while( (opt = getopt_long(argc, argv, "r:FI:", outputLongOptions, NULL)) != -1 )
+	{
+		if( opt == 'r' )
+			rate = atof(optarg);
+		else if( opt == 'F' )
+			skipGuestFree = true;
+		else if( opt == 'I' )
+			indexDir = optarg;
+		else if( opt == OUTPUT_OPT_JSON )
+			jsonPath = optarg;
+		else
+			usage();
+	}
+
+	if( argc - optind < 1 || rate <= 0 )
+		usage();
+
+	const double start = targetNow();
+	struct Chain chain;
+	chainOpen(&chain, argc - optind, argv + optind);
+	if( skipGuestFree )
+		chainSkipGuestFree(&chain);
+
+	for(unsigned i = 0; i < chain.layersCount; i++)
+	{
+		const struct ExtentCensus *c = &chain.layers[i].census;
+		printf("%s: %" PRIu64 " MiB allocated (%" PRIu64 " MiB in partly present blocks), %" PRIu64 " MiB zero\n",
+			chain.layers[i].path, c->data >> 20, c->partial >> 20, c->zero >> 20);
+	}
+
+	chain.map.virtualSize = chain.virtualSize;
+	struct ExtentCensus c;
+	extentMapCensus(&chain.map, &c);
+	if( jsonPath )
+		extentMapSaveJson(&chain.map, &c, jsonPath);
+
+	printf("virtualSize=%" PRIu64 "\n", chain.virtualSize);
+	printf("allocated=%" PRIu64 "\n", c.data);
+	printf("zero=%" PRIu64 "\n", c.zero);
+	printf("unallocated=%" PRIu64 "\n", c.unallocated);
+	printf("extents=%" PRIu64 "\n", c.extents);
+	printf("eta=%.0f\n", c.data / (rate * 1e6));
+	fprintf(stderr, "census took %.2f s\n", targetNow() - start);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	progName = argv[0];
+	if( argc < 2 )
+		usage();
+
+	if( strcmp(argv[1], "serve") == 0 )
+		return serve(argc - 1, argv + 1);
+	else if( strcmp(argv[1], "cor") == 0 )
+		return corMain(argc - 1, argv + 1);
+	else if( strcmp(argv[1], "copy") == 0 )
+		return copyMain(argc - 1, argv + 1);
+	else if( strcmp(argv[1], "census") == 0 )
+		return censusMain(argc - 1, argv + 1);
+
+	usage();
+}
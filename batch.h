@@ -0,0 +1,240 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * Batches of compressed clusters (qcow2) or grains (vmdk), decoded by a
+ * pool of threads while the main thread writes the batch before.
+ *
+ * The converter adds its items in virtual order with batchAdd(). When a
+ * batch is full the threads are given it as soon as they are done with
+ * the previous one, and only then is the previous one written, so
+ * decoding one batch and writing the other overlap. The items are written
+ * with the converter's callback in the order they were added, the data
+ * each one decoded to is at "unitSize" bytes per item in the batch's
+ * buffer. batchFinish() writes what is left and stops the threads.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "output.h"
+
+typedef void (*BatchDecode)(const void *item, uint8_t *dst);
+typedef void (*BatchWrite)(struct Output *out, const void *item, const uint8_t *data);
+
+struct Batch
+{
+	uint8_t			*items;
+	unsigned		count;
+	uint8_t			*buf;
+	atomic_uint		next;
+};
+
+struct BatchPipeline
+{
+	struct Batch	batches[2];
+	struct Batch	*filling;
+	struct Batch	*decoding;		// NULL if the threads have nothing
+	size_t			itemSize;
+	unsigned		capacity;
+	uint64_t		unitSize;
+	BatchDecode		decode;
+	BatchWrite		write;
+	struct Output	*out;
+
+	// the threads wait for "generation" to change, "busy" of them haven't
+	// finished the current batch yet
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	pthread_cond_t	idle;
+	unsigned		generation;
+	unsigned		busy;
+	bool			quit;
+	unsigned		threadsCount;
+	pthread_t		*threads;
+};
+
+static inline void *batchWorker(void *arg)
+{
+	struct BatchPipeline *p = arg;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for(;;)
+	{
+		while( p->generation == seen && !p->quit )
+			pthread_cond_wait(&p->wake, &p->lock);
+		if( p->quit )
+			break;
+		seen = p->generation;
+		struct Batch *b = p->decoding;
+		pthread_mutex_unlock(&p->lock);
+
+		for(;;)
+		{
+			const unsigned i = atomic_fetch_add(&b->next, 1);
+			if( i >= b->count )
+				break;
+			p->decode(b->items + i * p->itemSize, b->buf + i * p->unitSize);
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if( --p->busy == 0 )
+			pthread_cond_signal(&p->idle);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static inline void batchInit(struct BatchPipeline *p, struct Output *out, size_t itemSize, unsigned capacity,
+	uint64_t unitSize, unsigned threadsCount, BatchDecode decode, BatchWrite write)
+{
+	memset(p, 0, sizeof(*p));
+	p->itemSize = itemSize;
+	p->capacity = capacity;
+	p->unitSize = unitSize;
+	p->decode = decode;
+	p->write = write;
+	p->out = out;
+	p->filling = &p->batches[0];
+	p->threadsCount = threadsCount;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	pthread_cond_init(&p->idle, NULL);
+
+	for(int i = 0; i < 2; i++)
+	{
+		p->batches[i].items = calloc(capacity, itemSize);
+		p->batches[i].buf = mmap(NULL, capacity * unitSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if( !p->batches[i].items || p->batches[i].buf == MAP_FAILED )
+		{
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	p->threads = calloc(threadsCount, sizeof(pthread_t));
+	if( !p->threads )
+	{
+		perror("malloc");
+		exit(1);
+	}
+	for(unsigned t = 0; t < threadsCount; t++)
+	{
+		const int res = pthread_create(&p->threads[t], NULL, batchWorker, p);
+		if( res )
+		{
+			fprintf(stderr, "pthread_create: %s\n", strerror(res));
+			exit(1);
+		}
+	}
+}
+
+/*
+ * Wait for the threads to finish the batch they have, NULL if there is
+ * none.
+ */
+static inline struct Batch *batchWait(struct BatchPipeline *p)
+{
+	pthread_mutex_lock(&p->lock);
+	while( p->busy )
+		pthread_cond_wait(&p->idle, &p->lock);
+	struct Batch *b = p->decoding;
+	p->decoding = NULL;
+	pthread_mutex_unlock(&p->lock);
+	return b;
+}
+
+static inline void batchWrite(struct BatchPipeline *p, struct Batch *b)
+{
+	for(unsigned i = 0; i < b->count; i++)
+		p->write(p->out, b->items + i * p->itemSize, b->buf + i * p->unitSize);
+
+	// the buffer gets reused for the next batch
+	outputFlush(p->out);
+	b->count = 0;
+}
+
+/*
+ * Hand the filling batch to the threads, then write the one they had
+ * while they decode it.
+ */
+static inline void batchDispatch(struct BatchPipeline *p)
+{
+	struct Batch *prev = batchWait(p);
+	struct Batch *b = p->filling;
+
+	atomic_store(&b->next, 0);
+	pthread_mutex_lock(&p->lock);
+	p->decoding = b;
+	p->busy = p->threadsCount;
+	p->generation++;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	p->filling = b == &p->batches[0] ? &p->batches[1] : &p->batches[0];
+	if( prev )
+		batchWrite(p, prev);
+}
+
+static inline void batchAdd(struct BatchPipeline *p, const void *item)
+{
+	struct Batch *b = p->filling;
+	memcpy(b->items + b->count * p->itemSize, item, p->itemSize);
+	if( ++b->count == p->capacity )
+		batchDispatch(p);
+}
+
+static inline void batchFinish(struct BatchPipeline *p)
+{
+	if( p->filling->count )
+		batchDispatch(p);
+	struct Batch *last = batchWait(p);
+	if( last )
+		batchWrite(p, last);
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	for(unsigned t = 0; t < p->threadsCount; t++)
+		pthread_join(p->threads[t], NULL);
+	free(p->threads);
+}
+
+#endif
@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+"""
+Copyright (c) 2020  StorPool.
+All rights reserved.
+
+
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+"""
+
+"""
+Run a converter against simulated targets (simtarget.so) and compare the
+runs: the time, what the target saw, and whether the output is right.
+
+./bench-target.py -p storpool -p hdd -q 1,4,8 --ref disk.raw /tmp/out.raw -- \\
+    ./vhd --depth {depth} disk.vhd {target}
+
+{target} and {depth} in the command are replaced for every run. The target
+is created again before each run, as large as the reference or --size.
+
+A run passes if the converter succeeds and the output matches the
+reference, or if it fails after the simulator injected an I/O error. A
+crash, a failure without an injected error, or a wrong output fails it,
+and the script exits with 1.
+"""
+
+
+import argparse
+import filecmp
+import json
+import os
+import statistics
+import subprocess
+import sys
+import time
+
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# SIMTARGET_* settings, see simtarget.c
+PROFILES = {
+    'local': {},
+    'ssd': { 'latency': 'exp:100', 'bw': 1500, 'qd': 32 },
+    'storpool': { 'latency': 'normal:300:80', 'tail': '0.001:20000',
+        'bw': 1000, 'qd': 64, 'block': 4096, 'rmw': 400 },
+    'hdd': { 'latency': 'exp:8000', 'bw': 150, 'qd': 4, 'block': 4096,
+        'rmw': 8000 },
+    'short': { 'latency': 'normal:300:80', 'bw': 1000, 'qd': 64,
+        'short': 0.05 },
+    'eio': { 'latency': 'normal:300:80', 'bw': 1000, 'qd': 64,
+        'eio': 0.01 },
+}
+
+# summed over the processes of a run, the rest take the largest
+SUM_STATS = ('reads', 'readBytes', 'writes', 'writeBytes', 'iovecs',
+        'unaligned', 'eio', 'short', 'syncs', 'queueWait', 'service')
+
+
+def parse_profile(spec):
+    """ A profile name, or name:key=value,... on top of a known profile or
+    from nothing. """
+    name, _, settings = spec.partition(':')
+    profile = dict(PROFILES.get(name, {}))
+    if not settings and name not in PROFILES:
+        raise ValueError('unknown profile {}, known are {}'.format(
+            name, ', '.join(sorted(PROFILES))))
+    for kv in filter(None, settings.split(',')):
+        k, _, v = kv.partition('=')
+        profile[k] = v
+    return name, profile
+
+
+def read_stats(path):
+    stats = {}
+    if not os.path.exists(path):
+        return stats
+    with open(path) as f:
+        for line in f:
+            k, _, v = line.strip().partition('=')
+            if k == 'pid':
+                continue
+            v = float(v)
+            if k in SUM_STATS or k.startswith('size'):
+                stats[k] = stats.get(k, 0) + v
+            else:
+                stats[k] = max(stats.get(k, 0), v)
+    return stats
+
+
+def run_one(args, profile, depth):
+    if os.path.exists(args.target):
+        os.unlink(args.target)
+    with open(args.target, 'wb') as f:
+        f.truncate(args.size)
+    stats_path = args.target + '.stats'
+    if os.path.exists(stats_path):
+        os.unlink(stats_path)
+
+    env = dict(os.environ)
+    env['LD_PRELOAD'] = args.sim
+    env['SIMTARGET'] = args.target
+    env['SIMTARGET_STATS'] = stats_path
+    env['SIMTARGET_SEED'] = str(args.seed)
+    for k, v in profile.items():
+        env['SIMTARGET_' + k.upper()] = str(v)
+
+    cmd = [ a.format(target=args.target, depth=depth) for a in args.command ]
+    start = time.time()
+    with open(args.log, 'a') as log:
+        log.write('# {}\n'.format(' '.join(cmd)))
+        log.flush()
+        res = subprocess.call(cmd, env=env, stdin=subprocess.DEVNULL,
+                stdout=log, stderr=subprocess.STDOUT)
+    elapsed = time.time() - start
+
+    stats = read_stats(stats_path)
+    if os.path.exists(stats_path):
+        os.unlink(stats_path)
+
+    if res < 0:
+        verdict = 'FAIL (signal {})'.format(-res)
+    elif res:
+        verdict = 'ok (failed on EIO)' if stats.get('eio') else 'FAIL (exit {})'.format(res)
+    elif args.ref and not filecmp.cmp(args.target, args.ref, shallow=False):
+        verdict = 'FAIL (wrong output)'
+    else:
+        verdict = 'ok'
+    return elapsed, stats, verdict
+
+
+def main():
+
+    parser = argparse.ArgumentParser(
+            description='Benchmark a converter against simulated targets')
+    parser.add_argument('target', help='The target file, created for every run')
+    parser.add_argument('command', nargs='+',
+            help='The converter and its arguments, with {target} and {depth}')
+    parser.add_argument('-p', '--profile', action='append',
+            help='A target profile: {}, or name:key=value,... to change or '
+            'make one. Can be given more than once. Default is local.'.format(
+            ', '.join(sorted(PROFILES))))
+    parser.add_argument('-q', '--depth', default='1',
+            help='Comma separated writes in flight to try, put in {depth}. '
+            'Default is 1.')
+    parser.add_argument('-r', '--runs', type=int, default=1,
+            help='Runs of every combination, the median time is reported. '
+            'Default is 1.')
+    parser.add_argument('--ref', help='What the output should be')
+    parser.add_argument('-s', '--size', type=int,
+            help='The target size, bytes. Default is the size of --ref.')
+    parser.add_argument('--sim', default=os.path.join(TOOLS_DIR, 'simtarget.so'),
+            help='The simulator library. Default is simtarget.so here.')
+    parser.add_argument('--seed', type=int, default=1,
+            help='For the random latencies and faults. Default is 1.')
+    parser.add_argument('--log', default='bench-target.log',
+            help='The output of the converter. Default is bench-target.log.')
+    parser.add_argument('--json', help='Write the results here, JSON')
+
+    args = parser.parse_args()
+    args.target = os.path.abspath(args.target)
+    args.sim = os.path.abspath(args.sim)
+    if args.size is None:
+        if not args.ref:
+            parser.error('--size or --ref is needed')
+        args.size = os.path.getsize(args.ref)
+    depths = [ int(d) for d in args.depth.split(',') ]
+    if len(depths) > 1 and not any('{depth}' in a for a in args.command):
+        parser.error('several depths, but no {depth} in the command')
+    profiles = [ parse_profile(p) for p in args.profile or [ 'local' ] ]
+
+    print('{:<10} {:>5} {:>8} {:>8} {:>7} {:>8} {:>6} {:>9} {:>9}  {}'.format(
+        'profile', 'depth', 'seconds', 'MiB/s', 'writes', 'KiB/wr', 'qd',
+        'unaligned', 'faults', 'verdict'))
+    results = []
+    failed = False
+    for name, profile in profiles:
+        for depth in depths:
+            runs = [ run_one(args, profile, depth) for _ in range(args.runs) ]
+            elapsed = statistics.median(r[0] for r in runs)
+            stats = runs[-1][1]
+            verdicts = [ r[2] for r in runs ]
+            verdict = next((v for v in verdicts if v.startswith('FAIL')), verdicts[-1])
+            failed = failed or verdict.startswith('FAIL')
+
+            writes = stats.get('writes', 0)
+            written = stats.get('writeBytes', 0)
+            print('{:<10} {:>5} {:>8.2f} {:>8.1f} {:>7} {:>8.1f} {:>6} {:>9} {:>9}  {}'.format(
+                name, depth, elapsed, written / 1024.0 ** 2 / elapsed if elapsed else 0,
+                int(writes), written / 1024.0 / writes if writes else 0,
+                int(stats.get('maxInFlight', 0)), int(stats.get('unaligned', 0)),
+                int(stats.get('eio', 0) + stats.get('short', 0)), verdict))
+            sys.stdout.flush()
+            results.append({ 'profile': name, 'settings': profile, 'depth': depth,
+                'seconds': [ r[0] for r in runs ], 'stats': stats,
+                'verdicts': verdicts })
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+    if failed:
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -31,10 +31,18 @@ All rights reserved.
 
 
 import argparse
+import fcntl
+import json
 import md5
 import os
 import socket
 import subprocess
+import tempfile
+import time
+
+
+# another pass is worth it if it at least halves the downtime
+PASS_PAYOFF = 0.5
 
 
 def exec_ssh(host, cmd):
@@ -57,15 +65,17 @@ def windows2unix(path):
 def hash_filename(path):
     return md5.new(path.upper()).hexdigest()
 
-def copy_file_from_hv(args, transfer_dir, path):
-    # path is in windows format
+def copy_file_from_hv(args, transfer_dir, path, img_name=None):
+    # path is in windows format; a given name is downloaded again
 
-    img_name = hash_filename(path)
+    fresh = img_name is not None
+    if not fresh:
+        img_name = hash_filename(path)
     dst = os.path.join(args.dir, img_name)
 
     print "Downloading {} ({})".format(img_name, path)
 
-    if os.path.isfile(dst):
+    if os.path.isfile(dst) and not fresh:
         print "File {} already exists. Skipping.".format(img_name)
         return dst
 
@@ -75,6 +85,9 @@ def copy_file_from_hv(args, transfer_dir, path):
             "{u}@{h}:/'{p}'".format(u=args.user, h=args.host, p=upath),
             os.path.join(transfer_dir, img_name),
             ]
+    if args.bwlimit:
+        # scp takes Kbit/s
+        cmd[2:2] = [ '-l', str(args.bwlimit * 8) ]
 
     try:
         subprocess.check_call(cmd)
@@ -115,25 +128,151 @@ def get_parent(args, path):
     return output.strip()
 
 
-def convert_image(src, dst):
-
-    info = get_info(src)
-    if not os.path.exists(dst):
-        # Create sparse file
-        size = int(info.get('virtualSize'))  # in bytes
-        size_mb = (size - 1) // 1024 // 1024 + 1
-        print "Creating sparce raw output image " + dst
-        try:
-            subprocess.check_call([ 'dd', 'if=/dev/zero', 'of='+dst,
-                'bs=1', 'count=0', 'seek={}M'.format(size_mb)
-                ])
-        except subprocess.CalledProcessError as e:
-            print e.output
-            raise
+def cache_path(args, guid):
+    return os.path.join(args.base_cache, 'vhdx-{}.raw'.format(guid))
+
+def seed_output(cached, dst):
+    # a clone where the file system can share the blocks, the data copied
+    # otherwise
+    print "Seeding {} from {}".format(dst, cached)
+    if not os.path.exists(dst) or os.path.isfile(dst):
+        if subprocess.call([ 'cp', '--reflink=always', cached, dst ],
+                stderr=open(os.devnull, 'w')) == 0:
+            return
+        # a failed clone may leave an empty file behind
+        with open(dst, 'ab') as f:
+            if f.tell() < os.path.getsize(cached):
+                f.truncate(os.path.getsize(cached))
+    try:
+        subprocess.check_call([ './flat', cached, dst ])
+    except subprocess.CalledProcessError as e:
+        print e.output
+        raise
 
+def cache_root(args, transfer_dir, chain, dst):
+    # the root is known by its DataWriteGuid, which the next image has as
+    # its parent linkage, so a cached root is not downloaded again
+    cached = None
+    if len(chain) > 1:
+        image = copy_file_from_hv(args, transfer_dir, chain[1])
+        cached = cache_path(args, get_info(image)['parentDataGuid'])
+
+    if not cached or not os.path.exists(cached):
+        image = copy_file_from_hv(args, transfer_dir, chain[0])
+        cached = cache_path(args, get_info(image)['dataGuid'])
+        # VMs of the same template may be converted at the same time
+        with open(cached + '.lock', 'w') as lock:
+            fcntl.flock(lock, fcntl.LOCK_EX)
+            if not os.path.exists(cached):
+                tmp = cached + '.tmp'
+                if os.path.exists(tmp):
+                    os.unlink(tmp)
+                convert_image(image, tmp)
+                os.rename(tmp, cached)
+    else:
+        print "Root {} is cached as {}".format(chain[0], cached)
+    seed_output(cached, dst)
+
+def allocated(image):
+    # the data converting the image writes, from its metadata only
+    fd, tmp = tempfile.mkstemp(suffix='.json')
+    os.close(fd)
+    try:
+        with open(os.devnull, 'w') as null:
+            subprocess.check_call([ './vhdx', '--dry-run', '--json', tmp, image ],
+                    stdout=null, stderr=null)
+        with open(tmp) as f:
+            return json.load(f)['allocated']
+    finally:
+        os.unlink(tmp)
+
+def passes_path(args):
+    return os.path.join(args.dir, 'passes.json')
+
+def load_passes(args):
+    if not os.path.exists(passes_path(args)):
+        return []
+    with open(passes_path(args)) as f:
+        return json.load(f)
+
+def record_pass(args, converted, seconds):
+    # the throughput of the passes, for --estimate
+    passes = load_passes(args)
+    passes.append({ 'time': time.time(), 'bytes': converted, 'seconds': seconds })
+    with open(passes_path(args), 'w') as f:
+        json.dump(passes[-20:], f)
+
+def fmt_mib(n):
+    return '{:.1f} MiB'.format(n / 1024.0 ** 2)
+
+def estimate(args, transfer_dir):
+    passes = load_passes(args)
+    if args.rate:
+        rate = args.rate * 1000.0 ** 2
+    elif passes:
+        rate = passes[-1]['bytes'] / max(passes[-1]['seconds'], 0.001)
+    else:
+        raise SystemExit('No pass has been run yet to measure the throughput '
+                'of, give it with --rate')
+
+    # the top image's allocation over time, downloaded aside each time so
+    # the next pass doesn't take a sample for the image
+    samples = []
+    for i in range(3):
+        if i:
+            time.sleep(args.estimate)
+        t = time.time()
+        image = copy_file_from_hv(args, transfer_dir, args.path,
+                hash_filename(args.path) + '.sample')
+        samples.append((t, allocated(image)))
+        os.unlink(image)
+        print '{} top image {}'.format(time.strftime('%H:%M:%S',
+            time.localtime(t)), fmt_mib(samples[-1][1]))
+
+    (t0, a0), (t1, a1) = samples[-2:]
+    growth = max(0, (a1 - a0) / (t1 - t0))
+    downtime = a1 / rate
+    # a pass converts what the top holds now while the next top grows
+    next_downtime = growth * downtime / rate
+    print 'Throughput {}/s, the top image grows {}/s'.format(fmt_mib(rate), fmt_mib(growth))
+    print('Downtime of the --finish pass now: {:.0f} s, after another pass: {:.0f} s'
+            .format(downtime, next_downtime))
+
+    if downtime <= args.downtime:
+        print 'Stop the VM and run with --finish.'
+    elif growth >= rate:
+        print('The top image grows faster than it is converted, passes will not '
+                'catch up. Stop the VM and run with --finish, or lower its load.')
+    elif next_downtime > downtime * PASS_PAYOFF:
+        print 'Another pass has stopped paying off. Stop the VM and run with --finish.'
+    else:
+        print 'Checkpoint the VM and run another pass with --start-at.'
+
+
+def resync_state(args, image, keep):
+    # what --resync skips is only right if nothing was written to the
+    # output since the image was, so only the state of the image written
+    # last is kept, for the first image of the next pass
+    d = os.path.join(args.dir, 'resync')
+    if not os.path.isdir(d):
+        os.makedirs(d)
+    state = os.path.join(d, os.path.basename(image) + '.state') if image else None
+    for name in os.listdir(d):
+        if not keep or os.path.join(d, name) != state:
+            os.unlink(os.path.join(d, name))
+    return state
+
+
+def convert_image(src, dst, state=None):
+
+    # the converter creates the output, and allocates what it writes in
+    # one piece before it writes it
     print "Converting {}".format(src)
+    cmd = [ './vhdx', '--prealloc', src, dst ]
+    if state:
+        cmd[1:1] = [ '--resync', state ]
     try:
-        output = subprocess.check_output([ './vhdx', src, dst ])
+        output = subprocess.check_output(cmd)
     except subprocess.CalledProcessError as e:
         print e.output
         raise
@@ -155,13 +294,34 @@ def main():
             dest='dir',
             help='Temporary directory where Hyper-V images will be downloaded'
                 ' before being stored in StorPool. Default is /var/tmp/hv_convert.')
+    parser.add_argument('-b', '--bwlimit', type=int, default=0,
+            help='Limit the download to this many KiB/s.')
     parser.add_argument('-s', '--start-at',
             help='Skip converting images from root to this one, inclusive. '
             'Use this option when previous snapshots were already converted.')
+    parser.add_argument('-c', '--base-cache',
+            help='Directory of converted root images, by DataWriteGuid. A '
+            'chain whose root is there is started from a copy of it, '
+            'without downloading the root; a new root is converted there '
+            'first.')
     parser.add_argument('-f', '--finish', action='store_true',
             help='Apply the top image. Without this option the top file will '
             'be skipped. Use this option at the last invocation of the command, '
             'when the source VM is stopped.')
+    parser.add_argument('-e', '--estimate', type=int, metavar='SECONDS',
+            help='Convert nothing, sample the top image three times this many '
+            'seconds apart and tell whether to stop the VM and run the '
+            '--finish pass or to run another pass first.')
+    parser.add_argument('-t', '--downtime', type=int, default=60,
+            help='The downtime that is short enough with --estimate, seconds. '
+            'Default is 60.')
+    parser.add_argument('-r', '--rate', type=float,
+            help='The throughput for --estimate, MB/s. Default is that of the '
+            'last pass.')
+    parser.add_argument('-i', '--incremental', action='store_true',
+            help='Apply the top image in every pass, even while the VM runs, '
+            'and in the next pass only the blocks of it that changed. '
+            'Give it to all the passes, --finish included.')
 
     args = parser.parse_args()
 
@@ -170,6 +330,11 @@ def main():
     if not os.path.isdir(transfer_dir):
         os.makedirs(transfer_dir)
 
+    if args.estimate:
+        estimate(args, transfer_dir)
+        return
+    start = time.time()
+
     # Get snapshot chain
     chain = [] # root at the beginning
     path = args.path
@@ -183,20 +348,61 @@ def main():
             print("Reached the image {}, Skiping all the rest."
                     .format(args.start_at))
             break
-
-    if not args.finish:  # skip top image
+    # the root is in the chain, not converted before
+    root = not path
+    top_parent = chain[-2] if len(chain) > 1 else args.start_at
+    live = not args.finish
+
+    if args.incremental and not args.finish:
+        print('Applying the top image {} as it is now.'.format(chain[-1]))
+    elif not args.finish:  # skip top image
         print('Skipping the top image {}.'.format(chain[-1]))
         chain = chain[:-1]
+        live = False
 
     print "Chain to convert, starting from root:"
     print "\n".join(chain)
 
-    parent = None
-    for path in chain:
-        image = copy_file_from_hv(args, transfer_dir, path)
-        convert_image(image, dst)
+    # the running VM's image is not a root to share
+    if root and chain and args.base_cache and not (live and len(chain) == 1):
+        cache_root(args, transfer_dir, chain, dst)
+        chain = chain[1:]
+        if args.incremental:
+            resync_state(args, None, False)
 
-    if not args.finish and path is not None:
+    parent = None
+    converted = 0
+    for i, path in enumerate(chain):
+        # the top changes between the passes, it's downloaded again
+        fresh = None
+        if args.incremental and path == args.path:
+            fresh = hash_filename(path)
+        image = copy_file_from_hv(args, transfer_dir, path, fresh)
+        converted += allocated(image)
+        state = None
+        if args.incremental:
+            state = resync_state(args, image, i == 0)
+        try:
+            convert_image(image, dst, state)
+        except subprocess.CalledProcessError:
+            if state:
+                print('If {} lost data since the last pass, convert the chain '
+                        'again from the root, without --start-at, into an empty '
+                        'output.'.format(path))
+            raise
+    if converted:
+        record_pass(args, converted, time.time() - start)
+
+    if args.incremental and not args.finish and path is not None:
+        # the top is applied again, after the image below it
+        if top_parent:
+            print('To continue with the conversion from the current state, '
+                    'next time run this tool with `--incremental --start-at {}`'
+                    .format(top_parent))
+        else:
+            print('To continue with the conversion from the current state, '
+                    'next time run this tool with `--incremental`')
+    elif not args.finish and path is not None:
         _, image = os.path.split(path)
         print('To continue with the conversion from the current state, '
                 'next time run this tool with `--start-at {}`'
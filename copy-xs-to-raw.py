@@ -31,9 +31,18 @@ All rights reserved.
 
 
 import argparse
+import fcntl
+import json
 import os
+import shlex
 import socket
 import subprocess
+import tempfile
+import time
+
+
+# another pass is worth it if it at least halves the downtime
+PASS_PAYOFF = 0.5
 
 
 def exec_ssh(host, cmd):
@@ -44,22 +53,66 @@ def exec_ssh(host, cmd):
     return output
 
 
+def throttled_copy(cmd, dst, kbps):
+    # a pipe has no rate limit of its own, pace the reads from it
+    p = subprocess.Popen(cmd, stdout=subprocess.PIPE)
+    start = time.time()
+    done = 0
+    with open(dst, 'wb') as f:
+        while True:
+            buf = p.stdout.read(1024 * 1024)
+            if not buf:
+                break
+            f.write(buf)
+            done += len(buf)
+            ahead = done / (kbps * 1024.0) - (time.time() - start)
+            if ahead > 0:
+                time.sleep(ahead)
+    if p.wait() != 0:
+        raise subprocess.CalledProcessError(p.returncode, cmd)
+
+
+def is_lv(path):
+    # on LVM SRs the VHDs are the logical volumes VHD-<uuid>
+    return os.path.basename(path).startswith('VHD-')
+
+
 def copy_file_from_hv(args, path):
     # path is in windows format
 
+    if args.local:
+        return path
+
     src_dir, img_name = os.path.split(path)
     dst = os.path.join(args.dir, img_name)
 
     print("Downloading {} ({})".format(img_name, path))
 
-    cmd = [
-            'rsync', '-u', '--progress',
-            '{u}@{h}:/{p}'.format(u=args.user, h=args.host, p=path),
-            dst,
-            ]
+    if is_lv(path):
+        # rsync doesn't read block devices, the LV must be active on the
+        # host; the remote shell gets the path quoted
+        cmd = [
+                'ssh', '{u}@{h}'.format(u=args.user, h=args.host),
+                'dd if={p} bs=4M iflag=direct'.format(p=shlex.quote(path)),
+                ]
+        if args.bwlimit:
+            throttled_copy(cmd, dst, args.bwlimit)
+            return dst
+    else:
+        cmd = [
+                'rsync', '-u', '--progress',
+                '{u}@{h}:/{p}'.format(u=args.user, h=args.host, p=path),
+                dst,
+                ]
+        if args.bwlimit:
+            cmd.insert(1, '--bwlimit={}'.format(args.bwlimit))
 
     try:
-        subprocess.check_call(cmd)
+        if is_lv(path):
+            with open(dst, 'wb') as f:
+                subprocess.check_call(cmd, stdout=f)
+        else:
+            subprocess.check_call(cmd)
     except subprocess.CalledProcessError as e:
         print(e.output)
         raise
@@ -81,29 +134,152 @@ def get_info(path):
         info[a] = v
     return info
 
-def get_parent(image):
-    info = get_info(image)
-    return info['parentPath']
-
-def convert_image(src, dst):
-
-    info = get_info(src)
-    if not os.path.exists(dst):
-        # Create sparse file
-        size = int(info.get('size'))  # in bytes
-        size_mb = (size - 1) // 1024 // 1024 + 1
-        print("Creating sparce raw output image " + dst)
-        try:
-            subprocess.check_call([ 'dd', 'if=/dev/zero', 'of='+dst,
-                'bs=1', 'count=0', 'seek={}M'.format(size_mb)
-                ])
-        except subprocess.CalledProcessError as e:
-            print(e.output)
-            raise
+def parent_path(src_dir, image, parent):
+    # on LVM SRs the parent is named by its uuid, either as <uuid>.vhd or
+    # VHD-<uuid>, and lives in the LV VHD-<uuid>
+    if is_lv(image):
+        uuid = parent
+        if uuid.startswith('VHD-'):
+            uuid = uuid[len('VHD-'):]
+        if uuid.endswith('.vhd'):
+            uuid = uuid[:-len('.vhd')]
+        parent = 'VHD-' + uuid
+    return os.path.join(src_dir, parent)
+
+def cache_path(args, uuid):
+    return os.path.join(args.base_cache, 'vhd-{}.raw'.format(uuid))
+
+def seed_output(cached, dst):
+    # a clone where the file system can share the blocks, the data copied
+    # otherwise
+    print("Seeding {} from {}".format(dst, cached))
+    if not os.path.exists(dst) or os.path.isfile(dst):
+        if subprocess.call([ 'cp', '--reflink=always', cached, dst ],
+                stderr=subprocess.DEVNULL) == 0:
+            return
+        # a failed clone may leave an empty file behind
+        with open(dst, 'ab') as f:
+            if f.tell() < os.path.getsize(cached):
+                f.truncate(os.path.getsize(cached))
+    try:
+        subprocess.check_call([ './flat', cached, dst ])
+    except subprocess.CalledProcessError as e:
+        print(e.output)
+        raise
 
+def cache_root(args, root, dst):
+    # keep the converted root for the other VMs cloned from it
+    cached = cache_path(args, get_info(root)['uuid'])
+    # VMs of the same template may be converted at the same time
+    with open(cached + '.lock', 'w') as lock:
+        fcntl.flock(lock, fcntl.LOCK_EX)
+        if not os.path.exists(cached):
+            tmp = cached + '.tmp'
+            if os.path.exists(tmp):
+                os.unlink(tmp)
+            convert_image(root, tmp)
+            os.rename(tmp, cached)
+    seed_output(cached, dst)
+
+def allocated(image):
+    # the data converting the image writes, from its metadata only
+    fd, tmp = tempfile.mkstemp(suffix='.json')
+    os.close(fd)
+    try:
+        subprocess.check_call([ './vhd', '--dry-run', '--json', tmp, image ],
+                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        with open(tmp) as f:
+            return json.load(f)['allocated']
+    finally:
+        os.unlink(tmp)
+
+def passes_path(args):
+    return os.path.join(args.dir, 'passes.json')
+
+def load_passes(args):
+    if not os.path.exists(passes_path(args)):
+        return []
+    with open(passes_path(args)) as f:
+        return json.load(f)
+
+def record_pass(args, converted, seconds):
+    # the throughput of the passes, for --estimate
+    if not os.path.isdir(args.dir):
+        os.makedirs(args.dir)
+    passes = load_passes(args)
+    passes.append({ 'time': time.time(), 'bytes': converted, 'seconds': seconds })
+    with open(passes_path(args), 'w') as f:
+        json.dump(passes[-20:], f)
+
+def fmt_mib(n):
+    return '{:.1f} MiB'.format(n / 1024.0 ** 2)
+
+def estimate(args):
+    passes = load_passes(args)
+    if args.rate:
+        rate = args.rate * 1000.0 ** 2
+    elif passes:
+        rate = passes[-1]['bytes'] / max(passes[-1]['seconds'], 0.001)
+    else:
+        raise SystemExit('No pass has been run yet to measure the throughput '
+                'of, give it with --rate')
+
+    # the top image's allocation over time: with rsync only what changed is
+    # transferred again
+    samples = []
+    for i in range(3):
+        if i:
+            time.sleep(args.estimate)
+        t = time.time()
+        image = copy_file_from_hv(args, args.path)
+        samples.append((t, allocated(image)))
+        print('{} top image {}'.format(time.strftime('%H:%M:%S',
+            time.localtime(t)), fmt_mib(samples[-1][1])))
+
+    (t0, a0), (t1, a1) = samples[-2:]
+    growth = max(0, (a1 - a0) / (t1 - t0))
+    downtime = a1 / rate
+    # a pass converts what the top holds now while the next top grows
+    next_downtime = growth * downtime / rate
+    print('Throughput {}/s, the top image grows {}/s'.format(fmt_mib(rate), fmt_mib(growth)))
+    print('Downtime of the --finish pass now: {:.0f} s, after another pass: {:.0f} s'
+            .format(downtime, next_downtime))
+
+    if downtime <= args.downtime:
+        print('Stop the VM and run with --finish.')
+    elif growth >= rate:
+        print('The top image grows faster than it is converted, passes will not '
+                'catch up. Stop the VM and run with --finish, or lower its load.')
+    elif next_downtime > downtime * PASS_PAYOFF:
+        print('Another pass has stopped paying off. Stop the VM and run with --finish.')
+    else:
+        print('Snapshot the VM and run another pass with --stop-at.')
+
+
+def resync_state(args, image, keep):
+    # what --resync skips is only right if nothing was written to the
+    # output since the image was, so only the state of the image written
+    # last is kept, for the first image of the next pass
+    d = os.path.join(args.dir, 'resync')
+    if not os.path.isdir(d):
+        os.makedirs(d)
+    state = os.path.join(d, os.path.basename(image) + '.state') if image else None
+    for name in os.listdir(d):
+        if not keep or os.path.join(d, name) != state:
+            os.unlink(os.path.join(d, name))
+    return state
+
+
+def convert_image(src, dst, state=None):
+
+    # the converter creates the output, and allocates what it writes in
+    # one piece before it writes it
     print("Converting {}".format(src))
+    cmd = [ './vhd', '--prealloc', src, dst ]
+    if state:
+        cmd[1:1] = [ '--resync', state ]
     try:
-        subprocess.check_call([ './vhd', src, dst ])
+        subprocess.check_call(cmd)
     except subprocess.CalledProcessError as e:
         print(e.output)
         raise
@@ -116,9 +292,13 @@ def main():
     parser.add_argument('host',
             help='XenServer or NFS server hostname. Must support ssh')
     parser.add_argument('path',
-            help='Image file path at the host. Shall be a .vhd file. '
+            help='Image file path at the host. Shall be a .vhd file, or a '
+            'VHD logical volume on LVM SRs. '
             "Example: '/run/sr-mount/93a3cf4c-0061-0dc9-2a70-dc1a42b2b1a1/"
-            "1c005a0e-46f9-450b-98b7-c7b582dbacec.vhd'")
+            "1c005a0e-46f9-450b-98b7-c7b582dbacec.vhd' or "
+            "'/dev/VG_XenStorage-93a3cf4c-0061-0dc9-2a70-dc1a42b2b1a1/"
+            "VHD-1c005a0e-46f9-450b-98b7-c7b582dbacec'. "
+            'The logical volumes of the chain must be active.')
     parser.add_argument('out', help='Output raw image. Filename or block device')
     parser.add_argument('-u', '--user', default='root',
             help='Username in the XenServer hypervisor. Default is root.')
@@ -127,48 +307,128 @@ def main():
             help='Temporary directory where images will be downloaded and '
             'stored, before being applied to the output image. Default is '
             '/var/tmp/xen_convert.')
+    parser.add_argument('-l', '--local', action='store_true',
+            help='The images are accessible on this host, e.g. activated '
+            'logical volumes of a shared LVM SR, or a local copy of them. '
+            'Convert them in place instead of downloading them.')
+    parser.add_argument('-b', '--bwlimit', type=int, default=0,
+            help='Limit the download to this many KiB/s.')
     parser.add_argument('-s', '--stop-at',
             help='Stop converting when this file is reached. This file will '
             'not be copied nor applied to the output image. Use this option '
             'when previous snapshots were already converted.')
+    parser.add_argument('-c', '--base-cache',
+            help='Directory of converted root images, by VHD uuid. A chain '
+            'whose root is there is started from a copy of it, without '
+            'downloading the root; a new root is converted there first.')
     parser.add_argument('-f', '--finish', action='store_true',
             help='Apply the top image. Without this option the top file will '
             'be skipped. Use this option at the last invocation of the command, '
             'when the source VM is stopped.')
+    parser.add_argument('-e', '--estimate', type=int, metavar='SECONDS',
+            help='Convert nothing, sample the top image three times this many '
+            'seconds apart and tell whether to stop the VM and run the '
+            '--finish pass or to run another pass first.')
+    parser.add_argument('-t', '--downtime', type=int, default=60,
+            help='The downtime that is short enough with --estimate, seconds. '
+            'Default is 60.')
+    parser.add_argument('-r', '--rate', type=float,
+            help='The throughput for --estimate, MB/s. Default is that of the '
+            'last pass.')
+    parser.add_argument('-i', '--incremental', action='store_true',
+            help='Apply the top image in every pass, even while the VM runs, '
+            'and in the next pass only the blocks of it that changed. '
+            'Give it to all the passes, --finish included.')
 
 
     args = parser.parse_args()
 
+    if args.estimate:
+        estimate(args)
+        return
+    start = time.time()
+
     # Get snapshot chain
     chain = [] # root at the beginning
     path = args.path
     dst = args.out
     src_dir, _ = os.path.split(path)
+    seed = None
+    top_parent = None
     while path :
         image = copy_file_from_hv(args, path)
         chain.insert(0, image)
-        parent = get_parent(image)
+        info = get_info(image)
+        parent = info['parentPath']
         print("Parent = " + parent)
+        if top_parent is None:
+            top_parent = parent
         if parent:
-            path = os.path.join(src_dir, parent)
+            path = parent_path(src_dir, image, parent)
         else:
             path = None
         if args.stop_at == parent:
             print("Reached the image {}, Skiping all the rest."
                     .format(args.stop_at))
             break
+        if parent and args.base_cache and \
+                os.path.exists(cache_path(args, info['parentUuid'])):
+            seed = cache_path(args, info['parentUuid'])
+            print("Parent {} is cached as {}".format(parent, seed))
+            break
+    # the root is in the chain, not converted before or cached
+    root = not path and not seed
 
-    if not args.finish:  # skip top image
+    live = not args.finish
+    if args.incremental and not args.finish:
+        print('Applying the top image {} as it is now.'.format(chain[-1]))
+    elif not args.finish:  # skip top image
         print('Skipping the top image {}.'.format(chain[-1]))
         chain = chain[:-1]
+        live = False
 
     print("Chain to convert, starting from root:")
     print("\n".join(chain))
 
-    for path in chain:
-        convert_image(path, dst)
-
-    if not args.finish and path is not None:
+    seeded = False
+    if seed:
+        seed_output(seed, dst)
+        seeded = True
+    elif root and chain and args.base_cache and not (live and len(chain) == 1):
+        # the running VM's image is not a root to share
+        cache_root(args, chain[0], dst)
+        chain = chain[1:]
+        seeded = True
+    if args.incremental and seeded:
+        resync_state(args, None, False)
+
+    converted = 0
+    for i, path in enumerate(chain):
+        converted += allocated(path)
+        state = None
+        if args.incremental:
+            state = resync_state(args, path, i == 0)
+        try:
+            convert_image(path, dst, state)
+        except subprocess.CalledProcessError:
+            if state:
+                print('If {} lost data since the last pass, convert the chain '
+                        'again from the root, without --stop-at, into an empty '
+                        'output.'.format(path))
+            raise
+    if converted:
+        record_pass(args, converted, time.time() - start)
+
+    if args.incremental and not args.finish and path is not None:
+        # the top is applied again, from the image below it
+        if top_parent:
+            print('To continue with the conversion from the current state, '
+                    'next time run this tool with `--incremental --stop-at {}`'
+                    .format(top_parent))
+        else:
+            print('To continue with the conversion from the current state, '
+                    'next time run this tool with `--incremental`')
+    elif not args.finish and path is not None:
         _, image = os.path.split(path)
         print('To continue with the conversion from the current state, '
                 'next time run this tool with `--stop-at {}`'
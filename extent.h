@@ -0,0 +1,552 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * Extent maps.
+ *
+ * A converter walks the image metadata (BAT, bitmaps, grain tables) and
+ * describes what it would write as a list of extents sorted by virtual
+ * offset: either "these bytes come from this offset in the image file" or
+ * "these bytes are zero". Anything not covered by an extent is not present
+ * in the image and falls through to the parent.
+ *
+ * The map file is the header below followed by the extents. The same map
+ * can be written as JSON, with the totals of extentMapCensus(), for tools
+ * that plan a migration.
+ *
+ * An extent index is the map of an image kept between runs: the extents
+ * packed as varints relative to the one before, so a fragmented image
+ * takes a few bytes per extent, after a key the caller uses to tell if the
+ * index is still that of the image. Loading one never fails hard, a bad
+ * or stale index is just not used.
+ */
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+
+#define EXTENT_MAP_MAGIC	"a2kextm1"
+#define EXTENT_INDEX_MAGIC	"a2kidx01"
+#define EXTENT_ZERO		(~0ull)
+
+// not stored as-is in the image (e.g. compressed), only in dry runs
+#define EXTENT_FLAG_BUFFERED	1
+
+struct Extent
+{
+	uint64_t		virtOffset;
+	uint64_t		length;
+	uint64_t		fileOffset;	// EXTENT_ZERO for zero-filled extents
+	uint32_t		layer;		// index in the chain, 0 in map files
+	uint32_t		flags;
+};
+
+struct ExtentMapHeader
+{
+	char			magic[8];
+	uint64_t		virtualSize;
+	uint64_t		count;
+	uint64_t		blockSize;
+};
+
+struct ExtentIndexHeader
+{
+	char			magic[8];
+	uint64_t		virtualSize;
+	uint64_t		blockSize;
+	uint64_t		count;
+	uint64_t		packedSize;
+	uint64_t		keySize;
+};
+
+struct ExtentMap
+{
+	uint64_t		virtualSize;
+	uint64_t		blockSize;	// if blocks can be partly present, else 0
+	uint64_t		count;
+	uint64_t		alloc;
+	struct Extent	*ext;
+};
+
+struct ExtentCensus
+{
+	uint64_t		data;
+	uint64_t		partial;	// data in blocks that are only partly present
+	uint64_t		zero;
+	uint64_t		unallocated;
+	uint64_t		extents;
+};
+
+static inline void extentMapAppend(struct ExtentMap *map, const struct Extent *e)
+{
+	if( map->count && e->layer == map->ext[map->count - 1].layer && e->flags == map->ext[map->count - 1].flags )
+	{
+		struct Extent *last = &map->ext[map->count - 1];
+		if( last->virtOffset + last->length == e->virtOffset &&
+			( ( last->fileOffset == EXTENT_ZERO && e->fileOffset == EXTENT_ZERO ) ||
+			  ( last->fileOffset != EXTENT_ZERO && last->fileOffset + last->length == e->fileOffset ) ) )
+		{
+			last->length += e->length;
+			return;
+		}
+	}
+
+	if( map->count == map->alloc )
+	{
+		map->alloc = map->alloc ? map->alloc * 2 : 1024;
+		map->ext = realloc(map->ext, map->alloc * sizeof(*map->ext));
+		if( !map->ext )
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+	map->ext[map->count++] = *e;
+}
+
+static inline void extentMapFree(struct ExtentMap *map)
+{
+	free(map->ext);
+	memset(map, 0, sizeof(*map));
+}
+
+static inline void extentMapLoad(struct ExtentMap *map, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if( !f )
+	{
+		perror(path);
+		exit(1);
+	}
+
+	struct ExtentMapHeader hdr;
+	if( fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, EXTENT_MAP_MAGIC, 8) != 0 )
+	{
+		fprintf(stderr, "%s: not an extent map\n", path);
+		exit(1);
+	}
+
+	memset(map, 0, sizeof(*map));
+	map->virtualSize = hdr.virtualSize;
+	map->blockSize = hdr.blockSize;
+	map->alloc = hdr.count ? hdr.count : 1;
+	map->ext = malloc(map->alloc * sizeof(*map->ext));
+	if( !map->ext )
+	{
+		perror("malloc");
+		exit(1);
+	}
+
+	if( fread(map->ext, sizeof(*map->ext), hdr.count, f) != hdr.count )
+	{
+		fprintf(stderr, "%s: truncated extent map\n", path);
+		exit(1);
+	}
+	map->count = hdr.count;
+
+	fclose(f);
+}
+
+static inline void extentMapSave(const struct ExtentMap *map, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if( !f )
+	{
+		perror(path);
+		exit(1);
+	}
+
+	struct ExtentMapHeader hdr = { EXTENT_MAP_MAGIC, map->virtualSize, map->count, map->blockSize };
+	if( fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+		fwrite(map->ext, sizeof(*map->ext), map->count, f) != map->count ||
+		fflush(f) != 0 )
+	{
+		perror(path);
+		exit(1);
+	}
+
+	fclose(f);
+}
+
+static inline uint8_t *extentVarintPut(uint8_t *p, uint64_t v)
+{
+	while( v >= 0x80 )
+	{
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline const uint8_t *extentVarintGet(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	uint64_t res = 0;
+	for(unsigned shift = 0; p < end && shift < 64; shift += 7)
+	{
+		res |= (uint64_t)(*p & 0x7f) << shift;
+		if( !( *p++ & 0x80 ) )
+		{
+			*v = res;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Save the map as an index with "key" in front, written to a temporary
+ * file and renamed, so concurrent runs see either the whole index or none.
+ * False if it can't be saved, e.g. a read-only directory.
+ */
+static inline bool extentIndexSave(const struct ExtentMap *map, const char *path, const void *key, uint64_t keySize)
+{
+	uint8_t *packed = malloc(map->count * 40 + 1);
+	if( !packed )
+	{
+		perror("malloc");
+		exit(1);
+	}
+
+	// per extent: the gap after the previous one, the length, the flags
+	// with the low bit set for zeroes, and for data the offset in the file
+	// relative to where the previous data extent ended, zigzag encoded
+	uint8_t *p = packed;
+	uint64_t end = 0, fileEnd = 0;
+	for(uint64_t i = 0; i < map->count; i++)
+	{
+		const struct Extent *e = &map->ext[i];
+		if( e->virtOffset < end )
+		{
+			free(packed);
+			return false;
+		}
+		const bool zero = e->fileOffset == EXTENT_ZERO;
+		p = extentVarintPut(p, e->virtOffset - end);
+		p = extentVarintPut(p, e->length);
+		p = extentVarintPut(p, (uint64_t)e->flags << 1 | zero);
+		if( !zero )
+		{
+			const int64_t delta = e->fileOffset - fileEnd;
+			p = extentVarintPut(p, (uint64_t)delta << 1 ^ (uint64_t)(delta >> 63));
+			fileEnd = e->fileOffset + e->length;
+		}
+		end = e->virtOffset + e->length;
+	}
+
+	char tmp[PATH_MAX + 16];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	FILE *f = fopen(tmp, "w");
+	bool ok = f != NULL;
+	if( ok )
+	{
+		const struct ExtentIndexHeader hdr = { EXTENT_INDEX_MAGIC, map->virtualSize, map->blockSize,
+			map->count, p - packed, keySize };
+		ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+			fwrite(key, 1, keySize, f) == keySize &&
+			fwrite(packed, 1, p - packed, f) == p - packed;
+		ok = fclose(f) == 0 && ok;
+		ok = ok && rename(tmp, path) == 0;
+		if( !ok )
+			unlink(tmp);
+	}
+	free(packed);
+	return ok;
+}
+
+/*
+ * Load an index saved with the same key, false if there is none or it
+ * doesn't match.
+ */
+static inline bool extentIndexLoad(struct ExtentMap *map, const char *path, const void *key, uint64_t keySize)
+{
+	FILE *f = fopen(path, "r");
+	if( !f )
+		return false;
+
+	struct ExtentIndexHeader hdr;
+	uint8_t *buf = NULL;
+	bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && memcmp(hdr.magic, EXTENT_INDEX_MAGIC, 8) == 0 &&
+		hdr.keySize == keySize && hdr.count * 3 <= hdr.packedSize && hdr.packedSize <= hdr.count * 40 &&
+		( buf = malloc(keySize + hdr.packedSize + 1) ) != NULL &&
+		fread(buf, 1, keySize + hdr.packedSize, f) == keySize + hdr.packedSize &&
+		memcmp(buf, key, keySize) == 0;
+	fclose(f);
+
+	memset(map, 0, sizeof(*map));
+	if( ok )
+	{
+		map->virtualSize = hdr.virtualSize;
+		map->blockSize = hdr.blockSize;
+		map->alloc = hdr.count ? hdr.count : 1;
+		map->ext = malloc(map->alloc * sizeof(*map->ext));
+		if( !map->ext )
+		{
+			perror("malloc");
+			exit(1);
+		}
+
+		const uint8_t *p = buf + keySize, *pEnd = p + hdr.packedSize;
+		uint64_t end = 0, fileEnd = 0;
+		for(uint64_t i = 0; ok && i < hdr.count; i++)
+		{
+			struct Extent *e = &map->ext[i];
+			uint64_t gap = 0, kind = 0, delta = 0;
+			ok = ( p = extentVarintGet(p, pEnd, &gap) ) && ( p = extentVarintGet(p, pEnd, &e->length) ) &&
+				( p = extentVarintGet(p, pEnd, &kind) ) && ( ( kind & 1 ) || ( p = extentVarintGet(p, pEnd, &delta) ) );
+			e->virtOffset = end + gap;
+			e->layer = 0;
+			e->flags = kind >> 1;
+			e->fileOffset = EXTENT_ZERO;
+			if( ok && !( kind & 1 ) )
+			{
+				e->fileOffset = fileEnd + (int64_t)( delta >> 1 ^ -( delta & 1 ) );
+				fileEnd = e->fileOffset + e->length;
+			}
+			end = e->virtOffset + e->length;
+		}
+		ok = ok && p == pEnd;
+		map->count = hdr.count;
+	}
+
+	free(buf);
+	if( !ok )
+		extentMapFree(map);
+	return ok;
+}
+
+static inline void extentCensusBlock(const struct ExtentMap *map, uint64_t block, uint64_t covered, struct ExtentCensus *c)
+{
+	const uint64_t blockSize = map->blockSize;
+	if( block == ~0ull )
+		return;
+	const uint64_t blockStart = block * blockSize;
+	const uint64_t blockLen = map->virtualSize - blockStart < blockSize ? map->virtualSize - blockStart : blockSize;
+	if( covered < blockLen )
+		c->partial += covered;
+}
+
+/*
+ * Count what the map covers, up to its virtual size. Data in blocks that
+ * are only partly present is counted again as "partial", if the map has a
+ * block size.
+ */
+static inline void extentMapCensus(const struct ExtentMap *map, struct ExtentCensus *c)
+{
+	const uint64_t blockSize = map->blockSize;
+	memset(c, 0, sizeof(*c));
+	uint64_t block = ~0ull, covered = 0;
+
+	for(uint64_t i = 0; i < map->count; i++)
+	{
+		const struct Extent *e = &map->ext[i];
+		if( e->virtOffset >= map->virtualSize )
+			break;
+		const uint64_t len = e->length < map->virtualSize - e->virtOffset ? e->length : map->virtualSize - e->virtOffset;
+		c->extents++;
+		if( e->fileOffset == EXTENT_ZERO )
+		{
+			c->zero += len;
+			continue;
+		}
+		c->data += len;
+		if( !blockSize )
+			continue;
+
+		const uint64_t end = e->virtOffset + len;
+		for(uint64_t off = e->virtOffset; off < end; )
+		{
+			const uint64_t b = off / blockSize;
+			if( b != block )
+			{
+				extentCensusBlock(map, block, covered, c);
+				block = b;
+				covered = 0;
+			}
+			const uint64_t next = (b + 1) * blockSize < end ? (b + 1) * blockSize : end;
+			covered += next - off;
+			off = next;
+		}
+	}
+	if( blockSize )
+		extentCensusBlock(map, block, covered, c);
+
+	c->unallocated = map->virtualSize - c->data - c->zero;
+}
+
+/*
+ * The map and its census as JSON, to "path" or to stdout for "-". The
+ * extents are [ virtual offset, length, file offset or null for zeroes ].
+ */
+static inline void extentMapSaveJson(const struct ExtentMap *map, const struct ExtentCensus *c, const char *path)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+	if( !f )
+	{
+		perror(path);
+		exit(1);
+	}
+
+	fprintf(f, "{\"virtualSize\":%" PRIu64 ",\"allocated\":%" PRIu64 ",\"partial\":%" PRIu64
+		",\"zero\":%" PRIu64 ",\"unallocated\":%" PRIu64 ",\"extents\":[",
+		map->virtualSize, c->data, c->partial, c->zero, c->unallocated);
+	for(uint64_t i = 0; i < map->count; i++)
+	{
+		const struct Extent *e = &map->ext[i];
+		if( e->fileOffset == EXTENT_ZERO )
+			fprintf(f, "%s\n[%" PRIu64 ",%" PRIu64 ",null]", i ? "," : "", e->virtOffset, e->length);
+		else
+			fprintf(f, "%s\n[%" PRIu64 ",%" PRIu64 ",%" PRIu64 "]", i ? "," : "", e->virtOffset, e->length, e->fileOffset);
+	}
+	fprintf(f, "]}\n");
+
+	if( fflush(f) != 0 )
+	{
+		perror(path);
+		exit(1);
+	}
+	if( f != stdout )
+		fclose(f);
+}
+
+/*
+ * Put "top" over "bottom". Both must be sorted and non-overlapping; the
+ * result is too. Parts of "bottom" hidden by "top" are cut out.
+ */
+static inline void extentMapOverlay(struct ExtentMap *out, const struct ExtentMap *bottom, const struct ExtentMap *top)
+{
+	memset(out, 0, sizeof(*out));
+	out->virtualSize = top->virtualSize > bottom->virtualSize ? top->virtualSize : bottom->virtualSize;
+
+	uint64_t b = 0;
+	struct Extent cur;
+	bool haveCur = false;
+
+	for(uint64_t t = 0; t <= top->count; t++)
+	{
+		const uint64_t topStart = t < top->count ? top->ext[t].virtOffset : ~0ull;
+		const uint64_t topEnd = t < top->count ? topStart + top->ext[t].length : ~0ull;
+
+		// emit the parts of bottom extents before this top extent
+		for(;;)
+		{
+			if( !haveCur )
+			{
+				if( b == bottom->count )
+					break;
+				cur = bottom->ext[b++];
+				haveCur = true;
+			}
+
+			if( cur.virtOffset >= topStart )
+				break;
+
+			struct Extent head = cur;
+			if( head.virtOffset + head.length > topStart )
+				head.length = topStart - head.virtOffset;
+			extentMapAppend(out, &head);
+
+			if( head.length == cur.length )
+			{
+				haveCur = false;
+				continue;
+			}
+
+			// cut the part hidden by the top extent, keep the tail
+			const uint64_t skip = ( cur.virtOffset + cur.length > topEnd ? topEnd : cur.virtOffset + cur.length ) - cur.virtOffset;
+			cur.virtOffset += skip;
+			cur.length -= skip;
+			if( cur.fileOffset != EXTENT_ZERO )
+				cur.fileOffset += skip;
+			if( !cur.length )
+				haveCur = false;
+			break;
+		}
+
+		if( t == top->count )
+			break;
+
+		extentMapAppend(out, &top->ext[t]);
+
+		// drop bottom extents hidden by this one
+		for(;;)
+		{
+			if( !haveCur )
+			{
+				if( b == bottom->count )
+					break;
+				cur = bottom->ext[b++];
+				haveCur = true;
+			}
+
+			if( cur.virtOffset >= topEnd )
+				break;
+
+			if( cur.virtOffset + cur.length <= topEnd )
+			{
+				haveCur = false;
+				continue;
+			}
+
+			const uint64_t skip = topEnd - cur.virtOffset;
+			cur.virtOffset += skip;
+			cur.length -= skip;
+			if( cur.fileOffset != EXTENT_ZERO )
+				cur.fileOffset += skip;
+			break;
+		}
+	}
+}
+
+/*
+ * Find the extent containing "offset" or, if it's in a hole, the first
+ * extent after it. Returns map->count if there is none.
+ */
+static inline uint64_t extentMapFind(const struct ExtentMap *map, uint64_t offset)
+{
+	uint64_t lo = 0, hi = map->count;
+	while( lo < hi )
+	{
+		const uint64_t mid = lo + (hi - lo) / 2;
+		if( map->ext[mid].virtOffset + map->ext[mid].length <= offset )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+#endif
@@ -0,0 +1,382 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+compile:
+
+gcc -std=c99 -Wall -Werror -pthread -o flat flat.c
+
+with zstd compressed qcow2 output (-O qcow2 -c):
+
+gcc -std=c99 -Wall -Werror -pthread -o flat flat.c -DHAVE_ZSTD -lzstd
+*/
+
+/*
+ * Images without allocation metadata: raw files and block devices, and
+ * flat VMDKs (ESXi thick "-flat.vmdk", monolithicFlat, twoGbMaxExtentFlat),
+ * given either the descriptor or the flat extent itself.
+ *
+ * Holes are found with SEEK_DATA/SEEK_HOLE where the file system supports
+ * it, and what's left is checked for zeroes in FLAT_GRAIN units. Only the
+ * grains holding data are written.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <unistd.h>
+
+#include "output.h"
+
+#define FLAT_GRAIN			4096
+#define FLAT_MAX_EXTENTS	256
+
+struct FlatExtent
+{
+	char			*path;
+	const uint8_t	*base;
+	uint64_t		size;			// of the file
+	int				fd;
+
+	uint64_t		virtOffset;
+	uint64_t		length;
+	uint64_t		fileOffset;
+	bool			zero;			// a ZERO extent, no file
+};
+
+static struct FlatExtent extents[FLAT_MAX_EXTENTS];
+static unsigned extentsCount;
+
+static uint64_t dataBytes, zeroBytes, holeBytes;
+
+static void extentOpen(struct FlatExtent *e)
+{
+	e->fd = open(e->path, O_RDONLY);
+	if( e->fd == -1 )
+	{
+		perror(e->path);
+		exit(1);
+	}
+
+	struct stat st;
+	if( fstat(e->fd, &st) != 0 )
+	{
+		perror("fstat");
+		exit(1);
+	}
+	e->size = st.st_size;
+	if( S_ISBLK(st.st_mode) && ioctl(e->fd, BLKGETSIZE64, &e->size) != 0 )
+	{
+		perror("BLKGETSIZE64");
+		exit(1);
+	}
+
+	if( !e->size )
+		return;
+	e->base = mmap(NULL, e->size, PROT_READ, MAP_SHARED, e->fd, 0);
+	if( e->base == MAP_FAILED )
+	{
+		perror("mmap");
+		exit(1);
+	}
+	madvise((void *)e->base, e->size, MADV_SEQUENTIAL);
+}
+
+/*
+ * Parse the extent lines of a VMDK descriptor:
+ *   RW 41943040 FLAT "disk-flat.vmdk" 0
+ *   RW 41943040 VMFS "disk-flat.vmdk"
+ *   RW 2097152 ZERO
+ * Relative extent paths are relative to the descriptor.
+ */
+static void descriptorExtents(const char *descPath, const char *desc, uint64_t descLen)
+{
+	char *dirBuf = strdup(descPath);
+	const char *dir = dirname(dirBuf);
+	uint64_t virtOffset = 0;
+
+	const char *end = desc + descLen;
+	for(const char *line = desc; line < end; )
+	{
+		const char *eol = memchr(line, '\n', end - line);
+		if( !eol )
+			eol = end;
+
+		char buf[PATH_MAX + 64];
+		const size_t len = eol - line < sizeof(buf) - 1 ? eol - line : sizeof(buf) - 1;
+		memcpy(buf, line, len);
+		buf[len] = 0;
+		line = eol + 1;
+
+		char access[16], type[16], name[PATH_MAX];
+		uint64_t sectors, offset = 0;
+		const int n = sscanf(buf, " %15s %" SCNu64 " %15s \"%[^\"]\" %" SCNu64, access, &sectors, type, name, &offset);
+		if( n < 3 || ( strcmp(access, "RW") != 0 && strcmp(access, "RDONLY") != 0 && strcmp(access, "NOACCESS") != 0 ) )
+			continue;
+
+		if( extentsCount == FLAT_MAX_EXTENTS )
+		{
+			fprintf(stderr, "too many extents\n");
+			exit(1);
+		}
+		struct FlatExtent *e = &extents[extentsCount++];
+		e->virtOffset = virtOffset;
+		e->length = sectors * 512;
+		e->fileOffset = offset * 512;
+		virtOffset += e->length;
+
+		if( strcmp(type, "ZERO") == 0 )
+		{
+			e->zero = true;
+			continue;
+		}
+		if( ( strcmp(type, "FLAT") != 0 && strcmp(type, "VMFS") != 0 ) || n < 4 )
+		{
+			fprintf(stderr, "%s extents are not supported, only FLAT, VMFS and ZERO\n", type);
+			exit(1);
+		}
+
+		if( name[0] == '/' )
+			e->path = strdup(name);
+		else if( asprintf(&e->path, "%s/%s", dir, name) == -1 )
+		{
+			perror("asprintf");
+			exit(1);
+		}
+		extentOpen(e);
+		if( e->fileOffset + e->length > e->size )
+		{
+			fprintf(stderr, "%s is smaller than its extent\n", e->path);
+			exit(1);
+		}
+	}
+
+	free(dirBuf);
+	if( !extentsCount )
+	{
+		fprintf(stderr, "%s: no extents in the descriptor\n", descPath);
+		exit(1);
+	}
+}
+
+typedef uint64_t FlatVector __attribute__((vector_size(32)));
+
+/*
+ * Is the grain all zeroes? A whole 128 bytes at a time, which the
+ * compiler turns into vector instructions.
+ */
+static inline bool isZero(const uint8_t *p, uint64_t len)
+{
+	uint64_t i = 0;
+	for(; i + 128 <= len; i += 128)
+	{
+		FlatVector v[4];
+		memcpy(v, p + i, sizeof(v));
+		const FlatVector acc = v[0] | v[1] | v[2] | v[3];
+		if( acc[0] | acc[1] | acc[2] | acc[3] )
+			return false;
+	}
+	for(; i < len; i++)
+		if( p[i] )
+			return false;
+	return true;
+}
+
+/*
+ * Data at "pos" in the extent. The first extent is the source of the
+ * output, the others are mapped separately.
+ */
+static void emit(struct Output *out, const struct FlatExtent *e, uint64_t pos, uint64_t len)
+{
+	if( e == &extents[0] )
+		outputData(out, e->virtOffset + pos, e->fileOffset + pos, len);
+	else
+		outputBuffer(out, e->virtOffset + pos, e->base + e->fileOffset + pos, len);
+	dataBytes += len;
+}
+
+/*
+ * Write the grains of [pos, end) of the extent that aren't zero.
+ */
+static void scanData(struct Output *out, const struct FlatExtent *e, uint64_t pos, uint64_t end)
+{
+	const uint8_t *p = e->base + e->fileOffset;
+	uint64_t runStart = pos;
+	bool inRun = false;
+
+	while( pos < end )
+	{
+		// grains are aligned in the file, so holes line up with them
+		uint64_t l = FLAT_GRAIN - (e->fileOffset + pos) % FLAT_GRAIN;
+		if( l > end - pos )
+			l = end - pos;
+
+		const bool zero = isZero(p + pos, l);
+		if( zero && inRun )
+		{
+			emit(out, e, runStart, pos - runStart);
+			inRun = false;
+		}
+		else if( !zero && !inRun )
+		{
+			runStart = pos;
+			inRun = true;
+		}
+		if( zero )
+			zeroBytes += l;
+		pos += l;
+	}
+
+	if( inRun )
+		emit(out, e, runStart, end - runStart);
+}
+
+static void scanExtent(struct Output *out, const struct FlatExtent *e)
+{
+	for(uint64_t pos = 0; pos < e->length; )
+	{
+		// next data, in extent coordinates; all of it if SEEK_DATA isn't supported
+		uint64_t dataStart = pos, dataEnd = e->length;
+		const off_t data = lseek(e->fd, e->fileOffset + pos, SEEK_DATA);
+		if( data == -1 && errno == ENXIO )
+			dataStart = e->length;
+		else if( data != -1 )
+		{
+			dataStart = data - e->fileOffset;
+			const off_t hole = lseek(e->fd, data, SEEK_HOLE);
+			if( hole != -1 )
+				dataEnd = hole - e->fileOffset;
+		}
+		if( dataStart > e->length )
+			dataStart = e->length;
+		if( dataEnd > e->length )
+			dataEnd = e->length;
+
+		holeBytes += dataStart - pos;
+		if( dataStart == e->length )
+			break;
+
+		// a dry run reads no data, so it can't tell zeroed grains
+		if( out->dryRun || out->jsonPath )
+			emit(out, e, dataStart, dataEnd - dataStart);
+		else
+			scanData(out, e, dataStart, dataEnd);
+		pos = dataEnd;
+
+		printf("%" PRIu64 " MiB\r", (e->virtOffset + pos) >> 20);
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct OutputOptions outOpts = {};
+	int opt;
+	while( (opt = getopt_long(argc, argv, OUTPUT_OPTIONS, outputLongOptions, NULL)) != -1 )
+	{
+		if( !outputOption(&outOpts, opt, optarg) )
+			goto usage;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if( argc != 2 && argc != 3 )
+	{
+usage:
+		fprintf(stderr, "usage: %s: " OUTPUT_USAGE " file.vmdk|file-flat.vmdk|file.raw [output.raw|output.qcow2]\n", argv[0]);
+		exit(1);
+	}
+
+	// a descriptor, or the data itself
+	struct FlatExtent source = { .path = argv[1] };
+	extentOpen(&source);
+	static const char descMagic[] = "# Disk DescriptorFile";
+	if( source.size < 64 * 1024 && source.size > strlen(descMagic) && memcmp(source.base, descMagic, strlen(descMagic)) == 0 )
+	{
+		// the offsets in a map are in the image file given
+		if( outOpts.mapPath || outOpts.jsonPath )
+		{
+			fprintf(stderr, "%s is a descriptor, make the extent map of the -flat.vmdk itself\n", argv[1]);
+			exit(1);
+		}
+		descriptorExtents(argv[1], (const char *)source.base, source.size);
+		munmap((void *)source.base, source.size);
+		close(source.fd);
+	}
+	else
+	{
+		source.length = source.size;
+		extents[extentsCount++] = source;
+	}
+
+	const struct FlatExtent *last = &extents[extentsCount - 1];
+	const uint64_t virtualSize = last->virtOffset + last->length;
+
+	if( argc == 2 && !outputMapOnly(&outOpts) )
+	{
+		printf("virtualSize=%" PRIu64 "\n", virtualSize);
+		exit(0);
+	}
+
+	struct Output out;
+	outputInit(&out, extents[0].base, extents[0].size, virtualSize);
+	outputSourceFd(&out, extents[0].fd);
+	outputOpenOptions(&out, &outOpts, argv[2], O_RDWR);
+
+	for(unsigned i = 0; i < extentsCount; i++)
+	{
+		if( extents[i].zero )
+			holeBytes += extents[i].length;
+		else
+			scanExtent(&out, &extents[i]);
+
+		// the other extents' data stays mapped, but let the writes catch up
+		if( i )
+			outputFlush(&out);
+	}
+
+	printf("\n%" PRIu64 " MiB data, %" PRIu64 " MiB zeroes, %" PRIu64 " MiB holes\n",
+		dataBytes >> 20, zeroBytes >> 20, holeBytes >> 20);
+	printf("syncing\n");
+	outputClose(&out);
+
+	return 0;
+}
@@ -0,0 +1,721 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * Space the guest file systems don't use.
+ *
+ * The virtual disk is read through a callback. The partition table (MBR
+ * primary partitions or GPT, or none at all) is parsed, and for NTFS and
+ * ext2/3/4 partitions the file system's own allocation bitmap tells which
+ * clusters are free. The result is a sorted list of zero extents for the
+ * free ranges.
+ *
+ * Anything unexpected makes the partition count as fully used. So does a
+ * file system that wasn't cleanly unmounted: its bitmap may lag behind the
+ * journal. For NTFS that is the $LogFile restart area, as ntfs-3g checks
+ * it, and hiberfil.sys; Windows doesn't set the dirty bit of $Volume for a
+ * volume that is only mounted, so a snapshot of a running or hibernated
+ * (Fast Startup) guest passes that one.
+ */
+
+#ifndef GUESTFS_H
+#define GUESTFS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <endian.h>
+
+#include "extent.h"
+
+typedef void (*GuestRead)(void *ctx, uint64_t offset, void *buf, uint64_t len);
+
+struct GuestDisk
+{
+	GuestRead		read;
+	void			*ctx;
+	uint64_t		size;
+	struct ExtentMap	*freeMap;
+};
+
+static inline uint16_t guestLe16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+static inline uint32_t guestLe32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t guestLe64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline void *guestAlloc(uint64_t size)
+{
+	void *p = malloc(size);
+	if( !p )
+	{
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * Add the clear bits of an LSB-first bitmap as free ranges, bit "i" is the
+ * unit at "start + i * unit".
+ */
+static inline uint64_t guestFreeBits(struct GuestDisk *d, const uint8_t *bitmap, uint64_t bits, uint64_t start, uint64_t unit)
+{
+	uint64_t freeBytes = 0;
+	for(uint64_t i = 0; i < bits; )
+	{
+		// whole used bytes are the common case
+		if( i % 8 == 0 && i + 8 <= bits && bitmap[i / 8] == 0xff )
+		{
+			i += 8;
+			continue;
+		}
+		if( bitmap[i / 8] & ( 1 << (i % 8) ) )
+		{
+			i++;
+			continue;
+		}
+
+		uint64_t j = i + 1;
+		while( j < bits )
+		{
+			if( j % 8 == 0 && j + 8 <= bits && bitmap[j / 8] == 0 )
+				j += 8;
+			else if( !( bitmap[j / 8] & ( 1 << (j % 8) ) ) )
+				j++;
+			else
+				break;
+		}
+
+		const struct Extent e = { start + i * unit, (j - i) * unit, EXTENT_ZERO, 0, 0 };
+		extentMapAppend(d->freeMap, &e);
+		freeBytes += e.length;
+		i = j;
+	}
+	return freeBytes;
+}
+
+/*
+ * Undo the NTFS update sequence of a multi-sector record.
+ */
+static inline bool guestNtfsFixup(uint8_t *rec, uint64_t size)
+{
+	const uint16_t usaOffset = guestLe16(rec + 4);
+	const uint16_t usaCount = guestLe16(rec + 6);
+	if( !usaCount || usaOffset + usaCount * 2ull > size || ( usaCount - 1 ) * 512ull > size )
+		return false;
+
+	const uint8_t *usa = rec + usaOffset;
+	for(unsigned i = 1; i < usaCount; i++)
+	{
+		uint8_t *end = rec + i * 512 - 2;
+		if( memcmp(end, usa, 2) != 0 )
+			return false;
+		memcpy(end, usa + i * 2, 2);
+	}
+	return true;
+}
+
+#define NTFS_RESTART_VOLUME_IS_CLEAN	0x0002
+#define NTFS_LOGFILE_NO_CLIENT			0xffff
+#define NTFS_INDEX_ENTRY_END			0x0002
+
+struct GuestNtfs
+{
+	struct GuestDisk	*d;
+	uint64_t		start;
+	uint64_t		size;
+	uint64_t		clusterSize;
+	uint64_t		recordSize;
+	uint64_t		mft;
+};
+
+/*
+ * The attribute of this type in an MFT record with a name of "nameLen"
+ * characters, NULL if there is none.
+ */
+static inline const uint8_t *guestNtfsAttrNamed(const uint8_t *rec, uint64_t size, uint32_t type, unsigned nameLen)
+{
+	for(uint64_t off = guestLe16(rec + 0x14); off + 16 <= size; )
+	{
+		const uint8_t *attr = rec + off;
+		const uint32_t attrType = guestLe32(attr);
+		const uint32_t attrLen = guestLe32(attr + 4);
+		if( attrType == 0xffffffff || attrLen < 16 || off + attrLen > size )
+			return NULL;
+		if( attrType == type && attr[9] == nameLen )
+			return attr;
+		off += attrLen;
+	}
+	return NULL;
+}
+
+/*
+ * The unnamed attribute of this type in an MFT record, NULL if there is
+ * none.
+ */
+static inline const uint8_t *guestNtfsAttr(const uint8_t *rec, uint64_t size, uint32_t type)
+{
+	return guestNtfsAttrNamed(rec, size, type, 0);
+}
+
+/*
+ * Read "len" bytes at "offset" of the value of an attribute of the record
+ * ending at "recEnd", resident or not. False if it doesn't have them.
+ */
+static inline bool guestNtfsAttrRead(const struct GuestNtfs *n, const uint8_t *attr, const uint8_t *recEnd,
+	uint64_t offset, void *buf, uint64_t len)
+{
+	uint8_t *out = buf;
+	if( attr[8] == 0 )
+	{
+		const uint32_t valueLen = guestLe32(attr + 0x10);
+		const uint16_t valueOffset = guestLe16(attr + 0x14);
+		if( offset > valueLen || len > valueLen - offset || attr + valueOffset + valueLen > recEnd )
+			return false;
+		memcpy(out, attr + valueOffset + offset, len);
+		return true;
+	}
+
+	const uint8_t *attrEnd = attr + guestLe32(attr + 4);
+	const uint8_t *p = attr + guestLe16(attr + 0x20);
+	if( guestLe64(attr + 0x10) != 0 || offset > guestLe64(attr + 0x30) || len > guestLe64(attr + 0x30) - offset )
+		return false;
+
+	// walk the runlist until the range is complete
+	uint64_t runStart = 0;
+	int64_t lcn = 0;
+	while( runStart < offset + len )
+	{
+		if( p >= attrEnd || *p == 0 )
+			return false;
+		const unsigned lenBytes = *p & 0xf;
+		const unsigned offBytes = *p >> 4;
+		if( !lenBytes || lenBytes > 8 || offBytes > 8 || p + 1 + lenBytes + offBytes > attrEnd )
+			return false;
+
+		uint64_t runLen = 0;
+		for(unsigned i = 0; i < lenBytes; i++)
+			runLen |= (uint64_t)p[1 + i] << (i * 8);
+		int64_t delta = 0;
+		for(unsigned i = 0; i < offBytes; i++)
+			delta |= (int64_t)p[1 + lenBytes + i] << (i * 8);
+		if( offBytes && offBytes < 8 && ( p[lenBytes + offBytes] & 0x80 ) )
+			delta -= 1ll << (offBytes * 8);
+		p += 1 + lenBytes + offBytes;
+		if( runLen > n->size / n->clusterSize )
+			return false;
+		lcn += delta;
+		if( offBytes && lcn < 0 )
+			return false;
+
+		const uint64_t runEnd = runStart + runLen * n->clusterSize;
+		if( runEnd > offset )
+		{
+			const uint64_t from = offset > runStart ? offset : runStart;
+			const uint64_t to = runEnd < offset + len ? runEnd : offset + len;
+			if( !offBytes )
+				memset(out + (from - offset), 0, to - from);
+			else
+			{
+				const uint64_t disk = (uint64_t)lcn * n->clusterSize + (from - runStart);
+				if( disk + (to - from) > n->size )
+					return false;
+				n->d->read(n->d->ctx, n->start + disk, out + (from - offset), to - from);
+			}
+		}
+		runStart = runEnd;
+	}
+	return true;
+}
+
+static inline bool guestNtfsRecord(struct GuestDisk *d, uint64_t offset, uint8_t *rec, uint64_t size)
+{
+	d->read(d->ctx, offset, rec, size);
+	return memcmp(rec, "FILE", 4) == 0 && guestNtfsFixup(rec, size);
+}
+
+/*
+ * Read MFT record "index" through the runlist of $MFT, whose record is
+ * "mftRec".
+ */
+static inline bool guestNtfsMftRecord(const struct GuestNtfs *n, const uint8_t *mftRec, uint64_t index, uint8_t *rec)
+{
+	const uint8_t *attr = guestNtfsAttr(mftRec, n->recordSize, 0x80);
+	return attr && guestNtfsAttrRead(n, attr, mftRec + n->recordSize, index * n->recordSize, rec, n->recordSize) &&
+		memcmp(rec, "FILE", 4) == 0 && guestNtfsFixup(rec, n->recordSize);
+}
+
+/*
+ * True if $LogFile says the volume was cleanly unmounted, the way ntfs-3g
+ * tells it: the newer of the two restart areas has no client in use or is
+ * marked clean. A log that was never written is all 0xff.
+ */
+static inline bool guestNtfsLogClean(const struct GuestNtfs *n, uint8_t *rec)
+{
+	const uint8_t *attr;
+	if( !guestNtfsRecord(n->d, n->mft + 2 * n->recordSize, rec, n->recordSize) ||
+		!( attr = guestNtfsAttr(rec, n->recordSize, 0x80) ) )
+		return false;
+
+	uint8_t head[0x20];
+	if( !guestNtfsAttrRead(n, attr, rec + n->recordSize, 0, head, sizeof(head)) )
+		return false;
+	uint32_t pageSize = memcmp(head, "RSTR", 4) == 0 ? guestLe32(head + 0x10) : 4096;
+	if( pageSize < 512 || pageSize > 65536 || ( pageSize & (pageSize - 1) ) )
+		return false;
+
+	uint8_t *log = guestAlloc(2 * pageSize);
+	bool clean = false;
+	if( guestNtfsAttrRead(n, attr, rec + n->recordSize, 0, log, 2 * pageSize) )
+	{
+		const uint8_t *ra = NULL;
+		for(unsigned i = 0; i < 2; i++)
+		{
+			uint8_t *page = log + i * pageSize;
+			const uint16_t raOffset = guestLe16(page + 0x18);
+			if( memcmp(page, "RSTR", 4) != 0 || guestLe32(page + 0x10) != pageSize ||
+				!guestNtfsFixup(page, pageSize) || raOffset % 8 || raOffset + 0x30 > pageSize )
+				continue;
+			if( !ra || guestLe64(page + raOffset) > guestLe64(ra) )
+				ra = page + raOffset;
+		}
+
+		if( ra )
+			clean = guestLe16(ra + 0x0c) == NTFS_LOGFILE_NO_CLIENT || ( guestLe16(ra + 0x0e) & NTFS_RESTART_VOLUME_IS_CLEAN );
+		else
+		{
+			clean = true;
+			for(uint64_t i = 0; i < 2 * pageSize && clean; i++)
+				clean = log[i] == 0xff;
+		}
+	}
+	free(log);
+	return clean;
+}
+
+/*
+ * The MFT record number of hiberfil.sys in a run of index entries: 0 if
+ * it isn't there, ~0 if the entries are broken.
+ */
+static inline uint64_t guestNtfsFindHiberfil(const uint8_t *p, const uint8_t *end)
+{
+	static const char name[] = "hiberfil.sys";
+	while( p + 0x10 <= end )
+	{
+		const uint16_t entryLen = guestLe16(p + 8);
+		const uint16_t keyLen = guestLe16(p + 0x0a);
+		if( guestLe32(p + 0x0c) & NTFS_INDEX_ENTRY_END )
+			return 0;
+		if( entryLen < 0x10 || p + entryLen > end || 0x10 + keyLen > entryLen )
+			return ~0ull;
+
+		// the key is a $FILE_NAME
+		const uint8_t *key = p + 0x10;
+		if( keyLen >= 0x42 && key[0x40] == sizeof(name) - 1 && 0x42 + key[0x40] * 2 <= keyLen )
+		{
+			unsigned i = 0;
+			for(; i < sizeof(name) - 1; i++)
+			{
+				const uint16_t c = guestLe16(key + 0x42 + i * 2);
+				if( ( c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c ) != name[i] )
+					break;
+			}
+			if( i == sizeof(name) - 1 )
+				return guestLe64(p) & 0xffffffffffffull;
+		}
+		p += entryLen;
+	}
+	return ~0ull;
+}
+
+/*
+ * True if Windows was hibernated on the volume (Fast Startup included):
+ * hiberfil.sys in the root directory starts with "hibr". Also true if the
+ * root directory can't be read.
+ */
+static inline bool guestNtfsHibernated(const struct GuestNtfs *n, uint8_t *rec)
+{
+	uint8_t *mftRec = guestAlloc(n->recordSize);
+	uint8_t *blocks = NULL;
+	bool hibernated = true;
+	uint64_t found = ~0ull;
+	const uint8_t *attr;
+
+	if( !guestNtfsRecord(n->d, n->mft, mftRec, n->recordSize) || !guestNtfsMftRecord(n, mftRec, 5, rec) ||
+		!( attr = guestNtfsAttrNamed(rec, n->recordSize, 0x90, 4) ) || attr[8] != 0 )
+		goto out;
+
+	// $INDEX_ROOT of $I30, then all the blocks of its $INDEX_ALLOCATION
+	const uint8_t *root = attr + guestLe16(attr + 0x14);
+	const uint32_t rootLen = guestLe32(attr + 0x10);
+	if( rootLen < 0x20 || root + rootLen > rec + n->recordSize )
+		goto out;
+	const uint32_t blockSize = guestLe32(root + 8);
+	const uint8_t *hdr = root + 0x10;
+	if( guestLe32(hdr) > rootLen - 0x10 || guestLe32(hdr + 4) > rootLen - 0x10 )
+		goto out;
+	found = guestNtfsFindHiberfil(hdr + guestLe32(hdr), hdr + guestLe32(hdr + 4));
+
+	if( found == 0 && ( attr = guestNtfsAttrNamed(rec, n->recordSize, 0xa0, 4) ) )
+	{
+		const uint64_t allocLen = attr[8] ? guestLe64(attr + 0x30) : 0;
+		if( blockSize < 512 || blockSize > 65536 || ( blockSize & (blockSize - 1) ) || allocLen > 64 * 1024 * 1024 )
+		{
+			found = ~0ull;
+			goto out;
+		}
+		blocks = guestAlloc(allocLen + 1);
+		if( !guestNtfsAttrRead(n, attr, rec + n->recordSize, 0, blocks, allocLen) )
+		{
+			found = ~0ull;
+			goto out;
+		}
+		for(uint64_t off = 0; off + blockSize <= allocLen && found == 0; off += blockSize)
+		{
+			uint8_t *block = blocks + off;
+			// unused blocks are skipped, a stale entry in one only costs the
+			// free space
+			if( memcmp(block, "INDX", 4) != 0 || !guestNtfsFixup(block, blockSize) )
+				continue;
+			const uint8_t *bhdr = block + 0x18;
+			if( guestLe32(bhdr) > blockSize - 0x18 || guestLe32(bhdr + 4) > blockSize - 0x18 )
+				continue;
+			found = guestNtfsFindHiberfil(bhdr + guestLe32(bhdr), bhdr + guestLe32(bhdr + 4));
+			if( found == ~0ull )
+				found = 0;
+		}
+	}
+
+out:
+	if( found == 0 )
+		hibernated = false;
+	else if( found != ~0ull && guestNtfsMftRecord(n, mftRec, found, rec) && ( attr = guestNtfsAttr(rec, n->recordSize, 0x80) ) )
+	{
+		// an empty or short hiberfil.sys isn't a hibernation image
+		uint8_t magic[4];
+		const uint64_t dataLen = attr[8] ? guestLe64(attr + 0x30) : guestLe32(attr + 0x10);
+		hibernated = dataLen >= sizeof(magic) &&
+			( !guestNtfsAttrRead(n, attr, rec + n->recordSize, 0, magic, sizeof(magic)) ||
+			  memcmp(magic, "hibr", 4) == 0 || memcmp(magic, "HIBR", 4) == 0 );
+	}
+	free(blocks);
+	free(mftRec);
+	return hibernated;
+}
+
+static inline uint64_t guestNtfs(struct GuestDisk *d, uint64_t start, uint64_t size, const uint8_t *boot)
+{
+	const uint16_t bytesPerSector = guestLe16(boot + 0x0b);
+	const uint8_t spc = boot[0x0d];
+	const uint64_t sectorsPerCluster = spc > 0x80 ? 1ull << (256 - spc) : spc;
+	const uint64_t clusterSize = bytesPerSector * sectorsPerCluster;
+	const int8_t cpr = boot[0x40];
+	const uint64_t recordSize = cpr > 0 ? cpr * clusterSize : 1ull << -cpr;
+	const uint64_t clusters = sectorsPerCluster ? guestLe64(boot + 0x28) / sectorsPerCluster : 0;
+	const uint64_t mft = start + guestLe64(boot + 0x30) * clusterSize;
+
+	if( bytesPerSector < 512 || bytesPerSector > 4096 || !sectorsPerCluster || clusterSize > 2 * 1024 * 1024 ||
+		recordSize < 1024 || recordSize > 64 * 1024 || clusters * clusterSize > size || mft + 7 * recordSize > start + size )
+	{
+		fprintf(stderr, "guestfs: NTFS at %" PRIu64 ": invalid boot sector\n", start);
+		return 0;
+	}
+
+	const struct GuestNtfs n = { d, start, size, clusterSize, recordSize, mft };
+	uint8_t *rec = guestAlloc(recordSize);
+	uint8_t *bitmap = NULL;
+	uint64_t freeBytes = 0;
+
+	// $Volume, the dirty flag is in $VOLUME_INFORMATION
+	const uint8_t *attr;
+	if( !guestNtfsRecord(d, mft + 3 * recordSize, rec, recordSize) ||
+		!( attr = guestNtfsAttr(rec, recordSize, 0x70) ) || attr[8] != 0 ||
+		guestLe32(attr + 0x10) < 12 )
+	{
+		fprintf(stderr, "guestfs: NTFS at %" PRIu64 ": can't read $Volume\n", start);
+		goto out;
+	}
+	if( guestLe16(attr + guestLe16(attr + 0x14) + 0x0a) & 0x0001 )
+	{
+		fprintf(stderr, "guestfs: NTFS at %" PRIu64 ": volume is dirty, not skipping anything\n", start);
+		goto out;
+	}
+	if( !guestNtfsLogClean(&n, rec) )
+	{
+		fprintf(stderr, "guestfs: NTFS at %" PRIu64 ": $LogFile isn't clean (mounted or hibernated), not skipping anything\n", start);
+		goto out;
+	}
+	if( guestNtfsHibernated(&n, rec) )
+	{
+		fprintf(stderr, "guestfs: NTFS at %" PRIu64 ": Windows is hibernated, not skipping anything\n", start);
+		goto out;
+	}
+
+	// $Bitmap, one bit per cluster
+	if( !guestNtfsRecord(d, mft + 6 * recordSize, rec, recordSize) ||
+		!( attr = guestNtfsAttr(rec, recordSize, 0x80) ) )
+	{
+		fprintf(stderr, "guestfs: NTFS at %" PRIu64 ": can't read $Bitmap\n", start);
+		goto out;
+	}
+
+	const uint64_t bitmapSize = (clusters + 7) / 8;
+	bitmap = guestAlloc(bitmapSize);
+	if( !guestNtfsAttrRead(&n, attr, rec + recordSize, 0, bitmap, bitmapSize) )
+	{
+		fprintf(stderr, "guestfs: NTFS at %" PRIu64 ": invalid $Bitmap\n", start);
+		goto out;
+	}
+
+	freeBytes = guestFreeBits(d, bitmap, clusters, start, clusterSize);
+	printf("guestfs: NTFS at %" PRIu64 ": %" PRIu64 " of %" PRIu64 " MiB free\n", start, freeBytes >> 20, (clusters * clusterSize) >> 20);
+
+out:
+	free(bitmap);
+	free(rec);
+	return freeBytes;
+}
+
+#define EXT4_INCOMPAT_RECOVER	0x0004
+#define EXT4_INCOMPAT_META_BG	0x0010
+#define EXT4_INCOMPAT_64BIT		0x0080
+#define EXT4_RO_COMPAT_BIGALLOC	0x0200
+#define EXT4_BG_BLOCK_UNINIT	0x0002
+
+static inline uint64_t guestExt4(struct GuestDisk *d, uint64_t start, uint64_t size, const uint8_t *sb)
+{
+	const uint32_t logBlockSize = guestLe32(sb + 0x18);
+	const uint64_t blockSize = logBlockSize <= 6 ? 1024ull << logBlockSize : 0;
+	const uint32_t firstDataBlock = guestLe32(sb + 0x14);
+	const uint32_t blocksPerGroup = guestLe32(sb + 0x20);
+	const uint16_t state = guestLe16(sb + 0x3a);
+	const uint32_t incompat = guestLe32(sb + 0x60);
+	const uint32_t roCompat = guestLe32(sb + 0x64);
+	uint64_t blocks = guestLe32(sb + 0x04);
+	unsigned descSize = 32;
+	if( incompat & EXT4_INCOMPAT_64BIT )
+	{
+		blocks |= (uint64_t)guestLe32(sb + 0x150) << 32;
+		descSize = guestLe16(sb + 0xfe);
+	}
+
+	if( !blockSize || !blocksPerGroup || blocksPerGroup > blockSize * 8 || blocks * blockSize > size ||
+		descSize < 32 || descSize > blockSize || blocks <= firstDataBlock )
+	{
+		fprintf(stderr, "guestfs: ext4 at %" PRIu64 ": invalid superblock\n", start);
+		return 0;
+	}
+	if( ( incompat & EXT4_INCOMPAT_META_BG ) || ( roCompat & EXT4_RO_COMPAT_BIGALLOC ) )
+	{
+		fprintf(stderr, "guestfs: ext4 at %" PRIu64 ": meta_bg and bigalloc are not supported\n", start);
+		return 0;
+	}
+	if( state != 1 || ( incompat & EXT4_INCOMPAT_RECOVER ) )
+	{
+		fprintf(stderr, "guestfs: ext4 at %" PRIu64 ": not cleanly unmounted, not skipping anything\n", start);
+		return 0;
+	}
+
+	const uint64_t groups = (blocks - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+	const uint64_t gdtSize = groups * descSize;
+	const uint64_t gdtOffset = (firstDataBlock + 1) * blockSize;
+	if( gdtOffset + gdtSize > size )
+	{
+		fprintf(stderr, "guestfs: ext4 at %" PRIu64 ": invalid group descriptors\n", start);
+		return 0;
+	}
+
+	uint8_t *gdt = guestAlloc(gdtSize);
+	uint8_t *bitmap = guestAlloc(blockSize);
+	d->read(d->ctx, start + gdtOffset, gdt, gdtSize);
+
+	uint64_t freeBytes = 0;
+	for(uint64_t g = 0; g < groups; g++)
+	{
+		const uint8_t *desc = gdt + g * descSize;
+
+		// not initialized yet, its metadata may live in it, count it as used
+		if( guestLe16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT )
+			continue;
+
+		uint64_t bitmapBlock = guestLe32(desc);
+		if( descSize >= 64 )
+			bitmapBlock |= (uint64_t)guestLe32(desc + 0x20) << 32;
+		if( bitmapBlock >= blocks )
+		{
+			fprintf(stderr, "guestfs: ext4 at %" PRIu64 ": group %" PRIu64 " has an invalid bitmap\n", start, g);
+			continue;
+		}
+
+		const uint64_t first = firstDataBlock + g * blocksPerGroup;
+		const uint64_t count = blocks - first < blocksPerGroup ? blocks - first : blocksPerGroup;
+		d->read(d->ctx, start + bitmapBlock * blockSize, bitmap, blockSize);
+		freeBytes += guestFreeBits(d, bitmap, count, start + first * blockSize, blockSize);
+	}
+
+	printf("guestfs: ext4 at %" PRIu64 ": %" PRIu64 " of %" PRIu64 " MiB free\n", start, freeBytes >> 20, (blocks * blockSize) >> 20);
+
+	free(bitmap);
+	free(gdt);
+	return freeBytes;
+}
+
+static inline uint64_t guestPartition(struct GuestDisk *d, uint64_t start, uint64_t size)
+{
+	if( start >= d->size || size > d->size - start || size < 64 * 1024 )
+		return 0;
+
+	uint8_t buf[2048];
+	d->read(d->ctx, start, buf, sizeof(buf));
+
+	if( memcmp(buf + 3, "NTFS    ", 8) == 0 )
+		return guestNtfs(d, start, size, buf);
+	if( guestLe16(buf + 1024 + 0x38) == 0xef53 )
+		return guestExt4(d, start, size, buf + 1024);
+	return 0;
+}
+
+static inline uint64_t guestGpt(struct GuestDisk *d)
+{
+	uint8_t hdr[512];
+	d->read(d->ctx, 512, hdr, sizeof(hdr));
+	if( memcmp(hdr, "EFI PART", 8) != 0 )
+	{
+		fprintf(stderr, "guestfs: protective MBR without a GPT header\n");
+		return 0;
+	}
+
+	const uint64_t entriesLba = guestLe64(hdr + 0x48);
+	const uint32_t entries = guestLe32(hdr + 0x50);
+	const uint32_t entrySize = guestLe32(hdr + 0x54);
+	if( entrySize < 128 || entrySize > 4096 || entries > 65536 || entriesLba * 512 + (uint64_t)entries * entrySize > d->size )
+	{
+		fprintf(stderr, "guestfs: invalid GPT header\n");
+		return 0;
+	}
+
+	uint8_t *table = guestAlloc((uint64_t)entries * entrySize);
+	d->read(d->ctx, entriesLba * 512, table, (uint64_t)entries * entrySize);
+
+	static const uint8_t unused[16];
+	uint64_t freeBytes = 0;
+	for(uint32_t i = 0; i < entries; i++)
+	{
+		const uint8_t *e = table + (uint64_t)i * entrySize;
+		const uint64_t first = guestLe64(e + 0x20);
+		const uint64_t last = guestLe64(e + 0x28);
+		if( memcmp(e, unused, 16) == 0 || last < first )
+			continue;
+		freeBytes += guestPartition(d, first * 512, (last - first + 1) * 512);
+	}
+
+	free(table);
+	return freeBytes;
+}
+
+static inline int guestExtentCompare(const void *a, const void *b)
+{
+	const struct Extent *x = a, *y = b;
+	return x->virtOffset < y->virtOffset ? -1 : x->virtOffset > y->virtOffset;
+}
+
+/*
+ * Fill "freeMap" with the ranges of the disk that are free in its file
+ * systems, returns their total size. Only primary MBR partitions are
+ * looked at.
+ */
+static inline uint64_t guestFreeMap(struct ExtentMap *freeMap, GuestRead read, void *ctx, uint64_t diskSize)
+{
+	memset(freeMap, 0, sizeof(*freeMap));
+	freeMap->virtualSize = diskSize;
+	struct GuestDisk d = { read, ctx, diskSize, freeMap };
+
+	if( diskSize < 64 * 1024 )
+		return 0;
+
+	uint8_t mbr[512];
+	read(ctx, 0, mbr, sizeof(mbr));
+
+	uint64_t freeBytes = 0;
+	if( mbr[510] != 0x55 || mbr[511] != 0xaa || memcmp(mbr + 3, "NTFS    ", 8) == 0 )
+		freeBytes = guestPartition(&d, 0, diskSize);
+	else
+	{
+		for(unsigned i = 0; i < 4; i++)
+		{
+			const uint8_t *e = mbr + 446 + i * 16;
+			const uint8_t type = e[4];
+			if( type == 0xee )
+			{
+				freeBytes = guestGpt(&d);
+				break;
+			}
+			if( type == 0 || type == 0x05 || type == 0x0f || type == 0x85 )
+				continue;
+			freeBytes += guestPartition(&d, guestLe32(e + 8) * 512ull, guestLe32(e + 12) * 512ull);
+		}
+	}
+
+	// partitions needn't be in disk order, overlapping ones are ignored
+	qsort(freeMap->ext, freeMap->count, sizeof(*freeMap->ext), guestExtentCompare);
+	uint64_t out = 0;
+	for(uint64_t i = 0; i < freeMap->count; i++)
+	{
+		const struct Extent *prev = out ? &freeMap->ext[out - 1] : NULL;
+		if( prev && prev->virtOffset + prev->length > freeMap->ext[i].virtOffset )
+		{
+			freeBytes -= freeMap->ext[i].length;
+			continue;
+		}
+		freeMap->ext[out++] = freeMap->ext[i];
+	}
+	freeMap->count = out;
+
+	return freeBytes;
+}
+
+#endif
@@ -0,0 +1,340 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+"""
+Copyright (c) 2020  StorPool.
+All rights reserved.
+
+
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+"""
+
+"""
+Migrate a wave of VMs: run the copy of every disk in the manifest, as many
+at a time as the source hosts and the targets allow.
+
+The manifest is JSON:
+
+{
+    "limits": {
+        "sources": { "xs1": 4 },
+        "targets": { "sp-cluster": 16 }
+    },
+    "vms": [
+        {
+            "name": "web1",
+            "disks": [
+                {
+                    "type": "xs",
+                    "host": "xs1",
+                    "path": "/run/sr-mount/<sr>/<uuid>.vhd",
+                    "out": "/dev/storpool/web1-disk0",
+                    "target": "sp-cluster",
+                    "size": 42949672960,
+                    "depth": 3
+                }
+            ]
+        }
+    ]
+}
+
+"type" is "xs" (copy-xs-to-raw.py), "hv" (copy-hv-to-raw.py) or "vmware"
+(any2kvm copy of a chain on this host, "host" is not needed). "user" is
+passed to the copy scripts, "local" to copy-xs-to-raw.py only. "size" is the data in the chain and
+"depth" the number of images in it; they only order the work, the disks
+that take longest are started first. "target" groups the outputs that share
+a storage system, it defaults to the directory of "out".
+"""
+
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+
+# the fixed cost of an image in the chain (a download, a conversion pass),
+# in bytes of data
+LAYER_COST = 1024 * 1024 * 1024
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+class Disk(object):
+
+    def __init__(self, vm, index, d):
+        self.vm = vm
+        self.name = '{}/{}'.format(vm, index)
+        self.type = d['type']
+        if self.type not in ('xs', 'hv', 'vmware'):
+            raise ValueError('{}: unknown type {}'.format(self.name, self.type))
+        self.host = d.get('host', 'localhost')
+        self.path = d['path']
+        if self.type == 'vmware':
+            self.path = os.path.abspath(self.path)
+        self.out = os.path.abspath(d['out'])
+        self.target = d.get('target', os.path.dirname(self.out))
+        self.user = d.get('user')
+        self.local = d.get('local', False)
+        if self.local and self.type != 'xs':
+            raise ValueError('{}: "local" is only for xs disks'.format(self.name))
+        self.size = d.get('size')
+        if self.size is None and self.type == 'vmware':
+            self.size = os.path.getsize(self.path)
+        self.size = self.size or 0
+        self.depth = d.get('depth', 1)
+        self.cost = self.size + self.depth * LAYER_COST
+
+        self.proc = None
+        self.log = None
+        self.bwlimit = 0
+        self.started = None
+        self.status = 'pending'
+
+    def network(self):
+        return self.type != 'vmware' and not self.local
+
+    def command(self, args):
+        if self.type == 'vmware':
+            # the maps of the unchanged layers are kept for the next pass
+            return [ './any2kvm', 'copy', '-I', os.path.join(args.dir, 'index'),
+                    self.out, self.path ]
+
+        if self.type == 'xs':
+            cmd = [ sys.executable, 'copy-xs-to-raw.py' ]
+        else:
+            cmd = [ 'python2', 'copy-hv-to-raw.py' ]
+        cmd += [ self.host, self.path, self.out,
+                '-d', os.path.join(args.dir, self.vm) ]
+        if self.user:
+            cmd += [ '-u', self.user ]
+        if self.local:
+            cmd.append('-l')
+        if self.bwlimit:
+            cmd += [ '-b', str(self.bwlimit) ]
+        if args.base_cache:
+            cmd += [ '-c', args.base_cache ]
+        if args.finish:
+            cmd.append('-f')
+        return cmd
+
+
+def load_manifest(path):
+    with open(path) as f:
+        manifest = json.load(f)
+
+    disks = []
+    for vm in manifest['vms']:
+        for i, d in enumerate(vm['disks']):
+            disks.append(Disk(vm['name'], i, d))
+
+    limits = manifest.get('limits', {})
+    return disks, limits.get('sources', {}), limits.get('targets', {})
+
+
+def fmt_bytes(n):
+    return '{:.1f} GiB'.format(n / 1024.0 ** 3)
+
+
+def fmt_time(t):
+    t = int(t)
+    return '{}h{:02d}m{:02d}s'.format(t // 3600, t // 60 % 60, t % 60)
+
+
+class Wave(object):
+
+    def __init__(self, args, disks, source_limits, target_limits):
+        self.args = args
+        # longest first: with list scheduling that keeps the big disks from
+        # starting last and running alone at the end of the wave
+        self.pending = sorted(disks, key=lambda d: d.cost, reverse=True)
+        self.running = []
+        self.done = []
+        self.failed = []
+        self.total = sum(d.cost for d in disks)
+        self.source_limits = source_limits
+        self.target_limits = target_limits
+        self.start = time.time()
+        self.last_report = 0
+
+    def busy(self, attr, value):
+        return sum(1 for d in self.running if getattr(d, attr) == value)
+
+    def can_start(self, disk):
+        if len(self.running) >= self.args.jobs:
+            return False
+        limit = self.source_limits.get(disk.host, self.args.per_source)
+        if self.busy('host', disk.host) >= limit:
+            return False
+        limit = self.target_limits.get(disk.target, self.args.per_target)
+        if self.busy('target', disk.target) >= limit:
+            return False
+        return True
+
+    def bandwidth_share(self):
+        # KiB/s for the next download: the budget split among the downloads
+        # that can run at once, out of what the running ones left over
+        budget = self.args.bwlimit * 1024
+        left = budget - sum(d.bwlimit for d in self.running)
+        slots = min(self.args.jobs,
+                1 + sum(1 for d in self.running + self.pending if d.network()))
+        return max(1, min(budget // slots, left))
+
+    def launch(self, disk):
+        if self.args.bwlimit and disk.network():
+            disk.bwlimit = self.bandwidth_share()
+
+        log = os.path.join(self.args.log_dir, disk.name.replace('/', '-') + '.log')
+        disk.log = open(log, 'a')
+        cmd = disk.command(self.args)
+        disk.log.write('# {}\n'.format(' '.join(cmd)))
+        disk.log.flush()
+        disk.proc = subprocess.Popen(cmd, cwd=TOOLS_DIR, stdin=subprocess.DEVNULL,
+                stdout=disk.log, stderr=subprocess.STDOUT)
+        disk.started = time.time()
+        disk.status = 'running'
+        self.running.append(disk)
+        print('started {} ({}, {} -> {}{})'.format(disk.name, fmt_bytes(disk.size),
+            disk.host, disk.target,
+            ', {} KiB/s'.format(disk.bwlimit) if disk.bwlimit else ''))
+
+    def schedule(self):
+        for disk in list(self.pending):
+            if self.can_start(disk):
+                self.pending.remove(disk)
+                self.launch(disk)
+
+    def reap(self):
+        changed = False
+        for disk in list(self.running):
+            res = disk.proc.poll()
+            if res is None:
+                continue
+            disk.log.close()
+            self.running.remove(disk)
+            elapsed = fmt_time(time.time() - disk.started)
+            if res == 0:
+                disk.status = 'done'
+                self.done.append(disk)
+                print('done {} in {}'.format(disk.name, elapsed))
+            else:
+                disk.status = 'failed'
+                self.failed.append(disk)
+                print('FAILED {} after {} (exit {}), see {}'.format(
+                    disk.name, elapsed, res, disk.log.name))
+            changed = True
+        return changed
+
+    def report(self):
+        now = time.time()
+        elapsed = now - self.start
+        finished = sum(d.cost for d in self.done + self.failed)
+        eta = ''
+        if finished and self.pending + self.running:
+            eta = ', ETA {}'.format(fmt_time(elapsed * (self.total - finished) / finished))
+        print('[{}] {}/{} disks done, {} running, {} pending, {} failed, {} of {}{}'.format(
+            fmt_time(elapsed), len(self.done), len(self.done) + len(self.failed) +
+            len(self.running) + len(self.pending), len(self.running),
+            len(self.pending), len(self.failed),
+            fmt_bytes(sum(d.size for d in self.done)),
+            fmt_bytes(sum(d.size for d in self.done + self.failed + self.running + self.pending)),
+            eta))
+        sys.stdout.flush()
+        self.last_report = now
+
+    def run(self):
+        try:
+            while self.pending or self.running:
+                self.schedule()
+                if self.reap() or time.time() - self.last_report >= self.args.interval:
+                    self.report()
+                time.sleep(1)
+        except KeyboardInterrupt:
+            for disk in self.running:
+                disk.proc.terminate()
+            for disk in self.running:
+                disk.proc.wait()
+            raise
+
+
+def main():
+
+    parser = argparse.ArgumentParser(description='Migrate a wave of VMs')
+    parser.add_argument('manifest', help='The wave manifest, JSON')
+    parser.add_argument('-j', '--jobs', type=int, default=8,
+            help='Disks copied at once in the whole wave. Default is 8.')
+    parser.add_argument('-s', '--per-source', type=int, default=2,
+            help='Disks copied at once from one source host, unless the '
+            'manifest sets another limit for the host. Default is 2.')
+    parser.add_argument('-t', '--per-target', type=int, default=4,
+            help='Disks written at once to one target, unless the manifest '
+            'sets another limit for it. Default is 4.')
+    parser.add_argument('-b', '--bwlimit', type=int, default=0,
+            help='Download bandwidth of the whole wave, MiB/s. Each download '
+            'gets its share when it starts. Default is no limit.')
+    parser.add_argument('-d', '--download-dir', default='/var/tmp/wave',
+            dest='dir',
+            help='Directory for the downloaded images, one subdirectory per '
+            'VM. Default is /var/tmp/wave.')
+    parser.add_argument('-c', '--base-cache',
+            help='Directory of converted root images shared by the copies, '
+            'see the copy scripts.')
+    parser.add_argument('-l', '--log-dir', default='.',
+            help='Directory for the log of every disk. Default is the current '
+            'directory.')
+    parser.add_argument('-i', '--interval', type=int, default=60,
+            help='Seconds between progress reports. Default is 60.')
+    parser.add_argument('-f', '--finish', action='store_true',
+            help='Apply the top images. Use this option for the last pass, '
+            'when the source VMs are stopped.')
+
+    args = parser.parse_args()
+    # the copies run in the tools directory
+    args.dir = os.path.abspath(args.dir)
+    if args.base_cache:
+        args.base_cache = os.path.abspath(args.base_cache)
+
+    disks, source_limits, target_limits = load_manifest(args.manifest)
+    outs = set()
+    for disk in disks:
+        if disk.out in outs:
+            raise ValueError('{}: output {} used twice'.format(disk.name, disk.out))
+        outs.add(disk.out)
+
+    if not os.path.isdir(args.log_dir):
+        os.makedirs(args.log_dir)
+
+    wave = Wave(args, disks, source_limits, target_limits)
+    print('{} disks, {} of data'.format(len(disks), fmt_bytes(sum(d.size for d in disks))))
+    wave.run()
+
+    if wave.failed:
+        print('Failed:')
+        print('\n'.join('{} ({})'.format(d.name, d.log.name) for d in wave.failed))
+        sys.exit(1)
+    print('Wave complete!')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,1540 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * Output side shared by the converters.
+ *
+ * The converters walk the image metadata and hand every extent they find
+ * to outputData() / outputZero(). Depending on how the output was opened
+ * the extents are either written to the target, batched into pwritev()
+ * calls over contiguous virtual ranges, written out as a new qcow2 image
+ * (see qcow2.h), or recorded in an extent map (see extent.h) without
+ * touching the data. The map is saved as a map file or as JSON, or with
+ * --dry-run only counted.
+ *
+ * Raw targets with blocks larger than 512 bytes get write shaping: the
+ * unaligned head and tail of a run are widened to whole blocks, the rest
+ * of the block taken from what the target already holds (the parent
+ * layer, converted before), and small pieces close to each other are
+ * merged into one write. That way the device never sees a partial block
+ * write and doesn't have to read-modify-write.
+ *
+ * The write size, iovec count and writes in flight come from the target's
+ * limits (see target.h). With more than one write in flight the batches
+ * are handed to writer threads; outputFlush() still waits for all of them.
+ *
+ * Writes through the page cache are kept from piling up: every time half
+ * the dirty limit has been written, writeback of that window is started
+ * with sync_file_range() and the window before it is waited for and
+ * dropped from the cache. Dirty memory stays bounded and the fdatasync()
+ * at the end has little left to do.
+ *
+ * When the target is a file and the converter gave the source file with
+ * outputSourceFd(), whole-block extents stored as-is are not copied
+ * through memory: they are cloned with FICLONERANGE if the file system
+ * can share the blocks (XFS, btrfs on the same file system), or copied by
+ * the kernel with copy_file_range(). Either falls back to the normal path
+ * when the file systems don't support it.
+ *
+ * With O_DIRECT the iovecs must be aligned in memory too. Runs the source
+ * image has at an unaligned address (COWD grains are 512-byte aligned) are
+ * gathered into staging buffers, one per batch in flight, allocated once
+ * from huge pages where possible and touched first by the thread that
+ * fills them, so they are on its NUMA node. Aligned runs are written from
+ * the source as they are.
+ *
+ * With --resync the same layer can be applied again and again while it
+ * grows, e.g. the live top image between passes. For every block the
+ * state file keeps a hash of which parts the image had (its bitmap) and
+ * one of their data, as last written; blocks where both are the same are
+ * skipped. A block that lost parts since can't be fixed from this layer,
+ * the target has to be rebuilt from the parents then.
+ *
+ * With --prealloc a file target is created if it isn't there and sized,
+ * and the writes are held back: the extents are collected as for -m and
+ * on outputClose() allocated with fallocate() in extent order, runs with
+ * small gaps between them as one, before they are written. That lays the
+ * image out in the file nearly in one piece, where the writes alone leave
+ * it scattered. --extsize sets the extent size hint of a new file.
+ *
+ * The including file must define _GNU_SOURCE before any system header.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <sys/mman.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "extent.h"
+#include "qcow2.h"
+#include "target.h"
+
+#define OUTPUT_MAX_IOV		1024
+#define OUTPUT_ZERO_SIZE	(64 * 1024)
+#define OUTPUT_SHAPE_MAX	(256 * 1024)
+#define OUTPUT_DIRTY_LIMIT	(256 * 1024 * 1024)
+#define OUTPUT_OFFLOAD_MIN	(64 * 1024)
+#define OUTPUT_HUGE_PAGE	(2 * 1024 * 1024)
+#define OUTPUT_RESYNC_BLOCK	(1024 * 1024)
+#define OUTPUT_RESYNC_MAGIC	"a2kresy1"
+#define OUTPUT_PREALLOC_GAP	(256 * 1024)
+
+// the output options every converter takes, see outputOption()
+#define OUTPUT_OPTIONS		"m:O:B:c"
+#define OUTPUT_USAGE		"[-m extents.map | --json extents.json | --dry-run | -O qcow2 [-B backing] [-c]] [--direct] [--explain] [--calibrate] [--depth writes] [--dirty-limit MiB] [--resync state] [--prealloc [--extsize MiB]]"
+
+#define OUTPUT_OPT_EXPLAIN		0x100
+#define OUTPUT_OPT_CALIBRATE	0x101
+#define OUTPUT_OPT_DIRTY_LIMIT	0x102
+#define OUTPUT_OPT_DRY_RUN		0x103
+#define OUTPUT_OPT_JSON			0x104
+#define OUTPUT_OPT_DIRECT		0x105
+#define OUTPUT_OPT_DEPTH		0x106
+#define OUTPUT_OPT_RESYNC		0x107
+#define OUTPUT_OPT_PREALLOC		0x108
+#define OUTPUT_OPT_EXTSIZE		0x109
+
+static const struct option outputLongOptions[] =
+{
+	{ "explain", no_argument, NULL, OUTPUT_OPT_EXPLAIN },
+	{ "calibrate", no_argument, NULL, OUTPUT_OPT_CALIBRATE },
+	{ "dirty-limit", required_argument, NULL, OUTPUT_OPT_DIRTY_LIMIT },
+	{ "map", required_argument, NULL, 'm' },
+	{ "json", required_argument, NULL, OUTPUT_OPT_JSON },
+	{ "dry-run", no_argument, NULL, OUTPUT_OPT_DRY_RUN },
+	{ "direct", no_argument, NULL, OUTPUT_OPT_DIRECT },
+	{ "depth", required_argument, NULL, OUTPUT_OPT_DEPTH },
+	{ "resync", required_argument, NULL, OUTPUT_OPT_RESYNC },
+	{ "prealloc", no_argument, NULL, OUTPUT_OPT_PREALLOC },
+	{ "extsize", required_argument, NULL, OUTPUT_OPT_EXTSIZE },
+	{ NULL, 0, NULL, 0 },
+};
+
+static const char outputZeroes[OUTPUT_ZERO_SIZE] __attribute__((aligned(4096)));
+
+struct OutputJob
+{
+	enum { JOB_FREE, JOB_READY, JOB_BUSY } state;
+	struct iovec	iov[OUTPUT_MAX_IOV];
+	unsigned		iovCnt;
+	uint64_t		offset;
+	uint64_t		len;
+	uint8_t			*stage;
+};
+
+struct OutputResyncHeader
+{
+	char			magic[8];
+	uint64_t		virtualSize;
+	uint64_t		blockSize;
+	uint64_t		blocks;
+};
+
+struct OutputResyncBlock
+{
+	uint64_t		coverage;	// hash of the parts present and zeroed
+	uint64_t		data;		// hash of their data
+	uint64_t		covered;	// bytes
+};
+
+struct OutputResyncPiece
+{
+	uint64_t		virtOffset;
+	uint64_t		len;
+	uint64_t		srcOffset;	// EXTENT_ZERO for zeroes
+};
+
+struct OutputResync
+{
+	const char		*path;
+	uint64_t		blockSize;
+	uint64_t		blocks;
+	struct OutputResyncBlock	*old;
+	struct OutputResyncBlock	*cur;
+
+	// the block being collected, written or skipped when it's complete
+	uint64_t		block;
+	uint64_t		end;
+	struct OutputResyncPiece	*pieces;
+	unsigned		piecesCount;
+	unsigned		piecesAlloc;
+
+	uint64_t		skipped;
+	uint64_t		rewritten;
+};
+
+struct Output
+{
+	int				fd;
+	bool			mapping;
+	const char		*mapPath;
+	const char		*jsonPath;
+	bool			dryRun;
+	double			mapStart;
+	struct ExtentMap	map;
+	struct Qcow2Writer	*qcow2;
+
+	const uint8_t	*src;
+	uint64_t		srcSize;
+
+	// copy offload, off if "srcFd" is -1 or the target isn't a file
+	int				srcFd;
+	bool			offload;
+	bool			noClone;
+	uint64_t		cloned;
+	uint64_t		offloaded;
+
+	unsigned		maxIov;
+	uint64_t		maxBatch;
+	bool			explain;
+	bool			calibrate;
+	uint64_t		dirtyLimit;
+	unsigned		depthSet;
+
+	struct iovec	iov[OUTPUT_MAX_IOV];
+	unsigned		iovCnt;
+	uint64_t		batchOffset;
+	uint64_t		batchLen;
+
+	// O_DIRECT staging, off if "stage" is NULL
+	unsigned		memAlign;
+	uint8_t			*stage;
+	uint64_t		stageLen;
+	uint64_t		stageSize;
+	uint64_t		staged;
+
+	// target limits, see outputProbe()
+	unsigned		logicalBlock;
+	unsigned		physicalBlock;
+	unsigned		optimalIo;
+
+	// write shaping, off if "align" is 0
+	unsigned		align;
+	uint64_t		shapeGap;
+	uint64_t		shapeMax;
+	uint8_t			*shapeBuf;
+	uint64_t		shapeStart;
+	uint64_t		shapeLen;
+	bool			shapePastEnd;	// a file target was extended past the disk
+
+	// --resync, NULL if off
+	struct OutputResync	*resync;
+
+	// --prealloc, off for block devices; the extents are collected in
+	// "map" while "deferred"
+	bool			prealloc;
+	bool			deferred;
+	uint64_t		preallocated;
+	uint64_t		preallocRuns;
+
+	// writer threads, when more than one write is in flight
+	unsigned		depth;
+	pthread_t		*writers;
+	struct OutputJob	*jobs;
+	unsigned		jobsReady;
+	unsigned		jobsBusy;
+	bool			stopping;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+
+	// page cache writeback, off if "wbWindow" is 0
+	uint64_t		wbWindow;
+	uint64_t		wbLen;
+	uint64_t		wbStart, wbEnd;
+	uint64_t		wbPrevStart, wbPrevEnd;
+};
+
+struct OutputOptions
+{
+	const char		*mapPath;
+	const char		*jsonPath;
+	bool			dryRun;
+	bool			qcow2;
+	const char		*backing;
+	bool			compress;
+	bool			explain;
+	bool			calibrate;
+	bool			dirtyLimitSet;
+	uint64_t		dirtyLimit;
+	bool			direct;
+	unsigned		depth;
+	const char		*resyncPath;
+	bool			prealloc;
+	uint64_t		extSize;
+};
+
+/*
+ * Handle one of OUTPUT_OPTIONS, false if "opt" isn't one of them.
+ */
+static inline bool outputOption(struct OutputOptions *opts, int opt, const char *arg)
+{
+	switch( opt )
+	{
+		case 'm':
+			opts->mapPath = arg;
+			return true;
+		case 'O':
+			if( strcmp(arg, "qcow2") == 0 )
+				opts->qcow2 = true;
+			else if( strcmp(arg, "raw") != 0 )
+			{
+				fprintf(stderr, "unknown output format %s\n", arg);
+				exit(1);
+			}
+			return true;
+		case 'B':
+			opts->backing = arg;
+			return true;
+		case 'c':
+			opts->compress = true;
+			return true;
+		case OUTPUT_OPT_EXPLAIN:
+			opts->explain = true;
+			return true;
+		case OUTPUT_OPT_CALIBRATE:
+			opts->calibrate = true;
+			return true;
+		case OUTPUT_OPT_DIRTY_LIMIT:
+			opts->dirtyLimitSet = true;
+			opts->dirtyLimit = strtoull(arg, NULL, 0) * 1024 * 1024;
+			return true;
+		case OUTPUT_OPT_DRY_RUN:
+			opts->dryRun = true;
+			return true;
+		case OUTPUT_OPT_JSON:
+			opts->jsonPath = arg;
+			return true;
+		case OUTPUT_OPT_DIRECT:
+			opts->direct = true;
+			return true;
+		case OUTPUT_OPT_RESYNC:
+			opts->resyncPath = arg;
+			return true;
+		case OUTPUT_OPT_PREALLOC:
+			opts->prealloc = true;
+			return true;
+		case OUTPUT_OPT_EXTSIZE:
+			opts->extSize = strtoull(arg, NULL, 0) * 1024 * 1024;
+			return true;
+		case OUTPUT_OPT_DEPTH:
+			opts->depth = strtoul(arg, NULL, 0);
+			if( opts->depth < 1 || opts->depth > TARGET_MAX_DEPTH * 8 )
+			{
+				fprintf(stderr, "--depth must be 1 to %u\n", TARGET_MAX_DEPTH * 8);
+				exit(1);
+			}
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * True if nothing is written: the options only ask for the extent map, or
+ * its census. The converters take no target then.
+ */
+static inline bool outputMapOnly(const struct OutputOptions *opts)
+{
+	return opts->mapPath || opts->jsonPath || opts->dryRun;
+}
+
+static inline void outputInit(struct Output *o, const void *src, uint64_t srcSize, uint64_t virtualSize)
+{
+	memset(o, 0, sizeof(*o));
+	o->fd = -1;
+	o->srcFd = -1;
+	o->src = src;
+	o->srcSize = srcSize;
+	o->map.virtualSize = virtualSize;
+	o->maxIov = 256;
+	o->maxBatch = 1024 * 1024;
+	o->dirtyLimit = OUTPUT_DIRTY_LIMIT;
+}
+
+static inline void outputWriteJob(struct Output *o, const struct iovec *iov, unsigned iovCnt, uint64_t offset, uint64_t len)
+{
+	struct iovec rest[OUTPUT_MAX_IOV];
+	for(;;)
+	{
+		const ssize_t res = pwritev(o->fd, iov, iovCnt, offset);
+		if( res <= 0 )
+		{
+			if( res < 0 )
+				perror("pwrite");
+			else
+				fprintf(stderr, "pwrite: nothing written at %" PRIu64 "\n", offset);
+			exit(1);
+		}
+		if( res == len )
+			return;
+
+		// a short write, go on from where it stopped
+		size_t skip = res;
+		offset += res;
+		len -= res;
+		while( skip >= iov->iov_len )
+		{
+			skip -= iov->iov_len;
+			iov++;
+			iovCnt--;
+		}
+		memmove(rest, iov, iovCnt * sizeof(*iov));
+		rest[0].iov_base += skip;
+		rest[0].iov_len -= skip;
+		iov = rest;
+	}
+}
+
+static inline void *outputWriter(void *arg)
+{
+	struct Output *o = arg;
+	pthread_mutex_lock(&o->lock);
+	for(;;)
+	{
+		struct OutputJob *job = NULL;
+		for(unsigned i = 0; i < o->depth && !job; i++)
+			if( o->jobs[i].state == JOB_READY )
+				job = &o->jobs[i];
+		if( !job )
+		{
+			if( o->stopping )
+				break;
+			pthread_cond_wait(&o->cond, &o->lock);
+			continue;
+		}
+
+		job->state = JOB_BUSY;
+		o->jobsReady--;
+		o->jobsBusy++;
+		pthread_mutex_unlock(&o->lock);
+
+		outputWriteJob(o, job->iov, job->iovCnt, job->offset, job->len);
+
+		pthread_mutex_lock(&o->lock);
+		job->state = JOB_FREE;
+		o->jobsBusy--;
+		pthread_cond_broadcast(&o->cond);
+	}
+	pthread_mutex_unlock(&o->lock);
+	return NULL;
+}
+
+/*
+ * A staging buffer for O_DIRECT: huge pages if there are any reserved,
+ * transparent huge pages if not. It's touched here, by the thread that
+ * fills it, so it's local to that thread's NUMA node.
+ */
+static inline uint8_t *outputStageAlloc(struct Output *o, const char **how)
+{
+	void *p = mmap(NULL, o->stageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	*how = "huge pages";
+	if( p == MAP_FAILED )
+	{
+		p = mmap(NULL, o->stageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if( p == MAP_FAILED )
+		{
+			perror("mmap");
+			exit(1);
+		}
+		madvise(p, o->stageSize, MADV_HUGEPAGE);
+		*how = "transparent huge pages";
+	}
+	memset(p, 0, o->stageSize);
+	return p;
+}
+
+/*
+ * Get the limits of the target, pick the write size, iovec count and
+ * depth from them, and turn on write shaping if its blocks are larger
+ * than a sector and it can be read back.
+ */
+static inline void outputProbe(struct Output *o)
+{
+	struct TargetInfo info;
+	struct TargetTuning tuning;
+	targetProbe(o->fd, &info);
+	targetTune(o->fd, &info, o->calibrate, o->explain, &tuning);
+
+	o->logicalBlock = info.logicalBlock;
+	o->physicalBlock = info.physicalBlock;
+	o->offload = !info.isBlock;
+	if( o->prealloc && info.isBlock )
+	{
+		o->prealloc = o->deferred = false;
+		if( o->explain )
+			fprintf(stderr, "preallocation off (block device)\n");
+	}
+	if( o->explain )
+		fprintf(stderr, "copy offload %s\n", o->srcFd == -1 ? "off (no source file)" : o->offload ? "on" : "off (block device)");
+	o->optimalIo = info.optimalIo;
+	o->maxBatch = tuning.writeSize;
+	o->maxIov = tuning.maxIov > OUTPUT_MAX_IOV ? OUTPUT_MAX_IOV : tuning.maxIov;
+	o->depth = tuning.depth;
+	if( o->depthSet )
+	{
+		o->depth = o->depthSet;
+		if( o->explain )
+			fprintf(stderr, "writes in flight %u (--depth)\n", o->depth);
+	}
+
+	if( o->depth > 1 )
+	{
+		o->jobs = calloc(o->depth, sizeof(*o->jobs));
+		o->writers = calloc(o->depth, sizeof(*o->writers));
+		if( !o->jobs || !o->writers )
+		{
+			perror("calloc");
+			exit(1);
+		}
+		pthread_mutex_init(&o->lock, NULL);
+		pthread_cond_init(&o->cond, NULL);
+		for(unsigned i = 0; i < o->depth; i++)
+		{
+			const int res = pthread_create(&o->writers[i], NULL, outputWriter, o);
+			if( res )
+			{
+				fprintf(stderr, "pthread_create: %s\n", strerror(res));
+				exit(1);
+			}
+		}
+	}
+
+	// the memory alignment O_DIRECT needs; for a file it depends on the
+	// device under it, a page is always enough
+	if( fcntl(o->fd, F_GETFL) & O_DIRECT )
+	{
+		o->memAlign = info.isBlock ? info.logicalBlock : 4096;
+		o->stageSize = (o->maxBatch + OUTPUT_HUGE_PAGE - 1) / OUTPUT_HUGE_PAGE * OUTPUT_HUGE_PAGE;
+		const char *how;
+		o->stage = outputStageAlloc(o, &how);
+		for(unsigned i = 0; i < o->depth && o->jobs; i++)
+			o->jobs[i].stage = outputStageAlloc(o, &how);
+		if( o->explain )
+			fprintf(stderr, "O_DIRECT, runs not aligned to %u bytes staged in %u x %" PRIu64 " MiB of %s\n",
+				o->memAlign, o->jobs ? o->depth + 1 : 1, o->stageSize >> 20, how);
+	}
+
+	// O_DIRECT writes leave nothing dirty behind
+	if( o->dirtyLimit && !( fcntl(o->fd, F_GETFL) & O_DIRECT ) )
+		o->wbWindow = o->dirtyLimit / 2 < o->maxBatch ? o->maxBatch : o->dirtyLimit / 2;
+	if( o->explain )
+	{
+		if( o->wbWindow )
+			fprintf(stderr, "writeback every %" PRIu64 " MiB written\n", o->wbWindow >> 20);
+		else
+			fprintf(stderr, "writeback control off (%s)\n", o->dirtyLimit ? "O_DIRECT" : "--dirty-limit 0");
+	}
+
+	const unsigned align = o->physicalBlock;
+	const char *why = NULL;
+	if( align <= 512 )
+		why = "512 byte blocks";
+	else if( ( align & (align - 1) ) || align > OUTPUT_SHAPE_MAX / 4 )
+		why = "odd block size";
+	else if( ( fcntl(o->fd, F_GETFL) & O_ACCMODE ) != O_RDWR )
+		why = "target not readable";
+	if( o->explain )
+		fprintf(stderr, "block size %u logical, %u physical, write shaping %s%s%s\n",
+			o->logicalBlock, o->physicalBlock, why ? "off (" : "on", why ? why : "", why ? ")" : "");
+	if( why )
+		return;
+
+	o->align = align;
+	o->shapeGap = 8 * align;
+	o->shapeMax = o->optimalIo > OUTPUT_SHAPE_MAX ? o->optimalIo / align * align : OUTPUT_SHAPE_MAX;
+	if( posix_memalign((void **)&o->shapeBuf, 4096, o->shapeMax + align) != 0 )
+	{
+		perror("posix_memalign");
+		exit(1);
+	}
+}
+
+static inline void outputOpen(struct Output *o, const char *path, int flags)
+{
+	o->fd = open(path, flags);
+	if( o->fd == -1 )
+	{
+		perror("open");
+		exit(1);
+	}
+	outputProbe(o);
+}
+
+/*
+ * Create the target file for --prealloc if it isn't there, with the
+ * extent size hint (the file system takes it only while nothing is
+ * allocated), and make it as large as the image.
+ */
+static inline void outputCreate(struct Output *o, const char *path, uint64_t extSize)
+{
+	const int fd = open(path, O_RDWR | O_CREAT, 0666);
+	struct stat st;
+	if( fd == -1 || fstat(fd, &st) != 0 )
+	{
+		perror(path);
+		exit(1);
+	}
+	if( !S_ISREG(st.st_mode) )
+	{
+		close(fd);
+		return;
+	}
+
+	if( extSize && st.st_blocks == 0 )
+	{
+		struct fsxattr fsx;
+		bool ok = ioctl(fd, FS_IOC_FSGETXATTR, &fsx) == 0;
+		if( ok )
+		{
+			fsx.fsx_xflags |= FS_XFLAG_EXTSIZE;
+			fsx.fsx_extsize = extSize;
+			// some file systems take it and drop it
+			ok = ioctl(fd, FS_IOC_FSSETXATTR, &fsx) == 0 && ioctl(fd, FS_IOC_FSGETXATTR, &fsx) == 0 &&
+				fsx.fsx_extsize == extSize;
+		}
+		if( !ok )
+			fprintf(stderr, "the file system takes no extent size hint of %" PRIu64 " MiB, --extsize ignored\n", extSize >> 20);
+		else if( o->explain )
+			fprintf(stderr, "extent size hint %" PRIu64 " MiB\n", extSize >> 20);
+	}
+	else if( extSize && o->explain )
+		fprintf(stderr, "--extsize ignored, the target has data\n");
+
+	if( (uint64_t)st.st_size < o->map.virtualSize && ftruncate(fd, o->map.virtualSize) != 0 )
+	{
+		perror("ftruncate");
+		exit(1);
+	}
+	close(fd);
+}
+
+/*
+ * The file "src" is mapped from, for copy offload. Call before opening
+ * the output.
+ */
+static inline void outputSourceFd(struct Output *o, int fd)
+{
+	o->srcFd = fd;
+}
+
+/*
+ * Don't write anything, save the extent map to "path" on outputClose().
+ */
+static inline void outputOpenMap(struct Output *o, const char *path)
+{
+	o->mapping = true;
+	o->mapPath = path;
+	o->mapStart = targetNow();
+}
+
+/*
+ * The allocation unit of the image, for the count of partly present
+ * blocks in the census.
+ */
+static inline void outputBlockSize(struct Output *o, uint64_t blockSize)
+{
+	o->map.blockSize = blockSize;
+}
+
+/*
+ * Open the output the options ask for. A raw target must exist, unless
+ * --prealloc creates it, and is opened with "rawFlags", a qcow2 one is
+ * created.
+ */
+static inline void outputOpenOptions(struct Output *o, const struct OutputOptions *opts, const char *path, int rawFlags)
+{
+	if( outputMapOnly(opts) )
+	{
+		outputOpenMap(o, opts->mapPath);
+		o->jsonPath = opts->jsonPath;
+		o->dryRun = opts->dryRun;
+	}
+	else if( opts->qcow2 && opts->resyncPath )
+	{
+		fprintf(stderr, "--resync only applies to raw output\n");
+		exit(1);
+	}
+	else if( opts->qcow2 && ( opts->prealloc || opts->extSize ) )
+	{
+		fprintf(stderr, "--prealloc and --extsize only apply to raw output\n");
+		exit(1);
+	}
+	else if( opts->qcow2 )
+		o->qcow2 = qcow2WriterOpen(path, o->map.virtualSize, opts->backing, opts->compress);
+	else if( opts->backing || opts->compress )
+	{
+		fprintf(stderr, "-B and -c only apply to qcow2 output\n");
+		exit(1);
+	}
+	else
+	{
+		if( opts->resyncPath )
+		{
+			o->resync = calloc(1, sizeof(*o->resync));
+			if( !o->resync )
+			{
+				perror("calloc");
+				exit(1);
+			}
+			o->resync->path = opts->resyncPath;
+			o->resync->block = ~0ull;
+		}
+		o->explain = opts->explain;
+		o->calibrate = opts->calibrate;
+		if( opts->dirtyLimitSet )
+			o->dirtyLimit = opts->dirtyLimit;
+		o->depthSet = opts->depth;
+		if( opts->prealloc )
+		{
+			outputCreate(o, path, opts->extSize);
+			o->prealloc = o->deferred = true;
+		}
+		outputOpen(o, path, opts->direct ? rawFlags | O_DIRECT : rawFlags);
+	}
+}
+
+/*
+ * Wait for the writes in flight.
+ */
+static inline void outputWait(struct Output *o)
+{
+	if( o->depth > 1 )
+	{
+		pthread_mutex_lock(&o->lock);
+		while( o->jobsReady || o->jobsBusy )
+			pthread_cond_wait(&o->cond, &o->lock);
+		pthread_mutex_unlock(&o->lock);
+	}
+}
+
+/*
+ * Account for a write to the page cache. Once a window is full, its
+ * writeback is started, and the previous window is waited for and
+ * dropped from the cache.
+ */
+static inline void outputWriteback(struct Output *o, uint64_t offset, uint64_t len)
+{
+	if( !o->wbWindow )
+		return;
+
+	if( !o->wbLen || offset < o->wbStart )
+		o->wbStart = offset;
+	if( !o->wbLen || offset + len > o->wbEnd )
+		o->wbEnd = offset + len;
+	o->wbLen += len;
+	if( o->wbLen < o->wbWindow )
+		return;
+
+	// everything accounted for must have been written
+	outputWait(o);
+
+	if( o->wbPrevEnd )
+	{
+		const uint64_t l = o->wbPrevEnd - o->wbPrevStart;
+		if( sync_file_range(o->fd, o->wbPrevStart, l, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0 )
+		{
+			perror("sync_file_range");
+			exit(1);
+		}
+		posix_fadvise(o->fd, o->wbPrevStart, l, POSIX_FADV_DONTNEED);
+	}
+
+	if( sync_file_range(o->fd, o->wbStart, o->wbEnd - o->wbStart, SYNC_FILE_RANGE_WRITE) != 0 )
+	{
+		perror("sync_file_range");
+		exit(1);
+	}
+	o->wbPrevStart = o->wbStart;
+	o->wbPrevEnd = o->wbEnd;
+	o->wbLen = 0;
+}
+
+/*
+ * Send the current batch, to a writer thread if there are any.
+ */
+static inline void outputSubmit(struct Output *o)
+{
+	if( !o->iovCnt )
+		return;
+
+	if( o->depth <= 1 )
+		outputWriteJob(o, o->iov, o->iovCnt, o->batchOffset, o->batchLen);
+	else
+	{
+		pthread_mutex_lock(&o->lock);
+		struct OutputJob *job = NULL;
+		for(;;)
+		{
+			for(unsigned i = 0; i < o->depth && !job; i++)
+				if( o->jobs[i].state == JOB_FREE )
+					job = &o->jobs[i];
+			if( job )
+				break;
+			pthread_cond_wait(&o->cond, &o->lock);
+		}
+
+		memcpy(job->iov, o->iov, o->iovCnt * sizeof(*o->iov));
+		job->iovCnt = o->iovCnt;
+		// the staged runs go with the job, its free buffer is next
+		uint8_t *stage = job->stage;
+		job->stage = o->stage;
+		o->stage = stage;
+		job->offset = o->batchOffset;
+		job->len = o->batchLen;
+		job->state = JOB_READY;
+		o->jobsReady++;
+		pthread_cond_broadcast(&o->cond);
+		pthread_mutex_unlock(&o->lock);
+	}
+
+	o->iovCnt = 0;
+	outputWriteback(o, o->batchOffset, o->batchLen);
+	o->batchLen = 0;
+	o->stageLen = 0;
+}
+
+/*
+ * Write out everything queued and wait for it, the buffers passed to
+ * outputBuffer() can be reused after this.
+ */
+static inline void outputFlush(struct Output *o)
+{
+	outputSubmit(o);
+	outputWait(o);
+}
+
+static inline void outputQueueIov(struct Output *o, uint64_t virtOffset, const void *ptr, uint64_t len)
+{
+	if( o->iovCnt )
+	{
+		struct iovec *last = &o->iov[o->iovCnt - 1];
+		const bool contiguous = o->batchOffset + o->batchLen == virtOffset;
+		const bool fits = o->batchLen + len <= o->maxBatch;
+
+		// the source is contiguous too, just extend the last iovec
+		if( contiguous && fits && ptr != outputZeroes && last->iov_base + last->iov_len == ptr )
+		{
+			last->iov_len += len;
+			o->batchLen += len;
+			return;
+		}
+
+		if( !contiguous || !fits || o->iovCnt == o->maxIov )
+			outputSubmit(o);
+	}
+
+	if( !o->iovCnt )
+		o->batchOffset = virtOffset;
+
+	o->iov[o->iovCnt].iov_base = (void *)ptr;
+	o->iov[o->iovCnt].iov_len = len;
+	o->iovCnt++;
+	o->batchLen += len;
+}
+
+/*
+ * Copy a run that isn't aligned in memory to the staging buffer and queue
+ * it from there. The batch is sent first if the run doesn't continue it,
+ * so queueing never sends the staging buffer before it's filled.
+ */
+static inline void outputStage(struct Output *o, uint64_t virtOffset, const uint8_t *ptr, uint64_t len)
+{
+	while( len )
+	{
+		uint64_t l = len < o->maxBatch ? len : o->maxBatch;
+		if( o->iovCnt && ( o->batchOffset + o->batchLen != virtOffset ||
+				o->batchLen + l > o->maxBatch || o->iovCnt == o->maxIov ) )
+			outputSubmit(o);
+
+		uint8_t *buf = o->stage + o->stageLen;
+		memcpy(buf, ptr, l);
+		o->stageLen += l;
+		o->staged += l;
+		outputQueueIov(o, virtOffset, buf, l);
+		virtOffset += l;
+		ptr += l;
+		len -= l;
+	}
+}
+
+static inline void outputQueue(struct Output *o, uint64_t virtOffset, const void *ptr, uint64_t len)
+{
+	if( o->stage && (uintptr_t)ptr % o->memAlign )
+		outputStage(o, virtOffset, ptr, len);
+	else
+		outputQueueIov(o, virtOffset, ptr, len);
+}
+
+static inline void outputShapeFlush(struct Output *o)
+{
+	if( !o->shapeLen )
+		return;
+
+	const struct iovec iov = { o->shapeBuf, o->shapeLen };
+	outputWriteJob(o, &iov, 1, o->shapeStart, o->shapeLen);
+	outputWriteback(o, o->shapeStart, o->shapeLen);
+	o->shapeLen = 0;
+}
+
+/*
+ * Put a piece of a run that doesn't fill its block in the shaping buffer,
+ * "ptr" NULL for zeroes. The piece must be within one block.
+ */
+static inline void outputShapePiece(struct Output *o, uint64_t virtOffset, const void *ptr, uint64_t len)
+{
+	const uint64_t blockStart = virtOffset - virtOffset % o->align;
+	const uint64_t blockEnd = blockStart + o->align;
+
+	if( o->shapeLen )
+	{
+		const uint64_t shapeEnd = o->shapeStart + o->shapeLen;
+		if( blockStart >= shapeEnd &&
+			( blockStart - shapeEnd > o->shapeGap || blockEnd - o->shapeStart > o->shapeMax ) )
+			outputShapeFlush(o);
+	}
+	if( !o->shapeLen )
+		o->shapeStart = blockStart;
+
+	// fill up to the end of the block with what's on the target, but not
+	// past the end of the disk; O_DIRECT needs the length rounded up to its
+	// alignment, outputClose() trims a file back
+	const uint64_t shapeEnd = o->shapeStart + o->shapeLen;
+	uint64_t fillEnd = blockEnd;
+	if( blockEnd > o->map.virtualSize && o->map.virtualSize >= virtOffset + len )
+	{
+		fillEnd = o->map.virtualSize;
+		if( o->stage && fillEnd % o->memAlign )
+		{
+			fillEnd += o->memAlign - fillEnd % o->memAlign;
+			if( fillEnd > blockEnd )
+				fillEnd = blockEnd;
+			o->shapePastEnd = true;
+		}
+	}
+	if( fillEnd > shapeEnd )
+	{
+		uint8_t *buf = o->shapeBuf + o->shapeLen;
+		const ssize_t res = pread(o->fd, buf, fillEnd - shapeEnd, shapeEnd);
+		if( res < 0 )
+		{
+			perror("pread");
+			exit(1);
+		}
+		memset(buf + res, 0, fillEnd - shapeEnd - res);
+		o->shapeLen = fillEnd - o->shapeStart;
+	}
+
+	if( ptr )
+		memcpy(o->shapeBuf + (virtOffset - o->shapeStart), ptr, len);
+	else
+		memset(o->shapeBuf + (virtOffset - o->shapeStart), 0, len);
+}
+
+/*
+ * A run for a raw target, "ptr" NULL for zeroes.
+ */
+static inline void outputRaw(struct Output *o, uint64_t virtOffset, const void *ptr, uint64_t len)
+{
+	// the unaligned head goes through the shaping buffer
+	if( o->align && virtOffset % o->align )
+	{
+		uint64_t l = o->align - virtOffset % o->align;
+		if( l > len )
+			l = len;
+		outputShapePiece(o, virtOffset, ptr, l);
+		virtOffset += l;
+		len -= l;
+		if( ptr )
+			ptr += l;
+	}
+
+	// whole blocks are written as they are, the tail is shaped again
+	const uint64_t tail = o->align ? len % o->align : 0;
+	uint64_t body = len - tail;
+	if( body && o->shapeLen )
+		outputShapeFlush(o);
+	while( body )
+	{
+		uint64_t l = body < o->maxBatch ? body : o->maxBatch;
+		if( !ptr && l > OUTPUT_ZERO_SIZE )
+			l = OUTPUT_ZERO_SIZE;
+		outputQueue(o, virtOffset, ptr ? ptr : outputZeroes, l);
+		virtOffset += l;
+		body -= l;
+		if( ptr )
+			ptr += l;
+	}
+
+	if( tail )
+		outputShapePiece(o, virtOffset, ptr, tail);
+}
+
+/*
+ * Clone or copy in the kernel an extent that covers whole target blocks,
+ * false if it has to go through the normal path.
+ */
+static inline bool outputOffload(struct Output *o, uint64_t virtOffset, uint64_t srcOffset, uint64_t len)
+{
+	const uint64_t align = o->physicalBlock;
+	if( o->srcFd == -1 || !o->offload || len < OUTPUT_OFFLOAD_MIN || virtOffset % align || len % align )
+		return false;
+
+	// the neighbouring blocks may be in the shaping buffer
+	outputShapeFlush(o);
+
+	if( !o->noClone && srcOffset % align == 0 )
+	{
+		struct file_clone_range range = { o->srcFd, srcOffset, len, virtOffset };
+		if( ioctl(o->fd, FICLONERANGE, &range) == 0 )
+		{
+			o->cloned += len;
+			return true;
+		}
+		// EINVAL is an extent not aligned to the file system block
+		if( errno != EINVAL )
+			o->noClone = true;
+	}
+
+	while( len )
+	{
+		loff_t in = srcOffset, out = virtOffset;
+		const ssize_t res = copy_file_range(o->srcFd, &in, o->fd, &out, len, 0);
+		if( res <= 0 )
+		{
+			if( res < 0 && errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL && errno != ENOSYS )
+			{
+				perror("copy_file_range");
+				exit(1);
+			}
+			// not between these files, the rest goes the normal way
+			o->offload = false;
+			return false;
+		}
+		outputWriteback(o, virtOffset, res);
+		o->offloaded += res;
+		virtOffset += res;
+		srcOffset += res;
+		len -= res;
+	}
+	return true;
+}
+
+/*
+ * A run of the source image for a raw target.
+ */
+static inline void outputRawData(struct Output *o, uint64_t virtOffset, uint64_t srcOffset, uint64_t len)
+{
+	if( outputOffload(o, virtOffset, srcOffset, len) )
+		return;
+	outputRaw(o, virtOffset, o->src + srcOffset, len);
+}
+
+/*
+ * Allocate a run of the target file ahead of its writes.
+ */
+static inline void outputPreallocRun(struct Output *o, uint64_t offset, uint64_t len)
+{
+	if( !len || !o->prealloc )
+		return;
+	if( fallocate(o->fd, 0, offset, len) != 0 )
+	{
+		if( errno != EOPNOTSUPP && errno != ENOSYS )
+		{
+			perror("fallocate");
+			exit(1);
+		}
+		o->prealloc = false;
+		if( o->explain )
+			fprintf(stderr, "preallocation off (not supported by the file system)\n");
+		return;
+	}
+	o->preallocated += len;
+	o->preallocRuns++;
+}
+
+/*
+ * Allocate the extents of "map" in the target, in their order and one
+ * call for each run of them; gaps under OUTPUT_PREALLOC_GAP are allocated
+ * with the run and read as zeroes. Zero extents only with "zeroes". A
+ * converter that has its map before it writes calls this, its writes are
+ * not held back then.
+ */
+static inline void outputPreallocate(struct Output *o, const struct ExtentMap *map, bool zeroes)
+{
+	o->deferred = false;
+	uint64_t start = 0, end = 0;
+	for(uint64_t i = 0; i < map->count && o->prealloc; i++)
+	{
+		const struct Extent *e = &map->ext[i];
+		if( ( e->fileOffset == EXTENT_ZERO && !zeroes ) || e->virtOffset >= o->map.virtualSize )
+			continue;
+		const uint64_t eEnd = e->virtOffset + e->length < o->map.virtualSize ? e->virtOffset + e->length : o->map.virtualSize;
+		if( end > start && e->virtOffset >= end && e->virtOffset - end < OUTPUT_PREALLOC_GAP )
+		{
+			end = eEnd;
+			continue;
+		}
+		outputPreallocRun(o, start, end - start);
+		start = e->virtOffset;
+		end = eEnd;
+	}
+	outputPreallocRun(o, start, end - start);
+}
+
+static inline void outputData(struct Output *o, uint64_t virtOffset, uint64_t srcOffset, uint64_t len);
+static inline void outputZero(struct Output *o, uint64_t virtOffset, uint64_t len);
+
+/*
+ * Allocate what was held back and write it.
+ */
+static inline void outputReplay(struct Output *o)
+{
+	outputPreallocate(o, &o->map, true);
+	for(uint64_t i = 0; i < o->map.count; i++)
+	{
+		const struct Extent *e = &o->map.ext[i];
+		if( e->fileOffset == EXTENT_ZERO )
+			outputZero(o, e->virtOffset, e->length);
+		else
+			outputData(o, e->virtOffset, e->fileOffset, e->length);
+	}
+	o->map.count = 0;
+	o->deferred = true;
+}
+
+/*
+ * FNV-1a over 64-bit words, with a shift so the high bits reach the low
+ * ones. It only has to tell a block that changed.
+ */
+static inline uint64_t outputHash(uint64_t h, const void *ptr, uint64_t len)
+{
+	const uint8_t *p = ptr;
+	for(; len >= 8; p += 8, len -= 8)
+	{
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+	for(; len; p++, len--)
+		h = (h ^ *p) * 0x100000001b3ull;
+	return h;
+}
+
+static inline uint64_t outputHashPair(uint64_t h, uint64_t a, uint64_t b)
+{
+	const uint64_t v[2] = { a, b };
+	return outputHash(h, v, sizeof(v));
+}
+
+/*
+ * The state of the last run, or nothing if there is none: the whole layer
+ * is written then. Called at the first extent, when the converter has set
+ * the block size.
+ */
+static inline void outputResyncStart(struct Output *o)
+{
+	struct OutputResync *r = o->resync;
+	r->blockSize = o->map.blockSize ? o->map.blockSize : OUTPUT_RESYNC_BLOCK;
+	r->blocks = (o->map.virtualSize + r->blockSize - 1) / r->blockSize;
+	r->old = calloc(r->blocks + 1, sizeof(*r->old));
+	r->cur = calloc(r->blocks + 1, sizeof(*r->cur));
+	if( !r->old || !r->cur )
+	{
+		perror("calloc");
+		exit(1);
+	}
+
+	FILE *f = fopen(r->path, "r");
+	if( !f )
+	{
+		if( errno != ENOENT )
+		{
+			perror(r->path);
+			exit(1);
+		}
+		fprintf(stderr, "no resync state in %s, the whole layer is written\n", r->path);
+		return;
+	}
+	struct OutputResyncHeader hdr;
+	if( fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, OUTPUT_RESYNC_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.virtualSize != o->map.virtualSize || hdr.blockSize != r->blockSize || hdr.blocks != r->blocks )
+		fprintf(stderr, "%s is not the resync state of this image, the whole layer is written\n", r->path);
+	else if( fread(r->old, sizeof(*r->old), r->blocks, f) != r->blocks )
+	{
+		fprintf(stderr, "%s is truncated, the whole layer is written\n", r->path);
+		memset(r->old, 0, r->blocks * sizeof(*r->old));
+	}
+	fclose(f);
+}
+
+static inline void outputResyncSave(struct Output *o)
+{
+	const struct OutputResync *r = o->resync;
+	char tmp[PATH_MAX + 16];
+	snprintf(tmp, sizeof(tmp), "%s.%d", r->path, (int)getpid());
+	FILE *f = fopen(tmp, "w");
+	if( !f )
+	{
+		perror(tmp);
+		exit(1);
+	}
+	const struct OutputResyncHeader hdr = { OUTPUT_RESYNC_MAGIC, o->map.virtualSize, r->blockSize, r->blocks };
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+		fwrite(r->cur, sizeof(*r->cur), r->blocks, f) == r->blocks;
+	ok = fclose(f) == 0 && ok;
+	if( !ok || rename(tmp, r->path) != 0 )
+	{
+		perror(r->path);
+		unlink(tmp);
+		exit(1);
+	}
+}
+
+/*
+ * Parts of the image that were written to the target are gone from it, so
+ * the target has what the layer had there instead of what is below it.
+ * The state is kept, so that runs again fail the same way.
+ */
+static inline void outputResyncLost(struct Output *o, uint64_t block)
+{
+	fprintf(stderr, "the block at %" PRIu64 " lost parts since the last resync, the chain has to be "
+		"converted again into an empty target\n", block * o->resync->blockSize);
+	exit(1);
+}
+
+/*
+ * The block collected is complete: skip it if it's as the last run left
+ * it, write it otherwise.
+ */
+static inline void outputResyncBlockEnd(struct Output *o)
+{
+	struct OutputResync *r = o->resync;
+	const uint64_t blockStart = r->block * r->blockSize;
+
+	// parts next to each other count as one, however the image splits them
+	struct OutputResyncBlock b = { 0xcbf29ce484222325ull, 0xcbf29ce484222325ull, 0 };
+	uint64_t start = 0, end = 0, zeroes = 0;
+	for(unsigned i = 0; i < r->piecesCount; i++)
+	{
+		const struct OutputResyncPiece *p = &r->pieces[i];
+		if( p->virtOffset != end )
+		{
+			if( end )
+				b.coverage = outputHashPair(b.coverage, start - blockStart, end - start);
+			start = p->virtOffset;
+		}
+		end = p->virtOffset + p->len;
+		b.covered += p->len;
+
+		if( p->srcOffset == EXTENT_ZERO )
+			zeroes += p->len;
+		else
+		{
+			if( zeroes )
+				b.data = outputHashPair(b.data, EXTENT_ZERO, zeroes);
+			zeroes = 0;
+			b.data = outputHash(b.data, o->src + p->srcOffset, p->len);
+		}
+	}
+	b.coverage = outputHashPair(b.coverage, start - blockStart, end - start);
+	if( zeroes )
+		b.data = outputHashPair(b.data, EXTENT_ZERO, zeroes);
+
+	const struct OutputResyncBlock *old = &r->old[r->block];
+	r->cur[r->block] = b;
+	if( b.covered == old->covered && b.coverage == old->coverage && b.data == old->data )
+		r->skipped += b.covered;
+	else
+	{
+		// the image only gains parts, so other parts and no more of them
+		// mean some were dropped
+		if( old->covered && b.coverage != old->coverage && b.covered <= old->covered )
+			outputResyncLost(o, r->block);
+
+		for(unsigned i = 0; i < r->piecesCount; i++)
+		{
+			const struct OutputResyncPiece *p = &r->pieces[i];
+			if( p->srcOffset == EXTENT_ZERO )
+				outputRaw(o, p->virtOffset, NULL, p->len);
+			else
+				outputRawData(o, p->virtOffset, p->srcOffset, p->len);
+		}
+		r->rewritten += b.covered;
+	}
+	r->piecesCount = 0;
+}
+
+/*
+ * Collect an extent into its block, "srcOffset" EXTENT_ZERO for zeroes.
+ */
+static inline void outputResyncAdd(struct Output *o, uint64_t virtOffset, uint64_t srcOffset, uint64_t len)
+{
+	struct OutputResync *r = o->resync;
+	if( !r->cur )
+		outputResyncStart(o);
+
+	while( len )
+	{
+		const uint64_t block = virtOffset / r->blockSize;
+		if( block >= r->blocks || virtOffset < r->end )
+		{
+			fprintf(stderr, "extent at %" PRIu64 " is out of order, --resync can't be used with this image\n", virtOffset);
+			exit(1);
+		}
+		if( block != r->block )
+		{
+			if( r->piecesCount )
+				outputResyncBlockEnd(o);
+			r->block = block;
+		}
+
+		if( r->piecesCount == r->piecesAlloc )
+		{
+			r->piecesAlloc = r->piecesAlloc ? r->piecesAlloc * 2 : 64;
+			r->pieces = realloc(r->pieces, r->piecesAlloc * sizeof(*r->pieces));
+			if( !r->pieces )
+			{
+				perror("realloc");
+				exit(1);
+			}
+		}
+		const uint64_t blockEnd = (block + 1) * r->blockSize;
+		const uint64_t l = len < blockEnd - virtOffset ? len : blockEnd - virtOffset;
+		r->pieces[r->piecesCount++] = (struct OutputResyncPiece){ virtOffset, l, srcOffset };
+
+		r->end = virtOffset + l;
+		virtOffset += l;
+		len -= l;
+		if( srcOffset != EXTENT_ZERO )
+			srcOffset += l;
+	}
+}
+
+/*
+ * Finish the last block and check that no block that was there before is
+ * gone.
+ */
+static inline void outputResyncFinish(struct Output *o)
+{
+	struct OutputResync *r = o->resync;
+	if( !r->cur )
+		outputResyncStart(o);
+	if( r->piecesCount )
+		outputResyncBlockEnd(o);
+	for(uint64_t i = 0; i < r->blocks; i++)
+		if( r->old[i].covered && !r->cur[i].covered )
+			outputResyncLost(o, i);
+}
+
+static inline void outputData(struct Output *o, uint64_t virtOffset, uint64_t srcOffset, uint64_t len)
+{
+	if( srcOffset + len > o->srcSize )
+	{
+		fprintf(stderr, "extent at %" PRIu64 " is beyond the end of the image\n", srcOffset);
+		exit(1);
+	}
+
+	if( o->mapping || o->deferred )
+	{
+		const struct Extent e = { virtOffset, len, srcOffset, 0, 0 };
+		extentMapAppend(&o->map, &e);
+		return;
+	}
+
+	if( o->qcow2 )
+	{
+		qcow2WriterData(o->qcow2, virtOffset, o->src + srcOffset, len);
+		return;
+	}
+
+	if( o->resync )
+		outputResyncAdd(o, virtOffset, srcOffset, len);
+	else
+		outputRawData(o, virtOffset, srcOffset, len);
+}
+
+/*
+ * Data that isn't stored as-is in the source image, e.g. inflated. "ptr"
+ * must stay valid until the next outputFlush().
+ */
+static inline void outputBuffer(struct Output *o, uint64_t virtOffset, const void *ptr, uint64_t len)
+{
+	if( o->mapping )
+	{
+		if( o->mapPath || o->jsonPath )
+		{
+			fprintf(stderr, "extent at %" PRIu64 " is not stored as-is in the image, it can't be mapped\n", virtOffset);
+			exit(1);
+		}
+		// counted only, "ptr" may be NULL
+		const struct Extent e = { virtOffset, len, virtOffset, 0, EXTENT_FLAG_BUFFERED };
+		extentMapAppend(&o->map, &e);
+		return;
+	}
+
+	if( o->qcow2 )
+	{
+		qcow2WriterData(o->qcow2, virtOffset, ptr, len);
+		return;
+	}
+
+	if( o->resync )
+	{
+		fprintf(stderr, "extent at %" PRIu64 " is not stored as-is in the image, --resync can't be used with it\n", virtOffset);
+		exit(1);
+	}
+	if( o->deferred )
+	{
+		// "ptr" isn't kept to the end, what was held back goes first
+		outputReplay(o);
+		outputPreallocRun(o, virtOffset, len);
+	}
+	outputRaw(o, virtOffset, ptr, len);
+}
+
+static inline void outputZero(struct Output *o, uint64_t virtOffset, uint64_t len)
+{
+	if( o->mapping || o->deferred )
+	{
+		const struct Extent e = { virtOffset, len, EXTENT_ZERO, 0, 0 };
+		extentMapAppend(&o->map, &e);
+		return;
+	}
+
+	if( o->qcow2 )
+	{
+		qcow2WriterData(o->qcow2, virtOffset, NULL, len);
+		return;
+	}
+
+	if( o->resync )
+		outputResyncAdd(o, virtOffset, EXTENT_ZERO, len);
+	else
+		outputRaw(o, virtOffset, NULL, len);
+}
+
+static inline void outputClose(struct Output *o)
+{
+	if( o->mapping )
+	{
+		struct ExtentCensus c;
+		extentMapCensus(&o->map, &c);
+		if( o->mapPath )
+			extentMapSave(&o->map, o->mapPath);
+		if( o->jsonPath )
+			extentMapSaveJson(&o->map, &c, o->jsonPath);
+		if( o->dryRun )
+			fprintf(stderr, "dry run: %" PRIu64 " MiB allocated (%" PRIu64 " MiB in partly present blocks), "
+				"%" PRIu64 " MiB zero, %" PRIu64 " MiB unallocated, %" PRIu64 " extents, %.2f s\n",
+				c.data >> 20, c.partial >> 20, c.zero >> 20, c.unallocated >> 20, c.extents,
+				targetNow() - o->mapStart);
+		extentMapFree(&o->map);
+		return;
+	}
+
+	if( o->qcow2 )
+	{
+		qcow2WriterClose(o->qcow2);
+		o->qcow2 = NULL;
+		return;
+	}
+
+	if( o->deferred )
+		outputReplay(o);
+	if( o->resync )
+		outputResyncFinish(o);
+	outputFlush(o);
+	outputShapeFlush(o);
+	free(o->shapeBuf);
+	if( o->depth > 1 )
+	{
+		pthread_mutex_lock(&o->lock);
+		o->stopping = true;
+		pthread_cond_broadcast(&o->cond);
+		pthread_mutex_unlock(&o->lock);
+		for(unsigned i = 0; i < o->depth; i++)
+		{
+			pthread_join(o->writers[i], NULL);
+			if( o->jobs[i].stage )
+				munmap(o->jobs[i].stage, o->stageSize);
+		}
+		free(o->writers);
+		free(o->jobs);
+	}
+	if( o->stage )
+		munmap(o->stage, o->stageSize);
+	struct stat st;
+	if( o->shapePastEnd && fstat(o->fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size > o->map.virtualSize &&
+		ftruncate(o->fd, o->map.virtualSize) != 0 )
+	{
+		perror("ftruncate");
+		exit(1);
+	}
+	if( fdatasync(o->fd) != 0 )
+	{
+		perror("fdatasync");
+		exit(1);
+	}
+	close(o->fd);
+	if( o->resync )
+	{
+		struct OutputResync *r = o->resync;
+		outputResyncSave(o);
+		fprintf(stderr, "resync: %" PRIu64 " MiB written, %" PRIu64 " MiB unchanged\n",
+			r->rewritten >> 20, r->skipped >> 20);
+		free(r->old);
+		free(r->cur);
+		free(r->pieces);
+		free(r);
+		o->resync = NULL;
+	}
+	if( o->cloned || o->offloaded )
+		fprintf(stderr, "%" PRIu64 " MiB cloned, %" PRIu64 " MiB copied by the kernel\n", o->cloned >> 20, o->offloaded >> 20);
+	if( o->preallocated && o->explain )
+		fprintf(stderr, "%" PRIu64 " MiB preallocated in %" PRIu64 " runs\n", o->preallocated >> 20, o->preallocRuns);
+	if( o->staged && o->explain )
+		fprintf(stderr, "%" PRIu64 " KiB staged for O_DIRECT\n", o->staged >> 10);
+	extentMapFree(&o->map);
+}
+
+#endif
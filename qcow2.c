@@ -0,0 +1,418 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+compile:
+
+gcc -std=c99 -Wall -Werror -pthread -o qcow2 qcow2.c -lz
+
+with zstd compressed images and qcow2 output (-O qcow2 -c):
+
+gcc -std=c99 -Wall -Werror -pthread -o qcow2 qcow2.c -lz -DHAVE_ZSTD -lzstd
+*/
+
+/*
+ * qcow2 source images, one layer at a time like vhdx: what isn't allocated
+ * in this image is left to the parent (the backing file), converted
+ * before it.
+ *
+ * Compressed clusters are collected in batches in virtual order and each
+ * batch is decoded by a set of threads while the previous one is written.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <endian.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "output.h"
+#include "batch.h"
+
+#define BATCH_SIZE		(32 * 1024 * 1024)
+#define SUBCLUSTERS		32
+
+enum
+{
+	RUN_DATA,
+	RUN_ZERO,
+	RUN_COMPRESSED,
+};
+
+// a run of the image in virtual order, compressed ones are one cluster
+struct Run
+{
+	uint64_t		virtOffset;
+	uint64_t		hostOffset;
+	uint64_t		csize;
+	uint32_t		len;
+	uint8_t			type;
+};
+
+static const uint8_t *image;
+static uint64_t imageSize;
+static uint64_t clusterSize;
+static uint8_t compressionType;
+static unsigned threadsCount;
+static bool dryRun;
+
+static void decodeZlib(const struct Run *c, uint8_t *dst)
+{
+	z_stream zs = {};
+	zs.next_in = (Bytef *)image + c->hostOffset;
+	zs.avail_in = c->csize;
+	zs.next_out = dst;
+	zs.avail_out = clusterSize;
+
+	// raw deflate, the data may be followed by the rest of its last sector
+	if( inflateInit2(&zs, -12) != Z_OK )
+	{
+		fprintf(stderr, "inflateInit2 failed\n");
+		exit(1);
+	}
+	const int res = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	if( ( res != Z_STREAM_END && res != Z_BUF_ERROR ) || zs.avail_out )
+	{
+		fprintf(stderr, "cluster at %" PRIu64 ": inflate failed (%d)\n", c->hostOffset, res);
+		exit(1);
+	}
+}
+
+static void decodeZstd(const struct Run *c, uint8_t *dst)
+{
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *ds = ZSTD_createDStream();
+	ZSTD_inBuffer in = { image + c->hostOffset, c->csize, 0 };
+	ZSTD_outBuffer out = { dst, clusterSize, 0 };
+	while( out.pos < clusterSize && in.pos < in.size )
+	{
+		const size_t res = ZSTD_decompressStream(ds, &out, &in);
+		if( ZSTD_isError(res) || res == 0 )
+			break;
+	}
+	ZSTD_freeDStream(ds);
+	if( out.pos != clusterSize )
+	{
+		fprintf(stderr, "cluster at %" PRIu64 ": zstd decompression failed\n", c->hostOffset);
+		exit(1);
+	}
+#else
+	fprintf(stderr, "built without zstd, can't read zstd compressed clusters\n");
+	exit(1);
+#endif
+}
+
+static void decodeRun(const void *item, uint8_t *dst)
+{
+	const struct Run *r = item;
+	// a dry run only counts the compressed clusters
+	if( r->type != RUN_COMPRESSED || dryRun )
+		return;
+
+	if( compressionType == QCOW2_COMPRESSION_ZSTD )
+		decodeZstd(r, dst);
+	else
+		decodeZlib(r, dst);
+}
+
+static void writeRun(struct Output *out, const void *item, const uint8_t *data)
+{
+	const struct Run *r = item;
+	if( r->type == RUN_COMPRESSED )
+		outputBuffer(out, r->virtOffset, data, r->len);
+	else if( r->type == RUN_ZERO )
+		outputZero(out, r->virtOffset, r->len);
+	else
+		outputData(out, r->virtOffset, r->hostOffset, r->len);
+}
+
+static struct BatchPipeline pipeline;
+
+static void runAdd(uint8_t type, uint64_t virtOffset, uint64_t hostOffset, uint64_t csize, uint32_t len)
+{
+	const struct Run r = { virtOffset, hostOffset, csize, len, type };
+	batchAdd(&pipeline, &r);
+}
+
+int main(int argc, char *argv[])
+{
+	struct OutputOptions outOpts = {};
+	threadsCount = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while( (opt = getopt_long(argc, argv, OUTPUT_OPTIONS "j:", outputLongOptions, NULL)) != -1 )
+	{
+		if( opt == 'j' )
+			threadsCount = atoi(optarg);
+		else if( !outputOption(&outOpts, opt, optarg) )
+			goto usage;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if( ( argc != 2 && argc != 3 ) || !threadsCount )
+	{
+usage:
+		fprintf(stderr, "usage: %s: [-j threads] " OUTPUT_USAGE " file.qcow2 [output.raw|output.qcow2]\n", argv[0]);
+		exit(1);
+	}
+
+	const int fd = open(argv[1], O_RDONLY);
+	if( fd == -1 )
+	{
+		perror("open");
+		exit(1);
+	}
+
+	imageSize = lseek(fd, 0, SEEK_END);
+	image = mmap(NULL, imageSize, PROT_READ, MAP_SHARED, fd, 0);
+	if( imageSize < 512 || image == MAP_FAILED )
+	{
+		fprintf(stderr, "%s: not a qcow2 image\n", argv[1]);
+		exit(1);
+	}
+
+	const struct Qcow2Header *hdr = (const void *)image;
+	if( be32toh(hdr->magic) != QCOW2_MAGIC )
+	{
+		fprintf(stderr, "invalid magic\n");
+		exit(1);
+	}
+
+	const uint32_t version = be32toh(hdr->version);
+	if( version != 2 && version != 3 )
+	{
+		fprintf(stderr, "unsupported version %u\n", version);
+		exit(1);
+	}
+
+	const uint32_t clusterBits = be32toh(hdr->clusterBits);
+	const uint64_t virtualSize = be64toh(hdr->size);
+	const uint64_t incompat = version >= 3 ? be64toh(hdr->incompatibleFeatures) : 0;
+	const uint32_t headerLength = version >= 3 ? be32toh(hdr->headerLength) : 72;
+	if( headerLength > offsetof(struct Qcow2Header, compressionType) )
+		compressionType = hdr->compressionType;
+
+	if( clusterBits < 9 || clusterBits > 21 )
+	{
+		fprintf(stderr, "unsupported cluster size 2^%u\n", clusterBits);
+		exit(1);
+	}
+	if( hdr->cryptMethod )
+	{
+		fprintf(stderr, "encrypted images are not supported\n");
+		exit(1);
+	}
+	if( incompat & QCOW2_INCOMPAT_DIRTY )
+		fprintf(stderr, "warning: the image was not closed cleanly, the refcounts may be off but the data is fine\n");
+	if( incompat & QCOW2_INCOMPAT_DATA_FILE )
+	{
+		fprintf(stderr, "images with an external data file are not supported\n");
+		exit(1);
+	}
+	if( incompat & ~(QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_COMPRESSION | QCOW2_INCOMPAT_EXTL2) )
+	{
+		fprintf(stderr, "unsupported incompatible features %" PRIx64 "\n", incompat);
+		exit(1);
+	}
+	if( compressionType != QCOW2_COMPRESSION_ZLIB && compressionType != QCOW2_COMPRESSION_ZSTD )
+	{
+		fprintf(stderr, "unsupported compression type %u\n", compressionType);
+		exit(1);
+	}
+
+	clusterSize = 1ull << clusterBits;
+	const bool extL2 = incompat & QCOW2_INCOMPAT_EXTL2;
+	const unsigned l2EntrySize = extL2 ? 16 : 8;
+	const uint64_t l2Entries = clusterSize / l2EntrySize;
+	const uint64_t subclusterSize = clusterSize / SUBCLUSTERS;
+	const unsigned csizeShift = 62 - (clusterBits - 8);
+	const uint64_t csizeMask = (1ull << (clusterBits - 8)) - 1;
+
+	// backing file and its format from the header extensions
+	char *backing = NULL, *backingFormat = NULL;
+	const uint64_t backingOffset = be64toh(hdr->backingFileOffset);
+	const uint32_t backingSize = be32toh(hdr->backingFileSize);
+	if( backingOffset && backingSize && backingOffset + backingSize <= imageSize )
+		backing = strndup((const char *)image + backingOffset, backingSize);
+	for(uint64_t ext = headerLength; version >= 3 && ext + 8 <= clusterSize && ext + 8 <= imageSize; )
+	{
+		const uint32_t type = be32toh(*(const uint32_t *)(image + ext));
+		const uint32_t len = be32toh(*(const uint32_t *)(image + ext + 4));
+		if( type == QCOW2_EXT_END || ext + 8 + len > imageSize )
+			break;
+		if( type == QCOW2_EXT_BACKING_FORMAT )
+			backingFormat = strndup((const char *)image + ext + 8, len);
+		ext += 8 + (len + 7ull) / 8 * 8;
+	}
+	const bool hasParent = backing != NULL;
+
+	if( argc == 2 && !outputMapOnly(&outOpts) )
+	{
+		printf("virtualSize=%" PRIu64 "\n", virtualSize);
+		printf("clusterSize=%" PRIu64 "\n", clusterSize);
+		if( extL2 )
+			printf("extendedL2=1\n");
+		if( hasParent )
+		{
+			printf("parentPath=%s\n", backing);
+			if( backingFormat )
+				printf("parentFormat=%s\n", backingFormat);
+		}
+		exit(0);
+	}
+
+	const uint32_t l1Size = be32toh(hdr->l1Size);
+	const uint64_t l1Offset = be64toh(hdr->l1TableOffset);
+	if( l1Offset + l1Size * 8ull > imageSize || l1Size < (virtualSize + l2Entries * clusterSize - 1) / (l2Entries * clusterSize) )
+	{
+		fprintf(stderr, "invalid L1 table\n");
+		exit(1);
+	}
+	const uint64_t *l1 = (const void *)(image + l1Offset);
+
+	struct Output out;
+	outputInit(&out, image, imageSize, virtualSize);
+	outputSourceFd(&out, fd);
+	outputOpenOptions(&out, &outOpts, argv[2], O_RDWR);
+	dryRun = outOpts.dryRun;
+
+	// two batches: one being decoded while the other is written
+	const unsigned batchRuns = clusterSize < BATCH_SIZE ? BATCH_SIZE / clusterSize : 1;
+	batchInit(&pipeline, &out, sizeof(struct Run), batchRuns, clusterSize, threadsCount, decodeRun, writeRun);
+	uint64_t dataClusters = 0, compressedClusters = 0, zeroClusters = 0;
+
+	for(uint64_t i = 0; i < l1Size; i++)
+	{
+		const uint64_t l2Offset = be64toh(l1[i]) & QCOW2_OFFSET_MASK;
+		if( !l2Offset )
+			continue;
+		if( l2Offset + clusterSize > imageSize )
+		{
+			fprintf(stderr, "L2 table %" PRIu64 " is beyond the end of the image\n", i);
+			exit(1);
+		}
+		const uint8_t *l2 = image + l2Offset;
+
+		for(uint64_t j = 0; j < l2Entries; j++)
+		{
+			const uint64_t virtOffset = (i * l2Entries + j) * clusterSize;
+			if( virtOffset >= virtualSize )
+				break;
+			const uint32_t len = virtualSize - virtOffset < clusterSize ? virtualSize - virtOffset : clusterSize;
+
+			const uint64_t entry = be64toh(*(const uint64_t *)(l2 + j * l2EntrySize));
+			const uint64_t bitmap = extL2 ? be64toh(*(const uint64_t *)(l2 + j * l2EntrySize + 8)) : 0;
+			const uint64_t hostOffset = entry & QCOW2_OFFSET_MASK;
+
+			if( entry & QCOW2_OFLAG_COMPRESSED )
+			{
+				if( outOpts.mapPath || outOpts.jsonPath )
+				{
+					fprintf(stderr, "the image has compressed clusters, an extent map of it can't be made\n");
+					exit(1);
+				}
+
+				const uint64_t cOffset = entry & ((1ull << csizeShift) - 1);
+				uint64_t csize = ( ( (entry >> csizeShift) & csizeMask ) + 1 ) * 512 - ( cOffset & 511 );
+				if( cOffset >= imageSize )
+				{
+					fprintf(stderr, "compressed cluster at %" PRIu64 " is beyond the end of the image\n", cOffset);
+					exit(1);
+				}
+				if( cOffset + csize > imageSize )
+					csize = imageSize - cOffset;
+
+				compressedClusters++;
+				runAdd(RUN_COMPRESSED, virtOffset, cOffset, csize, len);
+			}
+			else if( !extL2 )
+			{
+				if( version >= 3 && ( entry & QCOW2_OFLAG_ZERO ) )
+				{
+					zeroClusters++;
+					if( hasParent )
+						runAdd(RUN_ZERO, virtOffset, 0, 0, len);
+				}
+				else if( hostOffset )
+				{
+					dataClusters++;
+					runAdd(RUN_DATA, virtOffset, hostOffset, 0, len);
+				}
+			}
+			else
+			{
+				// extended L2: bit n allocated, bit 32 + n reads as zeroes
+				for(unsigned sc = 0; sc < SUBCLUSTERS; sc++)
+				{
+					const uint64_t scOffset = sc * subclusterSize;
+					if( scOffset >= len )
+						break;
+					const uint32_t scLen = len - scOffset < subclusterSize ? len - scOffset : subclusterSize;
+
+					if( bitmap & (1ull << (32 + sc)) )
+					{
+						if( hasParent )
+							runAdd(RUN_ZERO, virtOffset + scOffset, 0, 0, scLen);
+					}
+					else if( bitmap & (1ull << sc) )
+					{
+						if( !hostOffset )
+						{
+							fprintf(stderr, "allocated subcluster without a host cluster at %" PRIu64 "\n", virtOffset);
+							exit(1);
+						}
+						runAdd(RUN_DATA, virtOffset + scOffset, hostOffset + scOffset, 0, scLen);
+					}
+				}
+				if( bitmap & 0xffffffffull )
+					dataClusters++;
+				else if( bitmap )
+					zeroClusters++;
+			}
+		}
+	}
+
+	batchFinish(&pipeline);
+
+	printf("%" PRIu64 " data, %" PRIu64 " compressed, %" PRIu64 " zero clusters\n", dataClusters, compressedClusters, zeroClusters);
+	printf("syncing\n");
+	outputClose(&out);
+	printf("Done.\n");
+
+	return 0;
+}
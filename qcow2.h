@@ -0,0 +1,767 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * qcow2 output.
+ *
+ * The writer takes the extents in virtual order and appends the data
+ * clusters to the file in that order through a large write buffer. The L2
+ * tables, L1 table and refcounts are kept in memory and written after the
+ * data on close, the header last.
+ *
+ * A cluster only partly covered by the source is completed from the
+ * backing file, so converting a differencing image with a backing file
+ * gives the same disk as the source chain. The backing reader below
+ * handles raw files and uncompressed or zstd compressed qcow2.
+ *
+ * Build with -DHAVE_ZSTD -lzstd for compressed output.
+ */
+
+#ifndef QCOW2_H
+#define QCOW2_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stddef.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define QCOW2_MAGIC				0x514649fb
+#define QCOW2_CLUSTER_BITS		16
+#define QCOW2_CLUSTER_SIZE		(1u << QCOW2_CLUSTER_BITS)
+#define QCOW2_L2_ENTRIES		(QCOW2_CLUSTER_SIZE / 8)
+#define QCOW2_REFCOUNT_ORDER	4
+#define QCOW2_REFBLOCK_ENTRIES	(QCOW2_CLUSTER_SIZE / 2)
+#define QCOW2_WRITE_BUF			(8 * 1024 * 1024)
+
+#define QCOW2_OFLAG_COPIED		(1ull << 63)
+#define QCOW2_OFLAG_COMPRESSED	(1ull << 62)
+#define QCOW2_OFLAG_ZERO		(1ull << 0)
+#define QCOW2_OFFSET_MASK		0x00fffffffffffe00ull
+
+#define QCOW2_INCOMPAT_DIRTY		(1ull << 0)
+#define QCOW2_INCOMPAT_DATA_FILE	(1ull << 2)
+#define QCOW2_INCOMPAT_COMPRESSION	(1ull << 3)
+#define QCOW2_INCOMPAT_EXTL2		(1ull << 4)
+
+#define QCOW2_COMPRESSION_ZLIB	0
+#define QCOW2_COMPRESSION_ZSTD	1
+
+#define QCOW2_EXT_END			0
+#define QCOW2_EXT_BACKING_FORMAT	0xe2792aca
+
+struct Qcow2Header
+{
+	uint32_t		magic;
+	uint32_t		version;
+	uint64_t		backingFileOffset;
+	uint32_t		backingFileSize;
+	uint32_t		clusterBits;
+	uint64_t		size;
+	uint32_t		cryptMethod;
+	uint32_t		l1Size;
+	uint64_t		l1TableOffset;
+	uint64_t		refcountTableOffset;
+	uint32_t		refcountTableClusters;
+	uint32_t		nbSnapshots;
+	uint64_t		snapshotsOffset;
+	uint64_t		incompatibleFeatures;
+	uint64_t		compatibleFeatures;
+	uint64_t		autoclearFeatures;
+	uint32_t		refcountOrder;
+	uint32_t		headerLength;
+	uint8_t			compressionType;
+	uint8_t			padding[7];
+} __attribute__((packed));
+
+/*
+ * Backing file reader.
+ */
+struct Qcow2Image
+{
+	int				fd;
+	bool			raw;
+	uint64_t		size;
+	unsigned		clusterBits;
+	uint8_t			compressionType;
+	uint32_t		l1Size;
+	uint64_t		*l1;
+	struct Qcow2Image	*backing;
+
+	// last L2 table read
+	uint64_t		l2Offset;
+	uint64_t		*l2;
+
+	uint8_t			*cbuf;
+};
+
+static inline void qcow2Pread(int fd, void *buf, uint64_t len, uint64_t offset)
+{
+	while( len )
+	{
+		const ssize_t res = pread(fd, buf, len, offset);
+		if( res <= 0 )
+		{
+			if( res < 0 )
+				perror("pread");
+			else
+				fprintf(stderr, "qcow2: unexpected end of file\n");
+			exit(1);
+		}
+		buf += res;
+		offset += res;
+		len -= res;
+	}
+}
+
+static inline struct Qcow2Image *qcow2Open(const char *path)
+{
+	struct Qcow2Image *img = calloc(1, sizeof(*img));
+	img->fd = open(path, O_RDONLY);
+	if( img->fd == -1 )
+	{
+		perror(path);
+		exit(1);
+	}
+	img->l2Offset = -1ull;
+
+	struct Qcow2Header hdr = {};
+	if( pread(img->fd, &hdr, sizeof(hdr), 0) < 72 || be32toh(hdr.magic) != QCOW2_MAGIC )
+	{
+		img->raw = true;
+		img->size = lseek(img->fd, 0, SEEK_END);
+		return img;
+	}
+
+	const uint32_t version = be32toh(hdr.version);
+	const uint64_t incompat = version >= 3 ? be64toh(hdr.incompatibleFeatures) : 0;
+	img->clusterBits = be32toh(hdr.clusterBits);
+	img->size = be64toh(hdr.size);
+	if( version >= 3 && be32toh(hdr.headerLength) > offsetof(struct Qcow2Header, compressionType) )
+		img->compressionType = hdr.compressionType;
+
+	if( ( version != 2 && version != 3 ) || hdr.cryptMethod ||
+		( incompat & ~QCOW2_INCOMPAT_COMPRESSION ) ||
+		img->clusterBits < 9 || img->clusterBits > 21 )
+	{
+		fprintf(stderr, "%s: unsupported qcow2 backing file\n", path);
+		exit(1);
+	}
+
+	img->l1Size = be32toh(hdr.l1Size);
+	img->l1 = malloc(img->l1Size * 8ull + 1);
+	qcow2Pread(img->fd, img->l1, img->l1Size * 8ull, be64toh(hdr.l1TableOffset));
+	for(uint32_t i = 0; i < img->l1Size; i++)
+		img->l1[i] = be64toh(img->l1[i]);
+
+	img->l2 = malloc(1ull << img->clusterBits);
+	img->cbuf = malloc(2ull << img->clusterBits);
+
+	const uint64_t backingOffset = be64toh(hdr.backingFileOffset);
+	const uint32_t backingSize = be32toh(hdr.backingFileSize);
+	if( backingOffset && backingSize )
+	{
+		char name[PATH_MAX];
+		if( backingSize >= sizeof(name) )
+		{
+			fprintf(stderr, "%s: backing file name too long\n", path);
+			exit(1);
+		}
+		qcow2Pread(img->fd, name, backingSize, backingOffset);
+		name[backingSize] = 0;
+
+		// relative to the directory of this image
+		char full[PATH_MAX * 2];
+		const char *slash = strrchr(path, '/');
+		if( name[0] != '/' && slash )
+			snprintf(full, sizeof(full), "%.*s/%s", (int)(slash - path), path, name);
+		else
+			snprintf(full, sizeof(full), "%s", name);
+		img->backing = qcow2Open(full);
+	}
+
+	return img;
+}
+
+static inline void qcow2Read(struct Qcow2Image *img, uint64_t offset, void *buf, uint64_t len);
+
+static inline void qcow2ReadCluster(struct Qcow2Image *img, uint64_t offset, void *buf, uint64_t len)
+{
+	const uint64_t clusterSize = 1ull << img->clusterBits;
+	const uint64_t l2Entries = clusterSize / 8;
+	const uint64_t cluster = offset >> img->clusterBits;
+	const uint64_t inCluster = offset & (clusterSize - 1);
+
+	uint64_t entry = 0;
+	const uint64_t l1Index = cluster / l2Entries;
+	if( l1Index < img->l1Size && ( img->l1[l1Index] & QCOW2_OFFSET_MASK ) )
+	{
+		const uint64_t l2Offset = img->l1[l1Index] & QCOW2_OFFSET_MASK;
+		if( l2Offset != img->l2Offset )
+		{
+			qcow2Pread(img->fd, img->l2, clusterSize, l2Offset);
+			img->l2Offset = l2Offset;
+		}
+		entry = be64toh(img->l2[cluster % l2Entries]);
+	}
+
+	if( entry & QCOW2_OFLAG_COMPRESSED )
+	{
+		const unsigned csizeShift = 62 - (img->clusterBits - 8);
+		const uint64_t hostOffset = entry & ((1ull << csizeShift) - 1);
+		const uint64_t sectors = ( ( entry & ~QCOW2_OFLAG_COMPRESSED ) >> csizeShift ) + 1;
+		const uint64_t csize = sectors * 512 - ( hostOffset & 511 );
+
+		if( img->compressionType != QCOW2_COMPRESSION_ZSTD )
+		{
+			fprintf(stderr, "qcow2: only zstd compressed backing files are supported\n");
+			exit(1);
+		}
+#ifdef HAVE_ZSTD
+		uint8_t *in = malloc(csize);
+		const ssize_t got = pread(img->fd, in, csize, hostOffset);
+		if( got <= 0 )
+		{
+			perror("pread");
+			exit(1);
+		}
+
+		// the compressed data is followed by whatever fills the last sector
+		ZSTD_DStream *ds = ZSTD_createDStream();
+		ZSTD_inBuffer zin = { in, got, 0 };
+		ZSTD_outBuffer zout = { img->cbuf, clusterSize, 0 };
+		while( zout.pos < clusterSize )
+		{
+			const size_t res = ZSTD_decompressStream(ds, &zout, &zin);
+			if( ZSTD_isError(res) || ( res == 0 && zout.pos < clusterSize ) || zin.pos == zin.size )
+				break;
+		}
+		ZSTD_freeDStream(ds);
+		free(in);
+		if( zout.pos != clusterSize )
+		{
+			fprintf(stderr, "qcow2: corrupt compressed cluster\n");
+			exit(1);
+		}
+		memcpy(buf, img->cbuf + inCluster, len);
+#else
+		(void)csize;
+		fprintf(stderr, "qcow2: built without zstd\n");
+		exit(1);
+#endif
+	}
+	else if( entry & QCOW2_OFLAG_ZERO )
+		memset(buf, 0, len);
+	else if( entry & QCOW2_OFFSET_MASK )
+		qcow2Pread(img->fd, buf, len, ( entry & QCOW2_OFFSET_MASK ) + inCluster);
+	else if( img->backing )
+		qcow2Read(img->backing, offset, buf, len);
+	else
+		memset(buf, 0, len);
+}
+
+static inline void qcow2Read(struct Qcow2Image *img, uint64_t offset, void *buf, uint64_t len)
+{
+	// past the end of a (smaller) backing file reads zeroes
+	if( offset >= img->size )
+	{
+		memset(buf, 0, len);
+		return;
+	}
+	if( offset + len > img->size )
+	{
+		memset(buf + (img->size - offset), 0, offset + len - img->size);
+		len = img->size - offset;
+	}
+
+	if( img->raw )
+	{
+		qcow2Pread(img->fd, buf, len, offset);
+		return;
+	}
+
+	const uint64_t clusterSize = 1ull << img->clusterBits;
+	while( len )
+	{
+		uint64_t l = clusterSize - ( offset & (clusterSize - 1) );
+		if( l > len )
+			l = len;
+		qcow2ReadCluster(img, offset, buf, l);
+		offset += l;
+		buf += l;
+		len -= l;
+	}
+}
+
+/*
+ * Writer.
+ */
+struct Qcow2Writer
+{
+	int				fd;
+	const char		*path;
+	uint64_t		size;
+	bool			compress;
+	const char		*backingName;
+	struct Qcow2Image	*backing;
+
+	uint64_t		l1Size;
+	uint64_t		**l2;
+
+	uint16_t		*refcounts;		// per host cluster
+	uint64_t		refcountsAlloc;
+
+	// data goes out through this buffer, "hostEnd" is the next free byte
+	uint8_t			*wbuf;
+	uint64_t		wbufStart;
+	uint64_t		wbufLen;
+	uint64_t		hostEnd;
+
+	// the cluster being assembled, clusters before "next" are done
+	uint64_t		cur;
+	uint64_t		next;
+	uint8_t			*cbuf;
+	uint64_t		filled[QCOW2_CLUSTER_SIZE / 512 / 64];
+
+	uint8_t			*zbuf;
+	uint64_t		zbufSize;
+};
+
+static inline void qcow2WriterFlush(struct Qcow2Writer *w)
+{
+	uint64_t done = 0;
+	while( done < w->wbufLen )
+	{
+		const ssize_t res = pwrite(w->fd, w->wbuf + done, w->wbufLen - done, w->wbufStart + done);
+		if( res <= 0 )
+		{
+			perror("pwrite");
+			exit(1);
+		}
+		done += res;
+	}
+	w->wbufStart += w->wbufLen;
+	w->wbufLen = 0;
+}
+
+static inline void qcow2WriterAppend(struct Qcow2Writer *w, const void *data, uint64_t len)
+{
+	while( len )
+	{
+		uint64_t l = QCOW2_WRITE_BUF - w->wbufLen;
+		if( l > len )
+			l = len;
+		if( data )
+			memcpy(w->wbuf + w->wbufLen, data, l);
+		else
+			memset(w->wbuf + w->wbufLen, 0, l);
+		w->wbufLen += l;
+		w->hostEnd += l;
+		len -= l;
+		if( data )
+			data += l;
+		if( w->wbufLen == QCOW2_WRITE_BUF )
+			qcow2WriterFlush(w);
+	}
+}
+
+static inline void qcow2WriterRef(struct Qcow2Writer *w, uint64_t hostCluster)
+{
+	if( hostCluster >= w->refcountsAlloc )
+	{
+		uint64_t n = w->refcountsAlloc ? w->refcountsAlloc : 1024;
+		while( n <= hostCluster )
+			n *= 2;
+		w->refcounts = realloc(w->refcounts, n * sizeof(*w->refcounts));
+		if( !w->refcounts )
+		{
+			perror("realloc");
+			exit(1);
+		}
+		memset(w->refcounts + w->refcountsAlloc, 0, (n - w->refcountsAlloc) * sizeof(*w->refcounts));
+		w->refcountsAlloc = n;
+	}
+	w->refcounts[hostCluster]++;
+}
+
+static inline void qcow2WriterAlign(struct Qcow2Writer *w)
+{
+	if( w->hostEnd % QCOW2_CLUSTER_SIZE )
+		qcow2WriterAppend(w, NULL, QCOW2_CLUSTER_SIZE - w->hostEnd % QCOW2_CLUSTER_SIZE);
+}
+
+static inline void qcow2WriterSetL2(struct Qcow2Writer *w, uint64_t cluster, uint64_t entry)
+{
+	uint64_t **l2 = &w->l2[cluster / QCOW2_L2_ENTRIES];
+	if( !*l2 && !( *l2 = calloc(QCOW2_L2_ENTRIES, 8) ) )
+	{
+		perror("calloc");
+		exit(1);
+	}
+	(*l2)[cluster % QCOW2_L2_ENTRIES] = entry;
+}
+
+static inline struct Qcow2Writer *qcow2WriterOpen(const char *path, uint64_t size, const char *backingName, bool compress)
+{
+	struct Qcow2Writer *w = calloc(1, sizeof(*w));
+	w->path = path;
+	w->size = size;
+	w->compress = compress;
+	w->backingName = backingName;
+	w->cur = -1ull;
+
+#ifndef HAVE_ZSTD
+	if( compress )
+	{
+		fprintf(stderr, "built without zstd, compressed qcow2 output is not available\n");
+		exit(1);
+	}
+#else
+	w->zbufSize = ZSTD_compressBound(QCOW2_CLUSTER_SIZE);
+	w->zbuf = malloc(w->zbufSize);
+#endif
+
+	if( backingName )
+	{
+		w->backing = qcow2Open(backingName);
+		if( w->backing->size > size )
+		{
+			fprintf(stderr, "%s is larger than the image\n", backingName);
+			exit(1);
+		}
+	}
+
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if( w->fd == -1 )
+	{
+		perror(path);
+		exit(1);
+	}
+
+	const uint64_t clusters = (size + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+	w->l1Size = (clusters + QCOW2_L2_ENTRIES - 1) / QCOW2_L2_ENTRIES;
+	w->l2 = calloc(w->l1Size ? w->l1Size : 1, sizeof(*w->l2));
+	w->wbuf = malloc(QCOW2_WRITE_BUF);
+	w->cbuf = malloc(QCOW2_CLUSTER_SIZE);
+	if( !w->l2 || !w->wbuf || !w->cbuf )
+	{
+		perror("malloc");
+		exit(1);
+	}
+
+	// cluster 0 is the header, written last
+	w->wbufStart = QCOW2_CLUSTER_SIZE;
+	w->hostEnd = QCOW2_CLUSTER_SIZE;
+	qcow2WriterRef(w, 0);
+
+	return w;
+}
+
+static inline bool qcow2IsZero(const uint8_t *p, uint64_t len)
+{
+	const uint64_t *q = (const uint64_t *)p;
+	for(uint64_t i = 0; i < len / 8; i++)
+		if( q[i] )
+			return false;
+	return true;
+}
+
+static inline void qcow2WriterFinishCluster(struct Qcow2Writer *w)
+{
+	if( w->cur == -1ull )
+		return;
+
+	const uint64_t cluster = w->cur;
+	w->cur = -1ull;
+	w->next = cluster + 1;
+
+	uint64_t clusterLen = w->size - cluster * QCOW2_CLUSTER_SIZE;
+	if( clusterLen > QCOW2_CLUSTER_SIZE )
+		clusterLen = QCOW2_CLUSTER_SIZE;
+
+	// complete the cluster from the backing file
+	if( w->backing )
+	{
+		for(unsigned sec = 0; sec < clusterLen / 512; )
+		{
+			if( w->filled[sec / 64] & (1ull << (sec % 64)) )
+			{
+				sec++;
+				continue;
+			}
+			unsigned end = sec;
+			while( end < clusterLen / 512 && !( w->filled[end / 64] & (1ull << (end % 64)) ) )
+				end++;
+			qcow2Read(w->backing, cluster * QCOW2_CLUSTER_SIZE + sec * 512ull, w->cbuf + sec * 512, (end - sec) * 512);
+			sec = end;
+		}
+	}
+
+	if( qcow2IsZero(w->cbuf, QCOW2_CLUSTER_SIZE) )
+	{
+		if( w->backing )
+			qcow2WriterSetL2(w, cluster, QCOW2_OFLAG_ZERO);
+		return;
+	}
+
+#ifdef HAVE_ZSTD
+	if( w->compress )
+	{
+		const size_t csize = ZSTD_compress(w->zbuf, w->zbufSize, w->cbuf, QCOW2_CLUSTER_SIZE, ZSTD_CLEVEL_DEFAULT);
+		if( !ZSTD_isError(csize) && csize < QCOW2_CLUSTER_SIZE - 512 )
+		{
+			const unsigned csizeShift = 62 - (QCOW2_CLUSTER_BITS - 8);
+			const uint64_t hostOffset = w->hostEnd;
+			const uint64_t sectors = ( (hostOffset + csize - 1) >> 9 ) - ( hostOffset >> 9 );
+
+			qcow2WriterAppend(w, w->zbuf, csize);
+			for(uint64_t c = hostOffset / QCOW2_CLUSTER_SIZE; c <= (hostOffset + csize - 1) / QCOW2_CLUSTER_SIZE; c++)
+				qcow2WriterRef(w, c);
+			qcow2WriterSetL2(w, cluster, QCOW2_OFLAG_COMPRESSED | ( sectors << csizeShift ) | hostOffset);
+			return;
+		}
+	}
+#endif
+
+	qcow2WriterAlign(w);
+	const uint64_t hostOffset = w->hostEnd;
+	qcow2WriterAppend(w, w->cbuf, QCOW2_CLUSTER_SIZE);
+	qcow2WriterRef(w, hostOffset / QCOW2_CLUSTER_SIZE);
+	qcow2WriterSetL2(w, cluster, QCOW2_OFLAG_COPIED | hostOffset);
+}
+
+static inline void qcow2WriterStartCluster(struct Qcow2Writer *w, uint64_t cluster)
+{
+	if( cluster == w->cur )
+		return;
+
+	qcow2WriterFinishCluster(w);
+	if( cluster < w->next )
+	{
+		fprintf(stderr, "%s: extents out of order\n", w->path);
+		exit(1);
+	}
+
+	w->cur = cluster;
+	memset(w->cbuf, 0, QCOW2_CLUSTER_SIZE);
+	memset(w->filled, 0, sizeof(w->filled));
+}
+
+/*
+ * "data" NULL writes zeroes.
+ */
+static inline void qcow2WriterData(struct Qcow2Writer *w, uint64_t offset, const void *data, uint64_t len)
+{
+	if( offset > w->size || len > w->size - offset )
+	{
+		fprintf(stderr, "%s: extent at %" PRIu64 " is beyond the end of the disk\n", w->path, offset);
+		exit(1);
+	}
+	if( offset % 512 || len % 512 )
+	{
+		fprintf(stderr, "%s: unaligned extent at %" PRIu64 "\n", w->path, offset);
+		exit(1);
+	}
+
+	while( len )
+	{
+		const uint64_t cluster = offset / QCOW2_CLUSTER_SIZE;
+		const uint64_t inCluster = offset % QCOW2_CLUSTER_SIZE;
+		uint64_t l = QCOW2_CLUSTER_SIZE - inCluster;
+		if( l > len )
+			l = len;
+
+		if( !data && l == QCOW2_CLUSTER_SIZE )
+		{
+			// a whole zero cluster, only needs to hide the backing file
+			qcow2WriterFinishCluster(w);
+			if( cluster < w->next )
+			{
+				fprintf(stderr, "%s: extents out of order\n", w->path);
+				exit(1);
+			}
+			if( w->backing )
+				qcow2WriterSetL2(w, cluster, QCOW2_OFLAG_ZERO);
+			w->next = cluster + 1;
+		}
+		else
+		{
+			qcow2WriterStartCluster(w, cluster);
+			if( data )
+				memcpy(w->cbuf + inCluster, data, l);
+			else
+				memset(w->cbuf + inCluster, 0, l);
+			for(uint64_t sec = inCluster / 512; sec < (inCluster + l) / 512; sec++)
+				w->filled[sec / 64] |= 1ull << (sec % 64);
+		}
+
+		offset += l;
+		len -= l;
+		if( data )
+			data += l;
+	}
+}
+
+static inline void qcow2WriterClose(struct Qcow2Writer *w)
+{
+	qcow2WriterFinishCluster(w);
+	qcow2WriterAlign(w);
+
+	// L2 tables
+	uint64_t *l1 = calloc(w->l1Size ? w->l1Size : 1, 8);
+	for(uint64_t i = 0; i < w->l1Size; i++)
+	{
+		if( !w->l2[i] )
+			continue;
+		for(unsigned j = 0; j < QCOW2_L2_ENTRIES; j++)
+			w->l2[i][j] = htobe64(w->l2[i][j]);
+		l1[i] = htobe64(QCOW2_OFLAG_COPIED | w->hostEnd);
+		qcow2WriterRef(w, w->hostEnd / QCOW2_CLUSTER_SIZE);
+		qcow2WriterAppend(w, w->l2[i], QCOW2_CLUSTER_SIZE);
+		free(w->l2[i]);
+	}
+
+	// L1 table
+	const uint64_t l1Offset = w->hostEnd;
+	const uint64_t l1Clusters = (w->l1Size * 8 + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+	for(uint64_t c = 0; c < l1Clusters; c++)
+		qcow2WriterRef(w, l1Offset / QCOW2_CLUSTER_SIZE + c);
+	qcow2WriterAppend(w, l1, w->l1Size * 8);
+	qcow2WriterAlign(w);
+	free(l1);
+
+	// refcount blocks followed by the refcount table, they cover themselves too
+	const uint64_t firstRefCluster = w->hostEnd / QCOW2_CLUSTER_SIZE;
+	uint64_t blocks = 0, tableClusters = 0;
+	for(;;)
+	{
+		const uint64_t total = firstRefCluster + blocks + tableClusters;
+		const uint64_t b = (total + QCOW2_REFBLOCK_ENTRIES - 1) / QCOW2_REFBLOCK_ENTRIES;
+		const uint64_t t = (b * 8 + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+		if( b == blocks && t == tableClusters )
+			break;
+		blocks = b;
+		tableClusters = t;
+	}
+	for(uint64_t c = 0; c < blocks + tableClusters; c++)
+		qcow2WriterRef(w, firstRefCluster + c);
+
+	uint16_t *block = malloc(QCOW2_CLUSTER_SIZE);
+	uint64_t *table = calloc(tableClusters, QCOW2_CLUSTER_SIZE);
+	for(uint64_t b = 0; b < blocks; b++)
+	{
+		for(unsigned i = 0; i < QCOW2_REFBLOCK_ENTRIES; i++)
+		{
+			const uint64_t c = b * QCOW2_REFBLOCK_ENTRIES + i;
+			block[i] = htobe16(c < w->refcountsAlloc ? w->refcounts[c] : 0);
+		}
+		table[b] = htobe64(w->hostEnd);
+		qcow2WriterAppend(w, block, QCOW2_CLUSTER_SIZE);
+	}
+	const uint64_t tableOffset = w->hostEnd;
+	qcow2WriterAppend(w, table, tableClusters * QCOW2_CLUSTER_SIZE);
+	qcow2WriterFlush(w);
+	free(block);
+	free(table);
+
+	// header, extensions and the backing file name in cluster 0
+	uint8_t *hdrCluster = calloc(1, QCOW2_CLUSTER_SIZE);
+	struct Qcow2Header *hdr = (struct Qcow2Header *)hdrCluster;
+	hdr->magic = htobe32(QCOW2_MAGIC);
+	hdr->version = htobe32(3);
+	hdr->clusterBits = htobe32(QCOW2_CLUSTER_BITS);
+	hdr->size = htobe64(w->size);
+	hdr->l1Size = htobe32(w->l1Size);
+	hdr->l1TableOffset = htobe64(l1Offset);
+	hdr->refcountTableOffset = htobe64(tableOffset);
+	hdr->refcountTableClusters = htobe32(tableClusters);
+	hdr->refcountOrder = htobe32(QCOW2_REFCOUNT_ORDER);
+	hdr->headerLength = htobe32(sizeof(*hdr));
+	if( w->compress )
+	{
+		hdr->incompatibleFeatures = htobe64(QCOW2_INCOMPAT_COMPRESSION);
+		hdr->compressionType = QCOW2_COMPRESSION_ZSTD;
+	}
+
+	uint8_t *p = hdrCluster + sizeof(*hdr);
+	if( w->backing )
+	{
+		const char *format = w->backing->raw ? "raw" : "qcow2";
+		*(uint32_t *)p = htobe32(QCOW2_EXT_BACKING_FORMAT);
+		*(uint32_t *)(p + 4) = htobe32(strlen(format));
+		memcpy(p + 8, format, strlen(format));
+		p += 8 + (strlen(format) + 7) / 8 * 8;
+	}
+	*(uint32_t *)p = htobe32(QCOW2_EXT_END);
+	p += 8;
+
+	if( w->backing )
+	{
+		const size_t nameLen = strlen(w->backingName);
+		if( p + nameLen > hdrCluster + QCOW2_CLUSTER_SIZE )
+		{
+			fprintf(stderr, "backing file name too long\n");
+			exit(1);
+		}
+		hdr->backingFileOffset = htobe64(p - hdrCluster);
+		hdr->backingFileSize = htobe32(nameLen);
+		memcpy(p, w->backingName, nameLen);
+	}
+
+	w->wbufStart = 0;
+	memcpy(w->wbuf, hdrCluster, QCOW2_CLUSTER_SIZE);
+	w->wbufLen = QCOW2_CLUSTER_SIZE;
+	qcow2WriterFlush(w);
+	free(hdrCluster);
+
+	if( fdatasync(w->fd) != 0 )
+	{
+		perror("fdatasync");
+		exit(1);
+	}
+	close(w->fd);
+
+	free(w->l2);
+	free(w->refcounts);
+	free(w->wbuf);
+	free(w->cbuf);
+	free(w->zbuf);
+	free(w);
+}
+
+#endif
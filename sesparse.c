@@ -30,19 +30,25 @@
 /*
 compile:
 
-gcc -std=c99 -o sesparse sesparse.c
+gcc -std=c99 -pthread -o sesparse sesparse.c
+
+with zstd compressed qcow2 output (-O qcow2 -c):
+
+gcc -std=c99 -pthread -o sesparse sesparse.c -DHAVE_ZSTD -lzstd
 */
 #define _GNU_SOURCE 1
-#define _BSD_SOURCE 1
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <sys/uio.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "output.h"
+
 struct SeSparseHeader
 {
 	uint64_t magic;
@@ -84,25 +90,28 @@ struct SESparseVolatileHeader
 	uint8_t pad[480];
 } __attribute__((packed));
 
-char zeroes[512*8] __attribute__((aligned(4096)));
-
 int main(int argc, char *argv[])
 {
-	if( argc != 3 )
+	struct OutputOptions outOpts = {};
+	int opt;
+	while( (opt = getopt_long(argc, argv, OUTPUT_OPTIONS, outputLongOptions, NULL)) != -1 )
 	{
-		fprintf(stderr, "usage: %s /path/to/sesparse.vmdk /dev/storpool/targetVolume\n", argv[0]);
-		exit(1);
+		if( !outputOption(&outOpts, opt, optarg) )
+			goto usage;
 	}
+	argc -= optind - 1;
+	argv += optind - 1;
 	
-	const int fd = open(argv[1], O_RDONLY);
-	if( fd == -1 )
+	if( argc != 3 && !( argc == 2 && outputMapOnly(&outOpts) ) )
 	{
-		perror("open");
+usage:
+		fprintf(stderr, "usage: %s [-O qcow2 [-B backing] [-c]] [--explain] [--calibrate] /path/to/sesparse.vmdk /dev/storpool/targetVolume\n", argv[0]);
+		fprintf(stderr, "       %s -m extents.map /path/to/sesparse.vmdk\n", argv[0]);
 		exit(1);
 	}
 	
-	const int ofd = open(argv[2], O_RDWR | O_DIRECT);
-	if( ofd == -1 )
+	const int fd = open(argv[1], O_RDONLY);
+	if( fd == -1 )
 	{
 		perror("open");
 		exit(1);
@@ -147,10 +156,28 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
+	/*
+	 * The journal holds metadata updates not yet applied to the grain
+	 * tables. Its format isn't documented, so it isn't replayed. Only a
+	 * journal area that is all zeroes surely has nothing in it; anything
+	 * else stops the conversion, the grain tables alone may be stale.
+	 */
 	if( vhdr->replay_journal )
 	{
-		fprintf(stderr, "replay journal is not supported\n");
-		exit(1);
+		const uint64_t journalStart = hdr->journal_offset * 512;
+		const uint64_t journalEnd = ( hdr->journal_offset + hdr->journal_size ) * 512;
+		bool empty = journalEnd <= size;
+		for(uint64_t i = journalStart; empty && i < journalEnd; i += 8)
+			empty = *(const uint64_t *)(ptr + i) == 0;
+		
+		if( !empty )
+		{
+			fprintf(stderr, "%s: the journal has to be replayed, which is not supported. The VM was\n"
+				"powered on or crashed when the disk was copied; consolidate the snapshot on the\n"
+				"ESXi host (or power the VM off cleanly) and copy the disk again\n", argv[1]);
+			exit(1);
+		}
+		fprintf(stderr, "the journal is empty, nothing to replay\n");
 	}
 	
 	const uint64_t *dir = ptr + hdr->grain_dir_offset * 512;
@@ -158,10 +185,10 @@ int main(int argc, char *argv[])
 	
 	const uint64_t dirEntVirtualSize = 8ull * 512 * 64 * 512 / 8;
 	
-	uint64_t lastAddr = 0;
-	const unsigned iovecSize = 32;
-	struct iovec iovec[iovecSize];
-	unsigned iovecPtr = 0;
+	struct Output out;
+	outputInit(&out, ptr, size, hdr->capacity * 512);
+	outputSourceFd(&out, fd);
+	outputOpenOptions(&out, &outOpts, argv[2], O_RDWR | O_DIRECT);
 	
 	for(unsigned i = 0; i < hdr->grain_dir_size * 512 / 8; i++ )
 	{
@@ -180,56 +207,28 @@ int main(int argc, char *argv[])
 						continue;
 					
 					const uint64_t virtualOffset = i * (uint64_t)dirEntVirtualSize + j * 8 * 512lu;
-					if( iovecPtr && (lastAddr != virtualOffset || iovecPtr == iovecSize) )
-					{
-						const ssize_t res = pwritev(ofd, iovec, iovecPtr, lastAddr - iovecPtr * 4096 );
-						if( res != iovecPtr * 4096)
-						{
-							if( res < 0 )
-								perror("pwrite");
-							else
-								abort();
-							exit(1);
-						}
-						iovecPtr = 0;
-					}
-					lastAddr = virtualOffset + 4096;
 					if( type == 1 || type == 2 )
 					{
 						// fprintf(stderr, "must write zeroes @%lu\n", virtualOffset);
-						iovec[iovecPtr].iov_base = zeroes;
+						outputZero(&out, virtualOffset, 4096);
 					}
 					else if( type == 3 )
 					{
 						uint64_t offset = ((tbl[j] & 0x0fff000000000000) >> 48) | ((tbl[j] & 0xffffffffffff) << 12);
 						const uint64_t fileOffset = hdr->grains_offset * 512ull + offset * 8 * 512;
 						fprintf(stderr, "vo %lu file addr %lu\n", virtualOffset, fileOffset);
-						iovec[iovecPtr].iov_base = (void*)ptr + fileOffset;
+						outputData(&out, virtualOffset, fileOffset, 4096);
 					}
 					else
 					{
 						fprintf(stderr, "unknown grain type %x\n", type);
 						exit(1);
 					}
-					
-					iovec[iovecPtr].iov_len = 4096;
-					iovecPtr++;
 				}
 			}
 		}
 	}
 	
-	if( iovecPtr )
-	{
-		const ssize_t res = pwritev(ofd, iovec, iovecPtr, lastAddr - iovecPtr * 4096 );
-		if( res != iovecPtr * 4096)
-		{
-			if( res < 0 )
-				perror("pwrite");
-			else
-				abort();
-			exit(1);
-		}
-	}
+	outputClose(&out);
 }
 
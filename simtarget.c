@@ -0,0 +1,539 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+compile:
+
+gcc -std=c99 -Wall -Werror -pthread -shared -fPIC -o simtarget.so simtarget.c -ldl -lm
+*/
+
+/*
+ * A simulated target for benchmarking and testing the converters without
+ * the storage they are meant for. Preloaded into a converter, it turns the
+ * I/O to one file into I/O to a slower, less reliable device:
+ *
+ * LD_PRELOAD=./simtarget.so SIMTARGET=out.raw SIMTARGET_LATENCY=exp:500 \
+ *     ./vhd disk.vhd out.raw
+ *
+ * SIMTARGET			the target file, the I/O to other files isn't touched
+ * SIMTARGET_LATENCY	per I/O, microseconds: fixed:US, uniform:MIN:MAX,
+ * 						exp:MEAN or normal:MEAN:SD
+ * SIMTARGET_TAIL		PROBABILITY:US, an extra delay for that part of the I/O
+ * SIMTARGET_BW			MiB/s shared by all the I/O
+ * SIMTARGET_QD			I/Os the device takes at once, the rest wait
+ * SIMTARGET_BLOCK		the physical block, reported in st_blksize
+ * SIMTARGET_RMW		US added to a write for each end not on a block
+ * 						boundary, the read-modify-write of the device
+ * SIMTARGET_EIO		probability of a write failing with EIO
+ * SIMTARGET_SHORT		probability of a write stopping short
+ * SIMTARGET_OFFLOAD	1 to let clones and copy_file_range() through, off
+ * 						by default, like on a block device
+ * SIMTARGET_SEED		for the random numbers, 1 by default
+ * SIMTARGET_STATS		a file to append what was seen to, as k=v lines
+ *
+ * The latency is paid after the transfer, which the bandwidth limit keeps
+ * in a single line for all the I/O. Short writes write a part of the data,
+ * a multiple of 4 KiB, and report it.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define SIM_MAX_FD		4096
+#define SIM_SIZES		24
+
+enum SimDist
+{
+	DIST_NONE,
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_EXP,
+	DIST_NORMAL,
+};
+
+static struct
+{
+	bool			on;
+	dev_t			dev;
+	ino_t			ino;
+	bool			fds[SIM_MAX_FD];
+
+	enum SimDist	dist;
+	double			lat1, lat2;
+	double			tailProb, tail;
+	double			bw;
+	unsigned		qd;
+	unsigned		block;
+	double			rmw;
+	double			eio;
+	double			shortProb;
+	bool			offload;
+	const char		*statsPath;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned short	rand[3];
+	unsigned		inFlight;
+	double			busyUntil;
+
+	// what was seen
+	unsigned		maxInFlight;
+	uint64_t		reads, writes, readBytes, writeBytes;
+	uint64_t		unaligned, eios, shorts, syncs, iovecs;
+	uint64_t		sizes[SIM_SIZES];
+	double			waited, serviced, start;
+} sim = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static int (*realOpen)(const char *, int, ...);
+static int (*realOpenat)(int, const char *, int, ...);
+static int (*realClose)(int);
+static ssize_t (*realPread)(int, void *, size_t, off_t);
+static ssize_t (*realPwrite)(int, const void *, size_t, off_t);
+static ssize_t (*realPwritev)(int, const struct iovec *, int, off_t);
+static int (*realFdatasync)(int);
+static int (*realFsync)(int);
+static int (*realFstat)(int, struct stat *);
+static int (*realIoctl)(int, unsigned long, ...);
+static ssize_t (*realCopyFileRange)(int, off_t *, int, off_t *, size_t, unsigned);
+
+static double simNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void simSleepUntil(double t)
+{
+	struct timespec ts;
+	ts.tv_sec = t;
+	ts.tv_nsec = (t - ts.tv_sec) * 1e9;
+	while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+		;
+}
+
+static double simEnv(const char *name, double def)
+{
+	const char *s = getenv(name);
+	return s && *s ? strtod(s, NULL) : def;
+}
+
+static void simParseLatency(const char *s)
+{
+	if( !s || !*s )
+		return;
+	if( sscanf(s, "fixed:%lf", &sim.lat1) == 1 )
+		sim.dist = DIST_FIXED;
+	else if( sscanf(s, "uniform:%lf:%lf", &sim.lat1, &sim.lat2) == 2 )
+		sim.dist = DIST_UNIFORM;
+	else if( sscanf(s, "exp:%lf", &sim.lat1) == 1 )
+		sim.dist = DIST_EXP;
+	else if( sscanf(s, "normal:%lf:%lf", &sim.lat1, &sim.lat2) == 2 )
+		sim.dist = DIST_NORMAL;
+	else
+	{
+		fprintf(stderr, "simtarget: bad SIMTARGET_LATENCY %s\n", s);
+		exit(1);
+	}
+}
+
+// seconds, called with the lock held
+static double simLatency()
+{
+	double us = 0;
+	switch( sim.dist )
+	{
+		case DIST_NONE:
+			break;
+		case DIST_FIXED:
+			us = sim.lat1;
+			break;
+		case DIST_UNIFORM:
+			us = sim.lat1 + erand48(sim.rand) * (sim.lat2 - sim.lat1);
+			break;
+		case DIST_EXP:
+			us = -sim.lat1 * log(1 - erand48(sim.rand));
+			break;
+		case DIST_NORMAL:
+			us = sim.lat1 + sim.lat2 * sqrt(-2 * log(1 - erand48(sim.rand))) * cos(2 * M_PI * erand48(sim.rand));
+			break;
+	}
+	if( sim.tailProb && erand48(sim.rand) < sim.tailProb )
+		us += sim.tail;
+	return us > 0 ? us / 1e6 : 0;
+}
+
+static void simStats()
+{
+	if( !sim.on || !sim.statsPath )
+		return;
+	FILE *f = fopen(sim.statsPath, "a");
+	if( !f )
+		return;
+	fprintf(f, "pid=%d\nelapsed=%.3f\nreads=%" PRIu64 "\nreadBytes=%" PRIu64 "\nwrites=%" PRIu64 "\nwriteBytes=%" PRIu64 "\n",
+		getpid(), simNow() - sim.start, sim.reads, sim.readBytes, sim.writes, sim.writeBytes);
+	fprintf(f, "iovecs=%" PRIu64 "\nunaligned=%" PRIu64 "\neio=%" PRIu64 "\nshort=%" PRIu64 "\nsyncs=%" PRIu64 "\n",
+		sim.iovecs, sim.unaligned, sim.eios, sim.shorts, sim.syncs);
+	fprintf(f, "maxInFlight=%u\nqueueWait=%.3f\nservice=%.3f\n", sim.maxInFlight, sim.waited, sim.serviced);
+	for(unsigned i = 0; i < SIM_SIZES; i++)
+		if( sim.sizes[i] )
+			fprintf(f, "size%" PRIu64 "=%" PRIu64 "\n", (uint64_t)1 << i, sim.sizes[i]);
+	fclose(f);
+}
+
+__attribute__((constructor))
+static void simInit()
+{
+	realOpen = dlsym(RTLD_NEXT, "open");
+	realOpenat = dlsym(RTLD_NEXT, "openat");
+	realClose = dlsym(RTLD_NEXT, "close");
+	realPread = dlsym(RTLD_NEXT, "pread");
+	realPwrite = dlsym(RTLD_NEXT, "pwrite");
+	realPwritev = dlsym(RTLD_NEXT, "pwritev");
+	realFdatasync = dlsym(RTLD_NEXT, "fdatasync");
+	realFsync = dlsym(RTLD_NEXT, "fsync");
+	realFstat = dlsym(RTLD_NEXT, "fstat");
+	realIoctl = dlsym(RTLD_NEXT, "ioctl");
+	realCopyFileRange = dlsym(RTLD_NEXT, "copy_file_range");
+
+	const char *path = getenv("SIMTARGET");
+	struct stat st;
+	if( !path || stat(path, &st) != 0 )
+		return;
+
+	sim.on = true;
+	sim.dev = st.st_dev;
+	sim.ino = st.st_ino;
+	simParseLatency(getenv("SIMTARGET_LATENCY"));
+	const char *tail = getenv("SIMTARGET_TAIL");
+	if( tail && sscanf(tail, "%lf:%lf", &sim.tailProb, &sim.tail) != 2 )
+	{
+		fprintf(stderr, "simtarget: bad SIMTARGET_TAIL %s\n", tail);
+		exit(1);
+	}
+	sim.bw = simEnv("SIMTARGET_BW", 0) * 1024 * 1024;
+	sim.qd = simEnv("SIMTARGET_QD", 0);
+	sim.block = simEnv("SIMTARGET_BLOCK", 0);
+	sim.rmw = simEnv("SIMTARGET_RMW", 0) / 1e6;
+	sim.eio = simEnv("SIMTARGET_EIO", 0);
+	sim.shortProb = simEnv("SIMTARGET_SHORT", 0);
+	sim.offload = simEnv("SIMTARGET_OFFLOAD", 0) != 0;
+	sim.statsPath = getenv("SIMTARGET_STATS");
+
+	const unsigned seed = simEnv("SIMTARGET_SEED", 1);
+	sim.rand[0] = seed;
+	sim.rand[1] = seed >> 16;
+	sim.rand[2] = 0x330e;
+	sim.start = simNow();
+	atexit(simStats);
+}
+
+static bool simIs(int fd)
+{
+	return sim.on && fd >= 0 && fd < SIM_MAX_FD && sim.fds[fd];
+}
+
+static void simOpened(int fd)
+{
+	struct stat st;
+	if( sim.on && fd >= 0 && fd < SIM_MAX_FD && realFstat(fd, &st) == 0 )
+		sim.fds[fd] = st.st_dev == sim.dev && st.st_ino == sim.ino;
+}
+
+/*
+ * One I/O of "len" bytes at "offset": wait for a queue slot, let "io" do
+ * it unless a fault is injected, and hold the result until the simulated
+ * device would have finished.
+ */
+static ssize_t simIo(bool write, size_t len, off_t offset, unsigned iovecs,
+	ssize_t (*io)(void *, size_t), void *arg)
+{
+	pthread_mutex_lock(&sim.lock);
+	const double queued = simNow();
+	while( sim.qd && sim.inFlight >= sim.qd )
+		pthread_cond_wait(&sim.cond, &sim.lock);
+	sim.inFlight++;
+	if( sim.inFlight > sim.maxInFlight )
+		sim.maxInFlight = sim.inFlight;
+
+	const double now = simNow();
+	sim.waited += now - queued;
+	double done = now;
+	if( sim.bw )
+	{
+		if( sim.busyUntil < now )
+			sim.busyUntil = now;
+		sim.busyUntil += len / sim.bw;
+		done = sim.busyUntil;
+	}
+	done += simLatency();
+
+	bool eio = false;
+	size_t part = len;
+	if( write )
+	{
+		if( sim.block )
+		{
+			const unsigned edges = ( offset % sim.block != 0 ) + ( ( offset + len ) % sim.block != 0 );
+			if( edges )
+				sim.unaligned++;
+			done += edges * sim.rmw;
+		}
+		if( sim.eio && erand48(sim.rand) < sim.eio )
+		{
+			eio = true;
+			sim.eios++;
+		}
+		else if( sim.shortProb && len > 4096 && erand48(sim.rand) < sim.shortProb )
+		{
+			part = (uint64_t)( erand48(sim.rand) * len ) / 4096 * 4096;
+			if( !part )
+				part = 4096;
+			sim.shorts++;
+		}
+		sim.writes++;
+		sim.iovecs += iovecs;
+	}
+	else
+		sim.reads++;
+	unsigned bucket = 0;
+	while( bucket < SIM_SIZES - 1 && ( (size_t)2 << bucket ) <= len )
+		bucket++;
+	sim.sizes[bucket]++;
+	pthread_mutex_unlock(&sim.lock);
+
+	ssize_t res = -1;
+	int err = EIO;
+	if( !eio )
+	{
+		res = io(arg, part);
+		err = errno;
+	}
+	simSleepUntil(done);
+
+	pthread_mutex_lock(&sim.lock);
+	if( res > 0 )
+	{
+		if( write )
+			sim.writeBytes += res;
+		else
+			sim.readBytes += res;
+	}
+	sim.serviced += simNow() - now;
+	sim.inFlight--;
+	pthread_cond_signal(&sim.cond);
+	pthread_mutex_unlock(&sim.lock);
+
+	errno = err;
+	return res;
+}
+
+struct SimRw
+{
+	int					fd;
+	void				*buf;
+	const struct iovec	*iov;
+	int					iovCnt;
+	off_t				offset;
+};
+
+static ssize_t simDoPread(void *arg, size_t len)
+{
+	struct SimRw *rw = arg;
+	return realPread(rw->fd, rw->buf, len, rw->offset);
+}
+
+static ssize_t simDoPwrite(void *arg, size_t len)
+{
+	struct SimRw *rw = arg;
+	return realPwrite(rw->fd, rw->buf, len, rw->offset);
+}
+
+static ssize_t simDoPwritev(void *arg, size_t len)
+{
+	struct SimRw *rw = arg;
+	struct iovec iov[rw->iovCnt];
+	int cnt = 0;
+	for(int i = 0; i < rw->iovCnt && len; i++, cnt++)
+	{
+		iov[i] = rw->iov[i];
+		if( iov[i].iov_len > len )
+			iov[i].iov_len = len;
+		len -= iov[i].iov_len;
+	}
+	return realPwritev(rw->fd, iov, cnt, rw->offset);
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	if( flags & ( O_CREAT | O_TMPFILE ) )
+	{
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	const int fd = realOpen(path, flags, mode);
+	simOpened(fd);
+	return fd;
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	if( flags & ( O_CREAT | O_TMPFILE ) )
+	{
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	const int fd = realOpenat(dirfd, path, flags, mode);
+	simOpened(fd);
+	return fd;
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) __attribute__((alias("openat")));
+
+int close(int fd)
+{
+	if( fd >= 0 && fd < SIM_MAX_FD )
+		sim.fds[fd] = false;
+	return realClose(fd);
+}
+
+ssize_t pread(int fd, void *buf, size_t len, off_t offset)
+{
+	if( !simIs(fd) )
+		return realPread(fd, buf, len, offset);
+	struct SimRw rw = { fd, buf, NULL, 0, offset };
+	return simIo(false, len, offset, 1, simDoPread, &rw);
+}
+
+ssize_t pread64(int fd, void *buf, size_t len, off_t offset) __attribute__((alias("pread")));
+
+ssize_t pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	if( !simIs(fd) )
+		return realPwrite(fd, buf, len, offset);
+	struct SimRw rw = { fd, (void *)buf, NULL, 0, offset };
+	return simIo(true, len, offset, 1, simDoPwrite, &rw);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t len, off_t offset) __attribute__((alias("pwrite")));
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovCnt, off_t offset)
+{
+	if( !simIs(fd) )
+		return realPwritev(fd, iov, iovCnt, offset);
+	size_t len = 0;
+	for(int i = 0; i < iovCnt; i++)
+		len += iov[i].iov_len;
+	struct SimRw rw = { fd, NULL, iov, iovCnt, offset };
+	return simIo(true, len, offset, iovCnt, simDoPwritev, &rw);
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovCnt, off_t offset) __attribute__((alias("pwritev")));
+
+int fdatasync(int fd)
+{
+	if( simIs(fd) )
+	{
+		pthread_mutex_lock(&sim.lock);
+		sim.syncs++;
+		pthread_mutex_unlock(&sim.lock);
+	}
+	return realFdatasync(fd);
+}
+
+int fsync(int fd)
+{
+	if( simIs(fd) )
+	{
+		pthread_mutex_lock(&sim.lock);
+		sim.syncs++;
+		pthread_mutex_unlock(&sim.lock);
+	}
+	return realFsync(fd);
+}
+
+int fstat(int fd, struct stat *st)
+{
+	const int res = realFstat(fd, st);
+	if( res == 0 && sim.block && simIs(fd) )
+		st->st_blksize = sim.block;
+	return res;
+}
+
+int fstat64(int fd, struct stat64 *st) __attribute__((alias("fstat")));
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	va_start(ap, request);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if( request == FICLONERANGE && !sim.offload && simIs(fd) )
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return realIoctl(fd, request, arg);
+}
+
+ssize_t copy_file_range(int fdIn, off_t *offIn, int fdOut, off_t *offOut, size_t len, unsigned flags)
+{
+	if( !sim.offload && simIs(fdOut) )
+	{
+		errno = EXDEV;
+		return -1;
+	}
+	return realCopyFileRange(fdIn, offIn, fdOut, offOut, len, flags);
+}
@@ -0,0 +1,273 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * What the target can take: block sizes from the block device ioctls,
+ * queue limits from sysfs (of the device itself, or of the device the
+ * file is on), and from those the write size, iovec count and number of
+ * writes in flight the output uses.
+ *
+ * The optional calibration times O_DIRECT reads of growing size from the
+ * start of the target. Reads, because the target may already hold the
+ * parent layer; it's a proxy for where the device stops gaining from
+ * larger requests.
+ */
+
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+
+#define TARGET_MIN_WRITE	(128 * 1024)
+#define TARGET_MAX_WRITE	(4 * 1024 * 1024)
+#define TARGET_MAX_DEPTH	8
+
+struct TargetInfo
+{
+	bool			isBlock;
+	unsigned		logicalBlock;
+	unsigned		physicalBlock;
+	unsigned		optimalIo;
+
+	// from sysfs, 0 (or -1 for rotational) if not known
+	unsigned		maxSectorsKb;
+	unsigned		maxSegments;
+	unsigned		nrRequests;
+	int				rotational;
+};
+
+struct TargetTuning
+{
+	uint64_t		writeSize;
+	unsigned		maxIov;
+	unsigned		depth;
+};
+
+static inline bool targetSysfs(dev_t dev, const char *name, unsigned *value)
+{
+	char path[PATH_MAX];
+	const char *fmts[] = { "/sys/dev/block/%u:%u/queue/%s", "/sys/dev/block/%u:%u/../queue/%s" };
+
+	// partitions have their queue in the parent device
+	for(int i = 0; i < 2; i++)
+	{
+		snprintf(path, sizeof(path), fmts[i], major(dev), minor(dev), name);
+		FILE *f = fopen(path, "r");
+		if( !f )
+			continue;
+		const bool ok = fscanf(f, "%u", value) == 1;
+		fclose(f);
+		if( ok )
+			return true;
+	}
+	return false;
+}
+
+static inline void targetProbe(int fd, struct TargetInfo *info)
+{
+	struct stat st;
+	if( fstat(fd, &st) != 0 )
+	{
+		perror("fstat");
+		exit(1);
+	}
+
+	memset(info, 0, sizeof(*info));
+	info->rotational = -1;
+	info->isBlock = S_ISBLK(st.st_mode);
+	info->logicalBlock = 512;
+	info->physicalBlock = st.st_blksize;
+	if( info->isBlock )
+	{
+		int logical;
+		unsigned physical, optimal;
+		if( ioctl(fd, BLKSSZGET, &logical) == 0 )
+			info->logicalBlock = logical;
+		if( ioctl(fd, BLKPBSZGET, &physical) == 0 )
+			info->physicalBlock = physical;
+		if( ioctl(fd, BLKIOOPT, &optimal) == 0 )
+			info->optimalIo = optimal;
+	}
+	if( info->physicalBlock < info->logicalBlock )
+		info->physicalBlock = info->logicalBlock;
+
+	// a file gets the limits of the device its file system is on
+	const dev_t dev = info->isBlock ? st.st_rdev : st.st_dev;
+	unsigned rotational;
+	targetSysfs(dev, "max_sectors_kb", &info->maxSectorsKb);
+	targetSysfs(dev, "max_segments", &info->maxSegments);
+	targetSysfs(dev, "nr_requests", &info->nrRequests);
+	if( targetSysfs(dev, "rotational", &rotational) )
+		info->rotational = rotational;
+	if( !info->optimalIo )
+		targetSysfs(dev, "optimal_io_size", &info->optimalIo);
+}
+
+static inline double targetNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The smallest read size that gets within 10% of the best throughput,
+ * 0 if the target can't be read with O_DIRECT.
+ */
+static inline uint64_t targetCalibrate(int fd, bool explain)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	const int dfd = open(path, O_RDONLY | O_DIRECT);
+	if( dfd == -1 )
+		return 0;
+
+	const uint64_t targetSize = lseek(dfd, 0, SEEK_END);
+	void *buf;
+	if( posix_memalign(&buf, 4096, TARGET_MAX_WRITE) != 0 )
+	{
+		perror("posix_memalign");
+		exit(1);
+	}
+
+	double rates[16] = {};
+	uint64_t sizes[16] = {};
+	unsigned count = 0;
+	double best = 0;
+	for(uint64_t size = 64 * 1024; size <= TARGET_MAX_WRITE && size * 16 <= targetSize; size *= 2, count++)
+	{
+		const double start = targetNow();
+		uint64_t done = 0;
+		for(unsigned i = 0; i < 16; i++)
+		{
+			const ssize_t res = pread(dfd, buf, size, i * size);
+			if( res <= 0 )
+				break;
+			done += res;
+		}
+		const double elapsed = targetNow() - start;
+		sizes[count] = size;
+		rates[count] = elapsed > 0 ? done / elapsed : 0;
+		if( rates[count] > best )
+			best = rates[count];
+		if( explain )
+			fprintf(stderr, "calibrate: %6" PRIu64 " KiB reads: %.1f MB/s, %.2f ms each\n",
+				size / 1024, rates[count] / 1e6, elapsed * 1000 / 16);
+	}
+
+	free(buf);
+	close(dfd);
+
+	for(unsigned i = 0; i < count; i++)
+		if( rates[i] >= best * 0.9 )
+			return sizes[i];
+	return 0;
+}
+
+static inline void targetTune(int fd, const struct TargetInfo *info, bool calibrate, bool explain, struct TargetTuning *t)
+{
+	// write size: as large as the device takes in one request
+	t->writeSize = 1024 * 1024;
+	const char *why = "default";
+	if( info->maxSectorsKb )
+	{
+		t->writeSize = info->maxSectorsKb * 1024ull;
+		why = "max_sectors_kb";
+	}
+	if( info->optimalIo > t->writeSize )
+	{
+		t->writeSize = info->optimalIo;
+		why = "optimal_io_size";
+	}
+	if( calibrate )
+	{
+		const uint64_t size = targetCalibrate(fd, explain);
+		if( size )
+		{
+			t->writeSize = size;
+			why = "calibration";
+		}
+	}
+	if( t->writeSize < TARGET_MIN_WRITE )
+		t->writeSize = TARGET_MIN_WRITE;
+	if( t->writeSize > TARGET_MAX_WRITE )
+		t->writeSize = TARGET_MAX_WRITE;
+	if( explain )
+		fprintf(stderr, "write size %" PRIu64 " KiB (%s)\n", t->writeSize / 1024, why);
+
+	// iovecs: what a request can carry, within IOV_MAX
+	t->maxIov = 256;
+	why = "default";
+	if( info->maxSegments )
+	{
+		t->maxIov = info->maxSegments;
+		why = "max_segments";
+	}
+	if( t->maxIov > IOV_MAX )
+	{
+		t->maxIov = IOV_MAX;
+		why = "IOV_MAX";
+	}
+	if( explain )
+		fprintf(stderr, "iovecs per write %u (%s)\n", t->maxIov, why);
+
+	// writes in flight: one for spinning disks and the page cache, more
+	// for devices with deep queues
+	t->depth = 1;
+	why = "default";
+	if( info->rotational == 1 )
+		why = "rotational";
+	else if( !info->isBlock && !( fcntl(fd, F_GETFL) & O_DIRECT ) )
+		why = "file, the page cache does the queueing";
+	else if( info->nrRequests )
+	{
+		t->depth = info->nrRequests / 16;
+		if( t->depth < 1 )
+			t->depth = 1;
+		if( t->depth > TARGET_MAX_DEPTH )
+			t->depth = TARGET_MAX_DEPTH;
+		why = "nr_requests / 16";
+	}
+	if( explain )
+		fprintf(stderr, "writes in flight %u (%s)\n", t->depth, why);
+}
+
+#endif
@@ -30,8 +30,13 @@
 /*
 compile:
 
-gcc -std=c99 -D _BSD_SOURCE -D _XOPEN_SOURCE=500 -o vhd vhd.c
+gcc -std=c99 -pthread -o vhd vhd.c
+
+with zstd compressed qcow2 output (-O qcow2 -c):
+
+gcc -std=c99 -pthread -o vhd vhd.c -DHAVE_ZSTD -lzstd
 */
+#define _GNU_SOURCE 1
 
 #include <unistd.h>
 #include <stdio.h>
@@ -42,6 +47,11 @@ gcc -std=c99 -D _BSD_SOURCE -D _XOPEN_SOURCE=500 -o vhd vhd.c
 #include <endian.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "output.h"
 
 struct VhdHeader
 {
@@ -87,12 +97,75 @@ struct VhdDyn
 	
 } __attribute__((packed));
 
+// XenServer (blktap) batmap: a bit per BAT entry, MSB first like the sector
+// bitmaps, set if the block is full
+#define BATMAP_COOKIE		"tdbatmap"
+#define BATMAP_VERSION(major, minor)	( ( (major) << 16 ) | ( (minor) & 0xffff ) )
+
+struct BatmapHeader
+{
+	char		cookie[8];
+	uint64_t	batmapOffset;
+	uint32_t	batmapSize;		// in sectors
+	uint32_t	batmapVersion;
+	uint32_t	checksum;		// 1's complement of the sum of the map bytes
+} __attribute__((packed));
+
+/*
+ * The batmap follows the BAT, NULL if there is none or it doesn't check
+ * out.
+ */
+const uint8_t *findBatmap(void *base, uint64_t size, uint64_t tableOffset, uint32_t maxTableEntries, uint64_t diskSize)
+{
+	const uint64_t hdrOffset = tableOffset + (maxTableEntries * 4ull + 511) / 512 * 512;
+	if( hdrOffset + sizeof(struct BatmapHeader) > size )
+		return NULL;
+	
+	const struct BatmapHeader *hdr = base + hdrOffset;
+	if( memcmp(hdr->cookie, BATMAP_COOKIE, 8) != 0 )
+		return NULL;
+	
+	const uint64_t mapOffset = be64toh(hdr->batmapOffset);
+	const uint32_t version = be32toh(hdr->batmapVersion);
+	if( version >> 16 != 1 )
+	{
+		fprintf(stderr, "batmap version %x not supported, ignoring it\n", version);
+		return NULL;
+	}
+	
+	// checksummed the way blktap does it, with signed bytes in 1.1
+	uint64_t mapSize = ( diskSize >> (21 + 3) ) ? ( (diskSize >> (21 + 3)) + 511 ) / 512 * 512 : 512;
+	if( mapSize > be32toh(hdr->batmapSize) * 512ull || mapOffset + mapSize > size ||
+		( maxTableEntries + 7 ) / 8 > be32toh(hdr->batmapSize) * 512ull )
+	{
+		fprintf(stderr, "batmap has invalid size, ignoring it\n");
+		return NULL;
+	}
+	
+	const uint8_t *map = base + mapOffset;
+	uint32_t checksum = 0;
+	for(uint64_t i = 0; i < mapSize; i++)
+	{
+		if( version == BATMAP_VERSION(1, 1) )
+			checksum += (uint32_t)(int8_t)map[i];
+		else
+			checksum += map[i];
+	}
+	if( ~checksum != be32toh(hdr->checksum) )
+	{
+		fprintf(stderr, "batmap checksum mismatch, ignoring it\n");
+		return NULL;
+	}
+	
+	return map;
+}
+
 void printUUid(uint8_t *uuid)
 {
 	for(unsigned i = 0; i < 16; i++, uuid++)
 	{
-		printf("%X%X", uuid[0] >> 4, uuid[0] & 0xf);
-		if( i % 4 == 0 )
+		printf("%x%x", uuid[0] >> 4, uuid[0] & 0xf);
+		if( i == 3 || i == 5 || i == 7 || i == 9 )
 			printf("-");
 	}
 }
@@ -109,9 +182,20 @@ void printUnicode(uint16_t *n)
 
 int main(int argc, char *argv[])
 {
+	struct OutputOptions outOpts = {};
+	int opt;
+	while( (opt = getopt_long(argc, argv, OUTPUT_OPTIONS, outputLongOptions, NULL)) != -1 )
+	{
+		if( !outputOption(&outOpts, opt, optarg) )
+			goto usage;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	
 	if( argc != 2 && argc != 3 )
 	{
-		fprintf(stderr, "usage: %s: file.vhd [output.raw]\n", argv[0]);
+usage:
+		fprintf(stderr, "usage: %s: " OUTPUT_USAGE " file.vhd [output.raw|output.qcow2]\n", argv[0]);
 		exit(1);
 	}
 	
@@ -122,7 +206,38 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
-	uint64_t size = lseek(fd, 0, SEEK_END);
+	struct stat st;
+	if( fstat(fd, &st) != 0 )
+	{
+		perror("fstat");
+		exit(1);
+	}
+	
+	/*
+	 * On XenServer LVM SRs the VHD is in a logical volume, VHD-<uuid>,
+	 * that's larger than the VHD itself. The volume may have been written
+	 * from another host since we last looked at it, so don't trust the
+	 * page cache for it.
+	 */
+	const bool isBlock = S_ISBLK(st.st_mode);
+	uint64_t size;
+	if( isBlock )
+	{
+		if( ioctl(fd, BLKGETSIZE64, &size) != 0 )
+		{
+			perror("BLKGETSIZE64");
+			exit(1);
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	else
+		size = st.st_size;
+	
+	if( size < 512 )
+	{
+		fprintf(stderr, "unsupported\n");
+		exit(1);
+	}
 	
 	void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
 	if( base == MAP_FAILED )
@@ -131,7 +246,14 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
+	/*
+	 * The copy of the footer at the start is the one to use. The one at
+	 * the end of a file is a fallback, the end of a logical volume is
+	 * slack after the last block, not a footer.
+	 */
 	struct VhdHeader *vhd = base;
+	if( vhd->cookie != 0x78697463656e6f63 && !isBlock )
+		vhd = base + size - 512;
 //	printf("cookie %lx, features %x, version %x, dataOffset %lx, origSize %ld, currentSize %ld, type %d, uuid ",
 //		vhd->cookie, be32toh(vhd->features), be32toh(vhd->version), be64toh(vhd->dataOffset), be64toh(vhd->origSize), be64toh(vhd->currentSize), be32toh(vhd->type));
 //	printUUid(vhd->uuid);
@@ -184,21 +306,37 @@ int main(int argc, char *argv[])
 	}
 	
 	printf("size=%ld\n", diskSize);
+	printf("uuid=");
+	printUUid(vhd->uuid);
+	printf("\n");
 	printf("parentPath=");
 	printUnicode(dyn->parentUnicodeName);
 	printf("\n");
+	if( type == 4 )
+	{
+		printf("parentUuid=");
+		printUUid(dyn->parentUuid);
+		printf("\n");
+	}
 	
 	uint32_t maxTableEntries = be32toh(dyn->maxTableEntries);
 	uint32_t blockSize = be32toh(dyn->blockSize);
 	uint32_t *bat = base + be64toh(dyn->tableOffset);
 	
-	if( argc == 3 )
+	if( argc == 3 || outputMapOnly(&outOpts) )
 	{
-		int out = open(argv[2], O_WRONLY);
+		struct Output out;
+		outputInit(&out, base, size, diskSize);
+		outputSourceFd(&out, fd);
+		outputOpenOptions(&out, &outOpts, argv[2], O_RDWR);
+		outputBlockSize(&out, blockSize);
 		
 		const unsigned bitmapSize = (blockSize / 512 / 8 + 511) / 512 * 512;
 		const unsigned blockFullSize = bitmapSize + blockSize;
 		
+		const uint8_t *batmap = findBatmap(base, size, be64toh(dyn->tableOffset), maxTableEntries, diskSize);
+		unsigned fullBlocks = 0;
+		
 		for(unsigned i = 0; i < maxTableEntries; i++)
 		{
 			if( bat[i] == -1 )
@@ -212,6 +350,16 @@ int main(int argc, char *argv[])
 			}
 			printf("%d: %lu\r", i, blockOffset);
 			
+			// marked full in the batmap, no need to look at the bitmap
+			if( batmap && ( batmap[i / 8] & ( 0x80 >> (i % 8) ) ) )
+			{
+				const uint64_t virtOffset = (uint64_t)i * blockSize;
+				if( virtOffset < diskSize )
+					outputData(&out, virtOffset, blockOffset + bitmapSize, diskSize - virtOffset < blockSize ? diskSize - virtOffset : blockSize);
+				fullBlocks++;
+				continue;
+			}
+			
 			uint8_t *bitmap = base + blockOffset;
 			void *data = bitmap + bitmapSize;
 			unsigned startSec = -1;
@@ -237,8 +385,7 @@ hasData:
 								exit(1);
 							}
 //							printf("startSec %d contSize %d\n", startSec, contSize);
-							const unsigned res = pwrite(out, data + startSec * 512, contSize * 512, (uint64_t)i * blockSize + startSec * 512);
-							assert( res == contSize * 512 );
+							outputData(&out, (uint64_t)i * blockSize + startSec * 512, blockOffset + bitmapSize + startSec * 512, contSize * 512);
 							
 							startSec = sec;
 							contSize = 1;
@@ -260,12 +407,15 @@ hasData:
 					exit(1);
 				}
 //				printf("startSec %d contSize %d\n", startSec, contSize);
-				const unsigned res = pwrite(out, data + startSec * 512, contSize * 512, (uint64_t)i * blockSize + startSec * 512);
-				assert( res == contSize * 512 );
+				outputData(&out, (uint64_t)i * blockSize + startSec * 512, blockOffset + bitmapSize + startSec * 512, contSize * 512);
 			}
 		}
+		if( batmap )
+			fprintf(stderr, "batmap: %u full blocks\n", fullBlocks);
 		printf("\nsyncing\n");
-		fdatasync(out);
+		outputClose(&out);
+		if( isBlock )
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
 	}
 	
 }
@@ -30,13 +30,13 @@
 /*
 compile:
 
-gcc -std=c99 -Wall -Werror -o vhdx vhdx.c
+gcc -std=c99 -Wall -Werror -pthread -o vhdx vhdx.c
+
+with zstd compressed qcow2 output (-O qcow2 -c):
+
+gcc -std=c99 -Wall -Werror -pthread -o vhdx vhdx.c -DHAVE_ZSTD -lzstd
 */
-/*
 #define _GNU_SOURCE 1
-#define _BSD_SOURCE 1
-*/
-#define _DEFAULT_SOURCE 1
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,6 +49,8 @@ gcc -std=c99 -Wall -Werror -o vhdx vhdx.c
 #include <stdbool.h>
 #include <assert.h>
 
+#include "output.h"
+
 uint32_t		crc32Table[256];
 
 // reverse of CRC32C_POLYNOMIAL		0x1edc6f41UL, used for table init
@@ -257,12 +259,77 @@ tooSmall:
 	out[l] = 0;
 }
 
+/*
+ * Write the runs of sectors present in a partially present block. The
+ * sector size is a constant in the two callers below, so each of them
+ * gets a loop with shifts and masks instead of divisions.
+ */
+static inline __attribute__((always_inline)) void outputBitmap(struct Output *out, const uint8_t *bitmap,
+	unsigned sectorShift, uint32_t blockSize, uint64_t virtualOffset, uint64_t dataOffset)
+{
+	const unsigned sectors = blockSize >> sectorShift;
+	unsigned sec = 0;
+	
+	while( sec < sectors )
+	{
+		// skip whole empty bytes
+		if( !( sec & 7 ) && !bitmap[sec >> 3] )
+		{
+			sec += 8;
+			continue;
+		}
+		if( !( bitmap[sec >> 3] & ( 1 << ( sec & 7 ) ) ) )
+		{
+			sec++;
+			continue;
+		}
+		
+		unsigned end = sec + 1;
+		while( end < sectors )
+		{
+			if( !( end & 7 ) && bitmap[end >> 3] == 0xff )
+				end += 8;
+			else if( bitmap[end >> 3] & ( 1 << ( end & 7 ) ) )
+				end++;
+			else
+				break;
+		}
+		if( end > sectors )
+			end = sectors;
+		
+		outputData(out, virtualOffset + ( (uint64_t)sec << sectorShift ), dataOffset + ( (uint64_t)sec << sectorShift ), (uint64_t)( end - sec ) << sectorShift);
+		sec = end;
+	}
+}
+
+static void outputBitmap512(struct Output *out, const uint8_t *bitmap, uint32_t blockSize, uint64_t virtualOffset, uint64_t dataOffset)
+{
+	outputBitmap(out, bitmap, 9, blockSize, virtualOffset, dataOffset);
+}
+
+static void outputBitmap4096(struct Output *out, const uint8_t *bitmap, uint32_t blockSize, uint64_t virtualOffset, uint64_t dataOffset)
+{
+	outputBitmap(out, bitmap, 12, blockSize, virtualOffset, dataOffset);
+}
+
 int main(int argc, char *argv[])
 {
 	initCrc32();
+	
+	struct OutputOptions outOpts = {};
+	int opt;
+	while( (opt = getopt_long(argc, argv, OUTPUT_OPTIONS, outputLongOptions, NULL)) != -1 )
+	{
+		if( !outputOption(&outOpts, opt, optarg) )
+			goto usage;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	
 	if( argc != 2 && argc != 3 )
 	{
-		fprintf(stderr, "usage: %s: file.vhd [output.raw]\n", argv[0]);
+usage:
+		fprintf(stderr, "usage: %s: " OUTPUT_USAGE " file.vhdx [output.raw|output.qcow2]\n", argv[0]);
 		exit(1);
 	}
 	
@@ -379,6 +446,7 @@ int main(int argc, char *argv[])
 	}
 	
 	uint32_t		blockSize = -1;
+	uint32_t		logicalSectorSize = 512;
 	uint64_t		virtualDiskSize = -1ul;
 	bool			hasParent;
 	
@@ -421,11 +489,12 @@ int main(int argc, char *argv[])
 		{
 			assert( metadata->entries[i].length == 4 );
 			const uint32_t ss = *(uint32_t*)(metaBase + metadata->entries[i].offset);
-			if( ss != 512 )
+			if( ss != 512 && ss != 4096 )
 			{
 				fprintf(stderr, "unsupported virtual sector size %d\n", ss);
 				exit(1);
 			}
+			logicalSectorSize = ss;
 		}
 		else if( memcmp(metadata->entries[i].itemId, physicalSectorSizeGuid, 16) == 0 )
 		{
@@ -547,6 +616,13 @@ invalidLinkage:
 		exit(1);
 	}
 	
+	// checked before the output is opened, which may create or truncate it
+	if( virtualDiskSize % logicalSectorSize || blockSize % (logicalSectorSize * 8) )
+	{
+		fprintf(stderr, "virtual size or block size not a multiple of the sector size\n");
+		exit(1);
+	}
+	
 	if( hasParent )
 	{
 		if( !gotParentPath || !gotParentGuid || !gotParentVolumePath )
@@ -556,7 +632,7 @@ invalidLinkage:
 		}
 	}
 	
-	if( argc == 2 )
+	if( argc == 2 && !outputMapOnly(&outOpts) )
 	{
 		printf("virtualSize=%ld\n", virtualDiskSize);
 		printf("dataGuid=");
@@ -574,14 +650,14 @@ invalidLinkage:
 	}
 	
 	{
-		int out = open(argv[2], O_WRONLY);
-		if( out == -1 )
-		{
-			perror("open");
-			exit(1);
-		}
+		struct Output out;
+		outputInit(&out, base, size, virtualDiskSize);
+		outputSourceFd(&out, fd);
+		outputOpenOptions(&out, &outOpts, argv[2], O_RDWR);
+		outputBlockSize(&out, blockSize);
 		
-		const unsigned chunkRatio = (1ull << 23) * 512 / blockSize;
+		// blocks covered by one sector bitmap block: 2^23 sectors
+		const unsigned chunkRatio = (1ull << 23) * logicalSectorSize / blockSize;
 		
 		struct VhdxBatEntry *bat = base + batReg->fileOffset;
 		
@@ -600,6 +676,9 @@ invalidLinkage:
 				continue;
 			}
 			
+			// the last block may be cut short by the virtual size
+			const uint64_t len = virtualDiskSize - virtualOffset < blockSize ? virtualDiskSize - virtualOffset : blockSize;
+			
 			switch( bat[batId].state )
 			{
 				case 0:
@@ -609,64 +688,24 @@ invalidLinkage:
 					break;
 				
 				case 6:
-					{
-						const unsigned res = pwrite(out, base + bat[batId].offsetMB * 1024ull*1024, blockSize, virtualOffset);
-						assert( res == blockSize );
-					}
+					outputData(&out, virtualOffset, bat[batId].offsetMB * 1024ull*1024, len);
 					break;
 				
 				case 7:
 					{
 						assert( bat[nextBmapId].state == 6 );
-						uint8_t *bitmap = base + bat[nextBmapId].offsetMB * 1024ull*1024 + entriesFromLastBmap * blockSize / 512 / 8;
-						
-						void *data = base + bat[batId].offsetMB * 1024ull*1024;
-						unsigned startSec = -1;
-						unsigned contSize = 0;
-						
-						for(unsigned sec = 0; sec < blockSize / 512; sec++)
+						const uint64_t bitmapOffset = bat[nextBmapId].offsetMB * 1024ull*1024 + entriesFromLastBmap * (blockSize / logicalSectorSize / 8);
+						const uint64_t dataOffset = bat[batId].offsetMB * 1024ull*1024;
+						if( bitmapOffset + blockSize / logicalSectorSize / 8 > size || dataOffset + blockSize > size )
 						{
-							const unsigned byteOffset = sec / 8;
-							const unsigned bitOffset = sec % 8;
-							
-							if( bitmap[byteOffset] & ( 1 << bitOffset ) )
-							{
-								if( startSec != -1 )
-								{
-									if( startSec + contSize == sec )
-										contSize++;
-									else
-									{
-										if( (uintptr_t)data - (uintptr_t)base + startSec * 512  + contSize * 512 > size )
-										{
-											fprintf(stderr, "invalid table\n");
-											exit(1);
-										}
-										const unsigned res = pwrite(out, data + startSec * 512, contSize * 512, virtualOffset + startSec * 512);
-										assert( res == contSize * 512 );
-										
-										startSec = sec;
-										contSize = 1;
-									}
-								}
-								else
-								{
-									startSec = sec;
-									contSize = 1;
-								}
-							}
+							fprintf(stderr, "invalid table\n");
+							exit(1);
 						}
 						
-						if( contSize )
-						{
-							if( (uintptr_t)data - (uintptr_t)base + startSec * 512 + contSize * 512 > size )
-							{
-								fprintf(stderr, "invalid table\n");
-								exit(1);
-							}
-							const unsigned res = pwrite(out, data + startSec * 512, contSize * 512, virtualOffset + startSec * 512);
-							assert( res == contSize * 512 );
-						}
+						if( logicalSectorSize == 512 )
+							outputBitmap512(&out, base + bitmapOffset, len, virtualOffset, dataOffset);
+						else
+							outputBitmap4096(&out, base + bitmapOffset, len, virtualOffset, dataOffset);
 					}
 					break;
 			}
@@ -677,7 +716,7 @@ invalidLinkage:
 		}
 		
 		printf("\nsyncing\n");
-		fdatasync(out);
+		outputClose(&out);
 	}
 }
 
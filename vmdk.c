@@ -0,0 +1,350 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+compile:
+
+gcc -std=c99 -Wall -Werror -pthread -o vmdk vmdk.c -lz
+
+with zstd compressed qcow2 output (-O qcow2 -c):
+
+gcc -std=c99 -Wall -Werror -pthread -o vmdk vmdk.c -lz -DHAVE_ZSTD -lzstd
+*/
+
+/*
+ * Hosted sparse VMDK (KDMV): monolithicSparse and streamOptimized, the
+ * latter being what OVA/OVF exports contain.
+ *
+ * The grains of a streamOptimized image are deflated. They are collected
+ * in batches in virtual order, each batch is inflated by a set of threads
+ * while the previous one is being written.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "output.h"
+#include "batch.h"
+#include "vmware.h"
+
+#define GD_AT_END				0xffffffffffffffffull
+#define GTE_ZERO				1
+
+#define MARKER_EOS				0
+#define MARKER_GT				1
+#define MARKER_GD				2
+#define MARKER_FOOTER			3
+
+#define BATCH_SIZE				(32 * 1024 * 1024)
+
+struct GrainMarker
+{
+	uint64_t lba;
+	uint32_t size;
+	uint8_t data[];
+} __attribute__((packed));
+
+struct Grain
+{
+	uint64_t		virtOffset;
+	uint64_t		fileOffset;
+	uint32_t		len;
+	bool			zero;
+};
+
+static const uint8_t *image;
+static uint64_t imageSize;
+static uint64_t grainBytes;
+static unsigned threadsCount;
+static bool markers;
+static bool hasParent;
+
+static void inflateGrain(const void *item, uint8_t *dst)
+{
+	const struct Grain *g = item;
+	if( g->zero )
+		return;
+
+	// with markers the grain starts with its lba and compressed size
+	const uint8_t *data = image + g->fileOffset;
+	uLong dataLen = imageSize - g->fileOffset;
+	if( g->fileOffset >= imageSize )
+		dataLen = 0;
+	if( markers )
+	{
+		const struct GrainMarker *m = (const void *)data;
+		if( dataLen < sizeof(*m) || dataLen - sizeof(*m) < m->size )
+		{
+			fprintf(stderr, "grain at %" PRIu64 " is beyond the end of the image\n", g->fileOffset);
+			exit(1);
+		}
+		if( m->lba * 512 != g->virtOffset )
+		{
+			fprintf(stderr, "grain at %" PRIu64 " has lba %" PRIu64 ", expected %" PRIu64 "\n",
+				g->fileOffset, m->lba, g->virtOffset / 512);
+			exit(1);
+		}
+		data = m->data;
+		dataLen = m->size;
+	}
+
+	uLongf len = grainBytes;
+	const int res = uncompress2(dst, &len, data, &dataLen);
+	if( res != Z_OK || len < g->len )
+	{
+		fprintf(stderr, "grain at %" PRIu64 ": inflate failed (%d)\n", g->fileOffset, res);
+		exit(1);
+	}
+}
+
+static void writeGrain(struct Output *out, const void *item, const uint8_t *data)
+{
+	const struct Grain *g = item;
+	if( !g->zero )
+		outputBuffer(out, g->virtOffset, data, g->len);
+	else if( hasParent )
+		outputZero(out, g->virtOffset, g->len);
+}
+
+/*
+ * The grain tables of grain directory entry "i", from the primary grain
+ * directory if it's sane, from the redundant one otherwise. NULL if the
+ * entry is empty.
+ */
+static const uint32_t *grainTable(const struct SparseExtentHeader *hdr, uint64_t i)
+{
+	const uint64_t gtBytes = hdr->numGTEsPerGT * 4ull;
+	const uint64_t gdOffsets[2] = { hdr->gdOffset, ( hdr->flags & SPARSEFLAG_USE_REDUNDANT ) ? hdr->rgdOffset : 0 };
+
+	for(int r = 0; r < 2; r++)
+	{
+		if( !gdOffsets[r] || gdOffsets[r] * 512 + (i + 1) * 4 > imageSize )
+			continue;
+
+		const uint32_t gte = ((const uint32_t *)(image + gdOffsets[r] * 512))[i];
+		if( !gte )
+			return NULL;
+		if( gte * 512ull + gtBytes <= imageSize )
+		{
+			if( r )
+				fprintf(stderr, "grain directory entry %" PRIu64 " is invalid, using the redundant one\n", i);
+			return (const uint32_t *)(image + gte * 512ull);
+		}
+	}
+
+	fprintf(stderr, "grain directory entry %" PRIu64 " is invalid\n", i);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct OutputOptions outOpts = {};
+	threadsCount = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while( (opt = getopt_long(argc, argv, OUTPUT_OPTIONS "j:", outputLongOptions, NULL)) != -1 )
+	{
+		if( opt == 'j' )
+			threadsCount = atoi(optarg);
+		else if( !outputOption(&outOpts, opt, optarg) )
+			goto usage;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if( ( argc != 2 && argc != 3 ) || !threadsCount )
+	{
+usage:
+		fprintf(stderr, "usage: %s: [-j threads] " OUTPUT_USAGE " file.vmdk [output.raw|output.qcow2]\n", argv[0]);
+		exit(1);
+	}
+
+	const int fd = open(argv[1], O_RDONLY);
+	if( fd == -1 )
+	{
+		perror("open");
+		exit(1);
+	}
+
+	imageSize = lseek(fd, 0, SEEK_END);
+	image = mmap(NULL, imageSize, PROT_READ, MAP_SHARED, fd, 0);
+	if( imageSize < 512 || image == MAP_FAILED )
+	{
+		fprintf(stderr, "%s: not a sparse VMDK extent\n", argv[1]);
+		exit(1);
+	}
+
+	const struct SparseExtentHeader *hdr = (const void *)image;
+	if( hdr->magicNumber != SPARSE_MAGIC )
+	{
+		fprintf(stderr, "invalid magic, only monolithicSparse and streamOptimized extents are supported\n");
+		exit(1);
+	}
+
+	// streamOptimized: the real header is in the footer, before the end-of-stream marker
+	if( hdr->gdOffset == GD_AT_END )
+	{
+		if( imageSize < 512 * 4 )
+		{
+			fprintf(stderr, "truncated image\n");
+			exit(1);
+		}
+		hdr = (const void *)(image + imageSize - 1024);
+		if( hdr->magicNumber != SPARSE_MAGIC || hdr->gdOffset == GD_AT_END )
+		{
+			fprintf(stderr, "invalid footer\n");
+			exit(1);
+		}
+	}
+
+	if( hdr->version < 1 || hdr->version > 3 )
+	{
+		fprintf(stderr, "unsupported version %u\n", hdr->version);
+		exit(1);
+	}
+
+	const bool compressed = hdr->flags & SPARSEFLAG_COMPRESSED;
+	markers = hdr->flags & SPARSEFLAG_EMBEDDED_LBA;
+	if( compressed && hdr->compressAlgorithm != 1 )
+	{
+		fprintf(stderr, "unsupported compression %u\n", hdr->compressAlgorithm);
+		exit(1);
+	}
+
+	grainBytes = hdr->grainSize * 512;
+	if( !hdr->grainSize || ( hdr->grainSize & (hdr->grainSize - 1) ) || grainBytes > BATCH_SIZE ||
+		!hdr->numGTEsPerGT )
+	{
+		fprintf(stderr, "unsupported grainSize %" PRIu64 "\n", hdr->grainSize);
+		exit(1);
+	}
+
+	const uint64_t virtualSize = hdr->capacity * 512;
+	const uint64_t gtCoverage = hdr->numGTEsPerGT * grainBytes;
+	const uint64_t gdEntries = (virtualSize + gtCoverage - 1) / gtCoverage;
+
+	char *desc = NULL, *parent = NULL, *cid = NULL, *parentCid = NULL, *createType = NULL;
+	if( hdr->descriptorOffset && ( hdr->descriptorOffset + hdr->descriptorSize ) * 512 <= imageSize )
+	{
+		desc = (char *)image + hdr->descriptorOffset * 512;
+		const uint64_t descLen = strnlen(desc, hdr->descriptorSize * 512);
+		parent = descriptorValue(desc, descLen, "parentFileNameHint");
+		cid = descriptorValue(desc, descLen, "CID");
+		parentCid = descriptorValue(desc, descLen, "parentCID");
+		createType = descriptorValue(desc, descLen, "createType");
+	}
+	hasParent = parent && parentCid && strcasecmp(parentCid, "ffffffff") != 0;
+
+	if( argc == 2 && !outputMapOnly(&outOpts) )
+	{
+		printf("virtualSize=%" PRIu64 "\n", virtualSize);
+		if( createType )
+			printf("createType=%s\n", createType);
+		if( cid )
+			printf("cid=%s\n", cid);
+		if( hasParent )
+		{
+			printf("parentCid=%s\n", parentCid);
+			printf("parentPath=%s\n", parent);
+		}
+		exit(0);
+	}
+
+	if( compressed && ( outOpts.mapPath || outOpts.jsonPath ) )
+	{
+		fprintf(stderr, "the grains are compressed, an extent map of this image can't be made\n");
+		exit(1);
+	}
+
+	struct Output out;
+	outputInit(&out, image, imageSize, virtualSize);
+	outputSourceFd(&out, fd);
+	outputOpenOptions(&out, &outOpts, argv[2], O_RDWR | O_DIRECT);
+
+	// two batches: one being inflated while the other is written
+	struct BatchPipeline pipeline;
+	if( compressed && !outOpts.dryRun )
+		batchInit(&pipeline, &out, sizeof(struct Grain), BATCH_SIZE / grainBytes, grainBytes, threadsCount, inflateGrain, writeGrain);
+
+	uint64_t grains = 0;
+	for(uint64_t i = 0; i < gdEntries; i++)
+	{
+		const uint32_t *gt = grainTable(hdr, i);
+		if( !gt )
+			continue;
+
+		for(unsigned j = 0; j < hdr->numGTEsPerGT; j++)
+		{
+			const uint32_t gte = gt[j];
+			const uint64_t virtOffset = i * gtCoverage + j * grainBytes;
+			if( !gte || virtOffset >= virtualSize )
+				continue;
+
+			const uint32_t len = virtualSize - virtOffset < grainBytes ? virtualSize - virtOffset : grainBytes;
+			grains++;
+
+			// a dry run only counts the compressed grains
+			if( !compressed || outOpts.dryRun )
+			{
+				if( gte == GTE_ZERO )
+				{
+					if( hasParent )
+						outputZero(&out, virtOffset, len);
+				}
+				else if( compressed )
+					outputBuffer(&out, virtOffset, NULL, len);
+				else
+					outputData(&out, virtOffset, gte * 512ull, len);
+				continue;
+			}
+
+			const struct Grain g = { virtOffset, gte * 512ull, len, gte == GTE_ZERO };
+			batchAdd(&pipeline, &g);
+		}
+	}
+
+	if( compressed && !outOpts.dryRun )
+		batchFinish(&pipeline);
+
+	printf("%" PRIu64 " grains\n", grains);
+	printf("syncing\n");
+	outputClose(&out);
+	printf("Done.\n");
+
+	return 0;
+}
@@ -30,7 +30,11 @@
 /*
 compile:
 
-gcc -std=c99 -o vmfssparse vmfssparse.c
+gcc -std=c99 -pthread -o vmfssparse vmfssparse.c
+
+with zstd compressed qcow2 output (-O qcow2 -c):
+
+gcc -std=c99 -pthread -o vmfssparse vmfssparse.c -DHAVE_ZSTD -lzstd
 */
 
 #define _GNU_SOURCE 1
@@ -43,61 +47,36 @@ gcc -std=c99 -o vmfssparse vmfssparse.c
 #include <sys/mman.h>
 #include <unistd.h>
 
-#define COWDISK_MAX_PARENT_FILELEN 1024
-#define COWDISK_MAX_NAME_LEN 60
-#define COWDISK_MAX_DESC_LEN 512
+#include "output.h"
+#include "vmware.h"
 
 #define GRAINS_PER_TABLE 4096
 #define GRAIN_SIZE 512
 
-struct COWDisk_Header
-{
-	uint32_t magicNumber;  // 0x44574f43
-	uint32_t version;	// 1
-	uint32_t flags;		// 3
-	uint32_t numSectors;	// 0x0ca00000
-	uint32_t grainSize;	// 1
-	uint32_t gdOffset;	// 4
-	uint32_t numGDEntries;	// 0xca00  (numSectors / 4k)
-	uint32_t freeSector;
-	union {
-		struct {
-			uint32_t cylinders;
-			uint32_t heads;
-			uint32_t sectors;
-		} root;
-		struct {
-			char parentFileName[COWDISK_MAX_PARENT_FILELEN];
-			uint32_t parentGeneration;
-		} child;
-	} u;
-	uint32_t generation;
-	char name[COWDISK_MAX_NAME_LEN];
-	char description[COWDISK_MAX_DESC_LEN];
-	uint32_t savedGeneration;
-	char reserved[8];
-	uint32_t uncleanShutdown;
-	char padding[396];
-} __attribute__((packed));
 
 
 int main(int argc, char *argv[])
 {
-	if( argc != 3 )
+	struct OutputOptions outOpts = {};
+	int opt;
+	while( (opt = getopt_long(argc, argv, OUTPUT_OPTIONS, outputLongOptions, NULL)) != -1 )
 	{
-		fprintf(stderr, "usage: %s /path/to/sparse.vmdk /dev/storpool/targetVolume\n", argv[0]);
-		exit(1);
+		if( !outputOption(&outOpts, opt, optarg) )
+			goto usage;
 	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
-	const int fd = open(argv[1], O_RDONLY);
-	if( fd == -1 )
+	if( argc != 3 && !( argc == 2 && outputMapOnly(&outOpts) ) )
 	{
-		perror("open");
+usage:
+		fprintf(stderr, "usage: %s [-O qcow2 [-B backing] [-c]] [--explain] [--calibrate] /path/to/sparse.vmdk /dev/storpool/targetVolume\n", argv[0]);
+		fprintf(stderr, "       %s -m extents.map /path/to/sparse.vmdk\n", argv[0]);
 		exit(1);
 	}
 
-	const int ofd = open(argv[2], O_RDWR | O_DIRECT);
-	if( ofd == -1 )
+	const int fd = open(argv[1], O_RDONLY);
+	if( fd == -1 )
 	{
 		perror("open");
 		exit(1);
@@ -136,11 +115,10 @@ int main(int argc, char *argv[])
 	const uint32_t *gDir = (void *) hdr + hdr->gdOffset * 512;
 	printf("Number of tables: %u\n", hdr->numGDEntries);
 
-
-	uint64_t lastAddr = 0;
-	const unsigned iovecSize = 32 * 8;
-	struct iovec iovec[iovecSize];
-	unsigned iovecPtr = 0;
+	struct Output out;
+	outputInit(&out, ptr, size, hdr->numSectors * 512ull);
+	outputSourceFd(&out, fd);
+	outputOpenOptions(&out, &outOpts, argv[2], O_RDWR | O_DIRECT);
 
 	for(unsigned i=0; i < hdr->numGDEntries; i++ )
 	{
@@ -156,29 +134,10 @@ int main(int argc, char *argv[])
 				const uint32_t grain = tbl[j];
 				if (grain > 0)
 				{
-					const void *rdPtr = ptr + grain * 512ul;;
 					const uint64_t wrOffset = (i * GRAINS_PER_TABLE + j) * 512ul;
 					//printf("Grain[%4u] = %lu\n", j, grain * 512ul);
 
-
-					if( iovecPtr && (lastAddr != wrOffset || iovecPtr == iovecSize) )
-					{
-						const ssize_t res = pwritev(ofd, iovec, iovecPtr, lastAddr - iovecPtr * 512 );
-						if( res != iovecPtr * 512)
-						{
-							if( res < 0 )
-								perror("pwrite");
-							else
-								abort();
-							exit(1);
-						}
-						iovecPtr = 0;
-					}
-					iovec[iovecPtr].iov_base = (void *)rdPtr;
-					iovec[iovecPtr].iov_len = 512;
-					lastAddr = wrOffset + 512;
-					iovecPtr++;
-
+					outputData(&out, wrOffset, grain * 512ul, 512);
 				}
 
 			}
@@ -186,18 +145,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if( iovecPtr )
-	{
-		const ssize_t res = pwritev(ofd, iovec, iovecPtr, lastAddr - iovecPtr * 512 );
-		if( res != iovecPtr * 512)
-		{
-			if( res < 0 )
-				perror("pwrite");
-			else
-				abort();
-			exit(1);
-		}
-	}
+	outputClose(&out);
 
 	printf("Done.");
 }
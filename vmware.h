@@ -0,0 +1,178 @@
+/*-
+ * Copyright (c) 2020  StorPool.
+ * All rights reserved.
+ */
+
+/*
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * VMware on-disk structures shared by the converters and any2kvm: the
+ * hosted sparse (KDMV) and VMFS sparse (COWD) headers, and the text
+ * descriptor.
+ */
+
+#ifndef VMWARE_H
+#define VMWARE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define SPARSE_MAGIC			0x564d444b	// "KDMV"
+
+#define SPARSEFLAG_VALID_NEWLINE_DETECTOR	(1u << 0)
+#define SPARSEFLAG_USE_REDUNDANT			(1u << 1)
+#define SPARSEFLAG_COMPRESSED				(1u << 16)
+#define SPARSEFLAG_EMBEDDED_LBA				(1u << 17)
+
+#define COWD_MAGIC				0x44574f43	// "COWD"
+
+#define COWDISK_MAX_PARENT_FILELEN 1024
+#define COWDISK_MAX_NAME_LEN 60
+#define COWDISK_MAX_DESC_LEN 512
+
+struct SparseExtentHeader
+{
+	uint32_t magicNumber;
+	uint32_t version;
+	uint32_t flags;
+	uint64_t capacity;
+	uint64_t grainSize;
+	uint64_t descriptorOffset;
+	uint64_t descriptorSize;
+	uint32_t numGTEsPerGT;
+	uint64_t rgdOffset;
+	uint64_t gdOffset;
+	uint64_t overHead;
+	uint8_t uncleanShutdown;
+	char singleEndLineChar;
+	char nonEndLineChar;
+	char doubleEndLineChar1;
+	char doubleEndLineChar2;
+	uint16_t compressAlgorithm;
+	uint8_t pad[433];
+} __attribute__((packed));
+
+struct COWDisk_Header
+{
+	uint32_t magicNumber;  // 0x44574f43
+	uint32_t version;	// 1
+	uint32_t flags;		// 3
+	uint32_t numSectors;	// 0x0ca00000
+	uint32_t grainSize;	// 1
+	uint32_t gdOffset;	// 4
+	uint32_t numGDEntries;	// 0xca00  (numSectors / 4k)
+	uint32_t freeSector;
+	union {
+		struct {
+			uint32_t cylinders;
+			uint32_t heads;
+			uint32_t sectors;
+		} root;
+		struct {
+			char parentFileName[COWDISK_MAX_PARENT_FILELEN];
+			uint32_t parentGeneration;
+		} child;
+	} u;
+	uint32_t generation;
+	char name[COWDISK_MAX_NAME_LEN];
+	char description[COWDISK_MAX_DESC_LEN];
+	uint32_t savedGeneration;
+	char reserved[8];
+	uint32_t uncleanShutdown;
+	char padding[396];
+} __attribute__((packed));
+
+/*
+ * Value of "key" in the text descriptor, NULL if it isn't there.
+ */
+static inline char *descriptorValue(const char *desc, uint64_t descLen, const char *key)
+{
+	const size_t keyLen = strlen(key);
+	const char *end = desc + descLen;
+	for(const char *line = desc; line < end; )
+	{
+		const char *eol = memchr(line, '\n', end - line);
+		if( !eol )
+			eol = end;
+
+		const char *p = line;
+		while( p < eol && ( *p == ' ' || *p == '\t' ) )
+			p++;
+		if( eol - p > keyLen && memcmp(p, key, keyLen) == 0 )
+		{
+			p += keyLen;
+			while( p < eol && ( *p == ' ' || *p == '\t' ) )
+				p++;
+			if( p < eol && *p == '=' )
+			{
+				p++;
+				while( p < eol && ( *p == ' ' || *p == '\t' || *p == '"' ) )
+					p++;
+				const char *q = eol;
+				while( q > p && ( q[-1] == '\r' || q[-1] == ' ' || q[-1] == '"' ) )
+					q--;
+				return strndup(p, q - p);
+			}
+		}
+		line = eol + 1;
+	}
+	return NULL;
+}
+
+/*
+ * The file name of the first extent in the text descriptor, e.g.
+ * "disk-flat.vmdk" in
+ *   RW 41943040 VMFS "disk-flat.vmdk"
+ * NULL if there is none.
+ */
+static inline char *descriptorExtentFile(const char *desc, uint64_t descLen)
+{
+	const char *end = desc + descLen;
+	for(const char *line = desc; line < end; )
+	{
+		const char *eol = memchr(line, '\n', end - line);
+		if( !eol )
+			eol = end;
+
+		const char *p = line;
+		while( p < eol && ( *p == ' ' || *p == '\t' ) )
+			p++;
+		if( ( eol - p > 3 && ( memcmp(p, "RW ", 3) == 0 ) ) ||
+			( eol - p > 7 && ( memcmp(p, "RDONLY ", 7) == 0 ) ) )
+		{
+			const char *q = memchr(p, '"', eol - p);
+			const char *qEnd = q ? memchr(q + 1, '"', eol - q - 1) : NULL;
+			if( qEnd )
+				return strndup(q + 1, qEnd - q - 1);
+		}
+		line = eol + 1;
+	}
+	return NULL;
+}
+
+#endif